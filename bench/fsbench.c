@@ -0,0 +1,523 @@
+/*
+ * fsbench - generate reproducible old/new trees and time fsdiff, fspatch,
+ * bsdiff and bspatch against them.  One JSON object per line on stdout.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifndef BUILD_CFLAGS
+#define BUILD_CFLAGS "unknown"
+#endif
+
+static const char *bindir = ".";
+static const char *workdir = "/tmp/fsbench";
+static char *fsdiff_args;
+static char *bsdiff_args;
+static int scale = 1;
+static int keep;
+
+/* xorshift64*, so every run generates the same trees */
+static uint64_t rng;
+
+static uint64_t rnd(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 2685821657736338717ULL;
+}
+
+static const char *words[] = {
+	"static", "int", "return", "struct", "if", "else", "for", "while",
+	"char", "void", "const", "unsigned", "size_t", "buf", "len", "ret",
+	"err", "fd", "NULL", "free", "malloc", "memcpy", "off_t", "path",
+};
+
+/* Files the generator changed, for the per-file bsdiff runs */
+#define MAXCHANGED 32
+static char changed[MAXCHANGED][PATH_MAX];
+static int nchanged;
+
+static void note_changed(const char *name)
+{
+	if(nchanged < MAXCHANGED)
+		snprintf(changed[nchanged++], PATH_MAX, "%s", name);
+}
+
+static void mkdirs(const char *fmt, ...)
+{
+	char path[PATH_MAX], *p;
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(path, sizeof(path), fmt, ap);
+	va_end(ap);
+	for(p = path + 1; *p; p++) {
+		if(*p != '/')
+			continue;
+		*p = 0;
+		mkdir(path, 0755);
+		*p = '/';
+	}
+	mkdir(path, 0755);
+}
+
+static void writefile(const char *path, const char *buf, size_t len)
+{
+	FILE *f;
+
+	if((f = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	if(len && fwrite(buf, len, 1, f) != 1)
+		err(1, "%s", path);
+	if(fclose(f))
+		err(1, "%s", path);
+}
+
+static char *readfile(const char *path, size_t *len)
+{
+	FILE *f;
+	char *buf;
+	struct stat sb;
+
+	if((f = fopen(path, "r")) == NULL || fstat(fileno(f), &sb))
+		err(1, "%s", path);
+	if((buf = malloc(sb.st_size + 1)) == NULL)
+		err(1, NULL);
+	if(sb.st_size && fread(buf, sb.st_size, 1, f) != 1)
+		err(1, "%s", path);
+	fclose(f);
+	*len = sb.st_size;
+	return buf;
+}
+
+static size_t gentext(char *buf, size_t len)
+{
+	size_t n = 0;
+	int col = 0;
+
+	while(n < len) {
+		const char *w = words[rnd() % (sizeof(words) / sizeof(words[0]))];
+		size_t wl = strlen(w);
+		if(n + wl + 1 > len)
+			break;
+		memcpy(buf + n, w, wl);
+		n += wl;
+		col += wl + 1;
+		buf[n++] = (col > 60 || rnd() % 8 == 0) ? '\n' : ' ';
+		if(buf[n - 1] == '\n')
+			col = 0;
+	}
+	return n;
+}
+
+/* Code-like binary: runs of instructions with embedded addresses */
+static void genbinary(unsigned char *buf, size_t len)
+{
+	size_t i;
+	uint32_t addr = 0x400000;
+
+	for(i = 0; i + 8 <= len; i += 8) {
+		uint64_t r = rnd();
+		buf[i] = 0xe8 + (r & 3);
+		buf[i + 1] = r >> 8;
+		buf[i + 2] = r >> 16 & 0x0f;
+		buf[i + 3] = 0x48;
+		memcpy(buf + i + 4, &addr, 4);
+		addr += (r >> 24) & 0xff;
+	}
+	for(; i < len; i++)
+		buf[i] = rnd();
+}
+
+static void gen_src_edit(const char *o, const char *n)
+{
+	char path[PATH_MAX], buf[20000];
+	int d, f, files = 40 * scale;
+	size_t len;
+
+	for(d = 0; d < 10; d++) {
+		mkdirs("%s/src/d%d", o, d);
+		mkdirs("%s/src/d%d", n, d);
+		for(f = 0; f < files; f++) {
+			int r = rnd() % 100;
+			len = gentext(buf, 2000 + rnd() % 18000);
+			if(r >= 5) {
+				snprintf(path, sizeof(path), "%s/src/d%d/f%d.c", o, d, f);
+				writefile(path, buf, len);
+			}
+			if(r < 10 && r >= 5)
+				continue;		/* deleted */
+			if(r >= 10 && r < 20) {		/* small edit */
+				size_t at = rnd() % (len - 100);
+				memcpy(buf + at, "edited", 6);
+				snprintf(path, sizeof(path), "src/d%d/f%d.c", d, f);
+				note_changed(path);
+			}
+			snprintf(path, sizeof(path), "%s/src/d%d/f%d.c", n, d, f);
+			writefile(path, buf, len);
+		}
+	}
+}
+
+static void gen_append_log(const char *o, const char *n)
+{
+	char path[PATH_MAX];
+	size_t len = 8 * 1024 * 1024 * (size_t)scale, l1, l2;
+	char *buf = malloc(len + len / 10);
+
+	l1 = gentext(buf, len);
+	snprintf(path, sizeof(path), "%s/app.log", o);
+	writefile(path, buf, l1);
+	l2 = l1 + gentext(buf + l1, len / 10);
+	snprintf(path, sizeof(path), "%s/app.log", n);
+	writefile(path, buf, l2);
+	note_changed("app.log");
+	free(buf);
+}
+
+static void gen_shifted_bin(const char *o, const char *n)
+{
+	char path[PATH_MAX];
+	size_t len = 8 * 1024 * 1024 * (size_t)scale, i;
+	unsigned char *old = malloc(len), *new = malloc(len + 4096);
+
+	genbinary(old, len);
+	snprintf(path, sizeof(path), "%s/prog", o);
+	writefile(path, (char *)old, len);
+
+	/* 4k of new code early on shifts everything after it, and the
+	   addresses that point past it all change */
+	memcpy(new, old, len / 10);
+	genbinary(new + len / 10, 4096);
+	memcpy(new + len / 10 + 4096, old + len / 10, len - len / 10);
+	for(i = len / 10 + 4096 + 4; i + 4 <= len + 4096; i += 4096)
+		new[i] += 0x10;
+	snprintf(path, sizeof(path), "%s/prog", n);
+	writefile(path, (char *)new, len + 4096);
+	note_changed("prog");
+	free(old);
+	free(new);
+}
+
+static void gen_zero_image(const char *o, const char *n)
+{
+	char path[PATH_MAX];
+	size_t len = 1024 * 1024 * (size_t)scale, i;
+	unsigned char *buf = calloc(1, len);
+
+	for(i = 0; i < len / 65536 / 100 + 1; i++)
+		genbinary(buf + (rnd() % (len / 65536)) * 65536, 65536);
+	snprintf(path, sizeof(path), "%s/disk.img", o);
+	writefile(path, (char *)buf, len);
+	for(i = 0; i < 8; i++)
+		genbinary(buf + (rnd() % (len / 4096)) * 4096, 4096);
+	snprintf(path, sizeof(path), "%s/disk.img", n);
+	writefile(path, (char *)buf, len);
+	note_changed("disk.img");
+	free(buf);
+}
+
+static void gen_renames(const char *o, const char *n)
+{
+	char path[PATH_MAX], buf[50000];
+	int f;
+	size_t len;
+
+	mkdirs("%s/a", o);
+	mkdirs("%s/a", n);
+	mkdirs("%s/b", n);
+	for(f = 0; f < 50 * scale; f++) {
+		len = gentext(buf, sizeof(buf));
+		snprintf(path, sizeof(path), "%s/a/file%d", o, f);
+		writefile(path, buf, len);
+		snprintf(path, sizeof(path), "%s/%s/file%d", n,
+				f % 2 ? "b" : "a", f);
+		writefile(path, buf, len);
+	}
+}
+
+/* Names of one inode in the new tree, among them names inside added
+ * directories that the walk reaches after the name it registers */
+static const char *linkgroups[][5] = {
+	{ "x", "d/f", "d/g", "z", NULL },
+	{ "e/h", "e/i", "w", NULL },
+};
+
+static void gen_hardlinks(const char *o, const char *n)
+{
+	char path[PATH_MAX], first[PATH_MAX], buf[50000];
+	size_t g, i, len;
+
+	len = gentext(buf, sizeof(buf));
+	snprintf(path, sizeof(path), "%s/x", o);
+	writefile(path, buf, len);
+	mkdirs("%s/d", n);
+	mkdirs("%s/e", n);
+	for(g = 0; g < sizeof(linkgroups) / sizeof(*linkgroups); g++) {
+		len = gentext(buf, sizeof(buf));
+		snprintf(first, sizeof(first), "%s/%s", n, linkgroups[g][0]);
+		writefile(first, buf, len);
+		for(i = 1; linkgroups[g][i]; i++) {
+			snprintf(path, sizeof(path), "%s/%s", n, linkgroups[g][i]);
+			if(link(first, path))
+				err(1, "%s", path);
+		}
+	}
+}
+
+/* the patched tree has the link groups of the new one */
+static int check_hardlinks(const char *tgt)
+{
+	char path[PATH_MAX];
+	struct stat first, sb;
+	size_t g, i;
+
+	for(g = 0; g < sizeof(linkgroups) / sizeof(*linkgroups); g++)
+		for(i = 0; linkgroups[g][i]; i++) {
+			snprintf(path, sizeof(path), "%s/%s", tgt, linkgroups[g][i]);
+			if(stat(path, i ? &sb : &first))
+				return -1;
+			if(i && (sb.st_ino != first.st_ino ||
+					sb.st_nlink != first.st_nlink))
+				return -1;
+			if(!linkgroups[g][i+1] && first.st_nlink != i + 1)
+				return -1;
+		}
+	return 0;
+}
+
+static const struct scenario {
+	const char *name;
+	void (*gen)(const char *, const char *);
+	int (*check)(const char *);	/* what diff -r does not see */
+} scenarios[] = {
+	{ "src-edit", gen_src_edit },
+	{ "append-log", gen_append_log },
+	{ "shifted-bin", gen_shifted_bin },
+	{ "zero-image", gen_zero_image },
+	{ "renames", gen_renames },
+	{ "hardlinks", gen_hardlinks, check_hardlinks },
+	{ NULL, NULL }
+};
+
+struct result {
+	double wall, user, sys;
+	long maxrss;
+	int status;
+};
+
+static double tv(struct timeval *t)
+{
+	return t->tv_sec + t->tv_usec / 1e6;
+}
+
+/* Run argv with its output discarded, capturing time and peak RSS */
+static int run(struct result *r, char **argv)
+{
+	struct timespec t0, t1;
+	struct rusage ru;
+	pid_t pid;
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if((pid = fork()) < 0)
+		err(1, "fork");
+	if(pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, 2);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	if(wait4(pid, &r->status, 0, &ru) < 0)
+		err(1, "wait4");
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	r->wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	r->user = tv(&ru.ru_utime);
+	r->sys = tv(&ru.ru_stime);
+	r->maxrss = ru.ru_maxrss;
+	return WIFEXITED(r->status) ? WEXITSTATUS(r->status) : -1;
+}
+
+/* Build "bindir/tool [extra words] args..." */
+static char **cmd(const char *tool, char *extra, ...)
+{
+	static char *argv[64];
+	static char prog[PATH_MAX], words[1024];
+	char *w, *a;
+	int argc = 0;
+	va_list ap;
+
+	snprintf(prog, sizeof(prog), "%s/%s", bindir, tool);
+	argv[argc++] = prog;
+	if(extra) {
+		snprintf(words, sizeof(words), "%s", extra);
+		for(w = strtok(words, " "); w && argc < 48; w = strtok(NULL, " "))
+			argv[argc++] = w;
+	}
+	va_start(ap, extra);
+	while((a = va_arg(ap, char *)) != NULL && argc < 63)
+		argv[argc++] = a;
+	va_end(ap);
+	argv[argc] = NULL;
+	return argv;
+}
+
+static long long treesize(const char *path)
+{
+	char buf[PATH_MAX + 32];
+	long long n = 0;
+	FILE *p;
+
+	snprintf(buf, sizeof(buf), "du -sb '%s'", path);
+	if((p = popen(buf, "r")) == NULL)
+		return -1;
+	if(fscanf(p, "%lld", &n) != 1)
+		n = -1;
+	pclose(p);
+	return n;
+}
+
+static long long filesize(const char *path)
+{
+	struct stat sb;
+
+	return stat(path, &sb) ? -1 : (long long)sb.st_size;
+}
+
+static void report(const char *scen, const char *tool, const char *file,
+		struct result *r, long long bytes, long long patch, int ok)
+{
+	printf("{\"scenario\":\"%s\",\"tool\":\"%s\"", scen, tool);
+	if(file)
+		printf(",\"file\":\"%s\"", file);
+	printf(",\"ok\":%s,\"wall_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f"
+		",\"max_rss_kb\":%ld,\"input_bytes\":%lld,\"patch_bytes\":%lld"
+		",\"mb_per_s\":%.2f,\"cflags\":\"%s\"}\n",
+		ok ? "true" : "false", r->wall, r->user, r->sys, r->maxrss,
+		bytes, patch, r->wall > 0 ? bytes / r->wall / 1e6 : 0.0,
+		BUILD_CFLAGS);
+	fflush(stdout);
+}
+
+static void bench(const struct scenario *sc)
+{
+	char dir[PATH_MAX], old[PATH_MAX], new[PATH_MAX], tgt[PATH_MAX];
+	char tar[PATH_MAX], a[PATH_MAX], b[PATH_MAX], p[PATH_MAX], q[PATH_MAX];
+	char *rm[] = { "/bin/rm", "-rf", dir, NULL };
+	char *cp[] = { "/bin/cp", "-a", old, tgt, NULL };
+	char *df[] = { "/usr/bin/diff", "-rq", new, tgt, NULL };
+	struct result r, s;
+	long long in;
+	int i, ok;
+
+	snprintf(dir, sizeof(dir), "%s/%s", workdir, sc->name);
+	snprintf(old, sizeof(old), "%s/old", dir);
+	snprintf(new, sizeof(new), "%s/new", dir);
+	snprintf(tgt, sizeof(tgt), "%s/target", dir);
+	snprintf(tar, sizeof(tar), "%s/patch.tar", dir);
+
+	run(&s, rm);
+	mkdirs("%s", old);
+	mkdirs("%s", new);
+	rng = 0x9e3779b97f4a7c15ULL;
+	for(i = 0; sc->name[i]; i++)
+		rng = rng * 31 + sc->name[i];
+	nchanged = 0;
+	sc->gen(old, new);
+
+	in = treesize(new);
+	ok = run(&r, cmd("fsdiff", fsdiff_args, old, new, tar, NULL)) == 0;
+	report(sc->name, "fsdiff", NULL, &r, in, filesize(tar), ok);
+
+	run(&s, cp);
+	ok = run(&r, cmd("fspatch", NULL, tar, tgt, NULL)) == 0;
+	ok = ok && run(&s, df) == 0;
+	ok = ok && (!sc->check || sc->check(tgt) == 0);
+	report(sc->name, "fspatch", NULL, &r, in, filesize(tar), ok);
+
+	for(i = 0; i < nchanged; i++) {
+		snprintf(a, sizeof(a), "%s/%s", old, changed[i]);
+		snprintf(b, sizeof(b), "%s/%s", new, changed[i]);
+		snprintf(p, sizeof(p), "%s/file.patch", dir);
+		snprintf(q, sizeof(q), "%s/file.out", dir);
+		in = filesize(b);
+		ok = run(&r, cmd("bsdiff", bsdiff_args, a, b, p, NULL)) == 0;
+		report(sc->name, "bsdiff", changed[i], &r, in, filesize(p), ok);
+		ok = run(&r, cmd("bspatch", NULL, a, q, p, NULL)) == 0;
+		if(ok) {
+			size_t l1, l2;
+			char *c1 = readfile(b, &l1), *c2 = readfile(q, &l2);
+			ok = l1 == l2 && memcmp(c1, c2, l1) == 0;
+			free(c1);
+			free(c2);
+		}
+		report(sc->name, "bspatch", changed[i], &r, in, filesize(p), ok);
+	}
+
+	if(!keep)
+		run(&s, rm);
+}
+
+int main(int argc, char **argv)
+{
+	const struct scenario *sc;
+	int ch, i;
+
+	while((ch = getopt(argc, argv, "b:d:F:B:s:k")) != -1) {
+		switch(ch) {
+		case 'b':
+			bindir = optarg;
+			break;
+		case 'd':
+			workdir = optarg;
+			break;
+		case 'F':
+			fsdiff_args = optarg;
+			break;
+		case 'B':
+			bsdiff_args = optarg;
+			break;
+		case 's':
+			scale = atoi(optarg);
+			if(scale < 1)
+				scale = 1;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b bindir] [-d workdir] [-s scale] "
+				"[-F fsdiff-args] [-B bsdiff-args] [-k] [scenario...]\n",
+				argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for(sc = scenarios; sc->name; sc++) {
+		if(optind < argc) {
+			for(i = optind; i < argc; i++)
+				if(!strcmp(argv[i], sc->name))
+					break;
+			if(i == argc)
+				continue;
+		}
+		bench(sc);
+	}
+	return 0;
+}
@@ -29,14 +29,21 @@ __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bsdiff/bsdiff.c,v 1.1 2005/08/06 01:59:05
 #endif
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 //#include <bzlib.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+
+#include "stats.c"
+#include "cache.c"
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
@@ -105,6 +112,9 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 {
 	off_t buckets[256];
 	off_t i,h,len;
+	struct stats_timer tm;
+
+	stats_start(&tm);
 
 	for(i=0;i<256;i++) buckets[i]=0;
 	for(i=0;i<oldsize;i++) buckets[old[i]]++;
@@ -137,6 +147,8 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	};
 
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
+
+	stats_stop(&tm,ST_QSUFSORT);
 }
 
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
@@ -175,6 +187,24 @@ static off_t search(off_t *I,u_char *old,off_t oldsize,
 	};
 }
 
+static off_t offtin(u_char *buf)
+{
+	off_t y;
+
+	y=buf[7]&0x7F;
+	y=y*256;y+=buf[6];
+	y=y*256;y+=buf[5];
+	y=y*256;y+=buf[4];
+	y=y*256;y+=buf[3];
+	y=y*256;y+=buf[2];
+	y=y*256;y+=buf[1];
+	y=y*256;y+=buf[0];
+
+	if(buf[7]&0x80) y=-y;
+
+	return y;
+}
+
 static void offtout(off_t x,u_char *buf)
 {
 	off_t y;
@@ -193,178 +223,498 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
-int main(int argc,char *argv[])
+/* Scanner presets for -1 (fastest) to -9 (smallest patch) */
+struct bsdiff_level {
+	off_t stride;		/* step between probes without a match */
+	off_t minlen;		/* shortest match worth switching to */
+	off_t maxcmp;		/* longest compare in search(), 0 unlimited */
+	off_t seed;		/* bytes hashed into the seed table, 0 off */
+	off_t extend;		/* give up extending after this many bytes
+				   without improvement, 0 never */
+};
+
+static const struct bsdiff_level levels[10] = {
+	{ 0 },
+	{ 16, 32, 4096, 16, 256 },
+	{ 8, 32, 4096, 16, 512 },
+	{ 4, 24, 16384, 12, 1024 },
+	{ 4, 16, 16384, 8, 4096 },
+	{ 2, 16, 65536, 8, 4096 },
+	{ 1, 12, 65536, 8, 16384 },
+	{ 1, 8, 262144, 8, 65536 },
+	{ 1, 0, 1048576, 0, 0 },
+	{ 1, 0, 0, 0, 0 },
+};
+
+/* One bit per hash of every seed-sized string in old */
+#define SEEDBITS 24
+
+static u_int32_t seedhash(const u_char *p,off_t len)
 {
-	int fd;
-	u_char *old,*new;
-	off_t oldsize,newsize;
-	off_t *I,*V;
-	off_t scan,pos,len;
-	off_t lastscan,lastpos,lastoffset;
-	off_t oldscore,scsc;
-	off_t s,Sf,lenf,Sb,lenb;
-	off_t overlap,Ss,lens;
+	u_int32_t h=2166136261u;
 	off_t i;
+
+	for(i=0;i<len;i++) h=(h^p[i])*16777619u;
+	return h>>(32-SEEDBITS);
+}
+
+/* Output state shared by every block of one patch */
+struct bsdiff_stream {
+	const struct bsdiff_level *lvl;
+	FILE *pf;		/* ctrl tuples are written here as we go */
+	u_char *db,*eb;		/* diff and extra bytes of the current block */
 	off_t dblen,eblen;
-	u_char *db,*eb;
+	off_t oldpos;		/* where the applier's old file pointer is */
+};
+
+static void ctrlout(struct bsdiff_stream *st,off_t x,off_t y,off_t z)
+{
 	u_char buf[8];
-	u_char header[32];
-	FILE * pf;
-	//BZFILE * pfbz2;
-	//int bz2err;
 
-	if(argc!=4) errx(1,"usage: %s oldfile newfile patchfile\n",argv[0]);
+	offtout(x,buf);
+	fwrite(buf, 8, 1, st->pf);
+	//BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
+	//if (bz2err != BZ_OK)
+	//	errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
 
-	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	if(((fd=open(argv[1],O_RDONLY,0))<0) ||
-		((oldsize=lseek(fd,0,SEEK_END))==-1) ||
-		((old=malloc(oldsize+1))==NULL) ||
-		(lseek(fd,0,SEEK_SET)!=0) ||
-		(read(fd,old,oldsize)!=oldsize) ||
-		(close(fd)==-1)) err(1,"%s",argv[1]);
+	offtout(y,buf);
+	fwrite(buf, 8, 1, st->pf);
+	//BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
+	//if (bz2err != BZ_OK)
+	//	errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
 
-	if(((I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
-		((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) err(1,NULL);
+	offtout(z,buf);
+	fwrite(buf, 8, 1, st->pf);
+	//BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
+	//if (bz2err != BZ_OK)
+	//	errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
 
-	qsufsort(I,V,old,oldsize);
+	st->oldpos+=x+z;
+}
 
-	free(V);
+/* Emit the tuple that takes the applier from the last match at
+	(lastscan,lastpos) up to the match at (scan,pos), extending both
+	approximately into the gap between them.  Returns how far the new
+	match was extended backwards. */
+static off_t bsdiff_emit(struct bsdiff_stream *st,u_char *old,off_t oldsize,
+		u_char *new,off_t newsize,off_t lastscan,off_t lastpos,
+		off_t scan,off_t pos)
+{
+	off_t s,Sf,lenf,Sb,lenb;
+	off_t overlap,Ss,lens;
+	off_t i,ext;
 
-	/* Allocate newsize+1 bytes instead of newsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	if(((fd=open(argv[2],O_RDONLY,0))<0) ||
-		((newsize=lseek(fd,0,SEEK_END))==-1) ||
-		((new=malloc(newsize+1))==NULL) ||
-		(lseek(fd,0,SEEK_SET)!=0) ||
-		(read(fd,new,newsize)!=newsize) ||
-		(close(fd)==-1)) err(1,"%s",argv[2]);
+	ext=st->lvl->extend ? st->lvl->extend : scan+1;
 
-	if(((db=malloc(newsize+1))==NULL) ||
-		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
-	dblen=0;
-	eblen=0;
+	s=0;Sf=0;lenf=0;
+	for(i=0;(lastscan+i<scan)&&(lastpos+i<oldsize);) {
+		if(old[lastpos+i]==new[lastscan+i]) s++;
+		i++;
+		if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
+		if(i-lenf>ext) break;
+	};
 
-	/* Create the patch file */
-	if ((pf = fopen(argv[3], "w")) == NULL)
-		err(1, "%s", argv[3]);
+	lenb=0;
+	if(scan<newsize) {
+		s=0;Sb=0;
+		for(i=1;(scan>=lastscan+i)&&(pos>=i);i++) {
+			if(old[pos-i]==new[scan-i]) s++;
+			if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
+			if(i-lenb>ext) break;
+		};
+	};
 
-	/* Header is
-		0	8	 "BSDIFFXX"
-		8	8	length of ctrl block
-		16	8	length of diff block
-		24	8	length of new file */
-	/* File is
-		0	32	Header
-		32	??	ctrl block
-		??	??	diff block
-		??	??	extra block */
-	memcpy(header,"BSDIFFXX",8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", argv[3]);
+	if(lastscan+lenf>scan-lenb) {
+		overlap=(lastscan+lenf)-(scan-lenb);
+		s=0;Ss=0;lens=0;
+		for(i=0;i<overlap;i++) {
+			if(new[lastscan+lenf-overlap+i]==
+			   old[lastpos+lenf-overlap+i]) s++;
+			if(new[scan-lenb+i]==
+			   old[pos-lenb+i]) s--;
+			if(s>Ss) { Ss=s; lens=i+1; };
+		};
 
-	/* Compute the differences, writing ctrl as we go */
-	//if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-	//	errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	scan=0;len=0;
+		lenf+=lens-overlap;
+		lenb-=lens;
+	};
+
+	for(i=0;i<lenf;i++)
+		st->db[st->dblen+i]=new[lastscan+i]-old[lastpos+i];
+	for(i=0;i<(scan-lenb)-(lastscan+lenf);i++)
+		st->eb[st->eblen+i]=new[lastscan+lenf+i];
+
+	st->dblen+=lenf;
+	st->eblen+=(scan-lenb)-(lastscan+lenf);
+
+	ctrlout(st,lenf,(scan-lenb)-(lastscan+lenf),
+			(pos-lenb)-(lastpos+lenf));
+
+	return lenb;
+}
+
+/* Diff new against old, where old starts at oldbase in the real old
+	file.  I is the suffix array of old. */
+static void bsdiff_scan(struct bsdiff_stream *st,off_t *I,
+		u_char *old,off_t oldsize,off_t oldbase,u_char *new,off_t newsize)
+{
+	off_t scan,pos,len;
+	off_t lastscan,lastpos,lastoffset;
+	off_t oldscore,scsc;
+	off_t lenb,step,i;
+	const struct bsdiff_level *lvl=st->lvl;
+	u_char *seeds=NULL;
+	struct stats_timer tm;
+
+	stats_start(&tm);
+
+	/* Windows start from their own base, seek the applier there */
+	if(st->oldpos!=oldbase)
+		ctrlout(st,0,0,oldbase-st->oldpos);
+
+	/* Probes whose seed never occurs in old cannot find a long
+		enough match, skip the search for those */
+	if(lvl->seed) {
+		if((seeds=calloc(1,1<<(SEEDBITS-3)))==NULL) err(1,NULL);
+		for(i=0;i+lvl->seed<=oldsize;i++) {
+			u_int32_t h=seedhash(old+i,lvl->seed);
+			seeds[h>>3]|=1<<(h&7);
+		};
+	};
+
+	scan=0;len=0;pos=0;
 	lastscan=0;lastpos=0;lastoffset=0;
 	while(scan<newsize) {
 		oldscore=0;
 
-		for(scsc=scan+=len;scan<newsize;scan++) {
-			len=search(I,old,oldsize,new+scan,newsize-scan,
-					0,oldsize,&pos);
+		for(scsc=scan+=len;scan<newsize;) {
+			len=0;
+			if(seeds && (scan+lvl->seed<=newsize)) {
+				u_int32_t h=seedhash(new+scan,lvl->seed);
+				if(seeds[h>>3]&(1<<(h&7))) len=-1;
+			} else len=-1;
+			if(len<0) len=search(I,old,oldsize,new+scan,
+					lvl->maxcmp ? MIN(newsize-scan,lvl->maxcmp) :
+					newsize-scan,0,oldsize,&pos);
 
 			for(;scsc<scan+len;scsc++)
 			if((scsc+lastoffset<oldsize) &&
 				(old[scsc+lastoffset] == new[scsc]))
 				oldscore++;
 
-			if(((len==oldscore) && (len!=0)) || 
-				(len>oldscore+8)) break;
+			if((len>=lvl->minlen) &&
+				(((len==oldscore) && (len!=0)) ||
+				(len>oldscore+8))) break;
 
+			step=MIN(lvl->stride,newsize-scan);
+			for(;step>0;step--,scan++)
 			if((scan+lastoffset<oldsize) &&
 				(old[scan+lastoffset] == new[scan]))
 				oldscore--;
 		};
 
 		if((len!=oldscore) || (scan==newsize)) {
-			s=0;Sf=0;lenf=0;
-			for(i=0;(lastscan+i<scan)&&(lastpos+i<oldsize);) {
-				if(old[lastpos+i]==new[lastscan+i]) s++;
-				i++;
-				if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
-			};
+			lenb=bsdiff_emit(st,old,oldsize,new,newsize,
+					lastscan,lastpos,scan,pos);
 
-			lenb=0;
-			if(scan<newsize) {
-				s=0;Sb=0;
-				for(i=1;(scan>=lastscan+i)&&(pos>=i);i++) {
-					if(old[pos-i]==new[scan-i]) s++;
-					if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
-				};
-			};
+			lastscan=scan-lenb;
+			lastpos=pos-lenb;
+			lastoffset=pos-scan;
+		};
+	};
 
-			if(lastscan+lenf>scan-lenb) {
-				overlap=(lastscan+lenf)-(scan-lenb);
-				s=0;Ss=0;lens=0;
-				for(i=0;i<overlap;i++) {
-					if(new[lastscan+lenf-overlap+i]==
-					   old[lastpos+lenf-overlap+i]) s++;
-					if(new[scan-lenb+i]==
-					   old[pos-lenb+i]) s--;
-					if(s>Ss) { Ss=s; lens=i+1; };
-				};
+	free(seeds);
+	stats_stop(&tm,ST_SCAN);
+}
 
-				lenf+=lens-overlap;
-				lenb-=lens;
-			};
+/* rsync-style matcher: index every FASTBLOCK-aligned block of old by a
+	rolling hash, slide the hash over new and greedily take the first
+	verified match.  Much faster than suffix sorting, at the cost of
+	missing matches shorter than two blocks. */
+#define FASTBLOCK 32
+#define FASTMUL 0x01000193
+
+struct fastslot {
+	u_int32_t hash;
+	off_t pos;		/* old offset + 1, 0 for an empty slot */
+};
+
+static u_int32_t fasthash(u_char *p)
+{
+	u_int32_t h=0;
+	int i;
+
+	for(i=0;i<FASTBLOCK;i++) h=h*FASTMUL+p[i];
+	return h;
+}
+
+/* size of the block index of old, a power of two */
+static off_t fast_slots(off_t oldsize)
+{
+	off_t nslots=1;
+
+	while(nslots<2*(oldsize/FASTBLOCK)) nslots*=2;
+	return nslots;
+}
+
+/* Index the blocks of old, in a table of mask+1 slots */
+static struct fastslot *fast_index(u_char *old,off_t oldsize,off_t *mask)
+{
+	struct fastslot *tab;
+	off_t nslots,i,k;
+	u_int32_t h;
+	struct stats_timer tm;
+
+	stats_start(&tm);
+	nslots=fast_slots(oldsize);
+	*mask=nslots-1;
+	if((tab=calloc(nslots,sizeof(*tab)))==NULL) err(1,NULL);
+
+	/* Keep the first copy of each block */
+	for(i=0;i+FASTBLOCK<=oldsize;i+=FASTBLOCK) {
+		h=fasthash(old+i);
+		for(k=h&*mask;tab[k].pos;k=(k+1)&*mask)
+			if((tab[k].hash==h) &&
+				(memcmp(old+tab[k].pos-1,old+i,FASTBLOCK)==0)) break;
+		if(!tab[k].pos) { tab[k].hash=h; tab[k].pos=i+1; };
+	};
+	stats_stop(&tm,ST_SCAN);
+	return tab;
+}
 
-			for(i=0;i<lenf;i++)
-				db[dblen+i]=new[lastscan+i]-old[lastpos+i];
-			for(i=0;i<(scan-lenb)-(lastscan+lenf);i++)
-				eb[eblen+i]=new[lastscan+lenf+i];
+/* Diff new against the indexed old, with the applier's old file pointer
+	at lastpos */
+static void fast_scan(struct bsdiff_stream *st,struct fastslot *tab,
+		off_t mask,u_char *old,off_t oldsize,off_t lastpos,
+		u_char *new,off_t newsize)
+{
+	off_t scan,pos,len,i,k;
+	off_t lastscan,lenb;
+	u_int32_t h,outmul;
+	struct stats_timer tm;
 
-			dblen+=lenf;
-			eblen+=(scan-lenb)-(lastscan+lenf);
+	stats_start(&tm);
 
-			offtout(lenf,buf);
-			fwrite(buf, 8, 1, pf);
-			//BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			//if (bz2err != BZ_OK)
-			//	errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+	/* FASTMUL^FASTBLOCK, to drop the outgoing byte from the hash */
+	outmul=1;
+	for(i=0;i<FASTBLOCK;i++) outmul*=FASTMUL;
 
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			fwrite(buf, 8, 1, pf);
-			//BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			//if (bz2err != BZ_OK)
-			//	errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+	scan=0;h=0;pos=0;len=0;
+	lastscan=0;
+	if(newsize>=FASTBLOCK) h=fasthash(new);
+	while(scan+FASTBLOCK<=newsize) {
+		for(k=h&mask;tab[k].pos;k=(k+1)&mask) {
+			if((tab[k].hash==h) &&
+				(memcmp(old+tab[k].pos-1,new+scan,FASTBLOCK)==0)) break;
+		};
 
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			fwrite(buf, 8, 1, pf);
-			//BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			//if (bz2err != BZ_OK)
-			//	errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+		if(tab[k].pos) {
+			pos=tab[k].pos-1;
+			len=FASTBLOCK+matchlen(old+pos+FASTBLOCK,oldsize-pos-FASTBLOCK,
+					new+scan+FASTBLOCK,newsize-scan-FASTBLOCK);
 
+			lenb=bsdiff_emit(st,old,oldsize,new,newsize,
+					lastscan,lastpos,scan,pos);
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
-			lastoffset=pos-scan;
+
+			scan+=len;
+			if(scan+FASTBLOCK<=newsize) h=fasthash(new+scan);
+			continue;
 		};
+
+		if(scan+FASTBLOCK<newsize)
+			h=h*FASTMUL+new[scan+FASTBLOCK]-outmul*new[scan];
+		scan++;
+	};
+
+	bsdiff_emit(st,old,oldsize,new,newsize,lastscan,lastpos,newsize,lastpos);
+
+	stats_stop(&tm,ST_SCAN);
+}
+
+static void bsdiff_fast(struct bsdiff_stream *st,u_char *old,off_t oldsize,
+		u_char *new,off_t newsize)
+{
+	struct fastslot *tab;
+	off_t mask;
+
+	tab=fast_index(old,oldsize,&mask);
+	fast_scan(st,tab,mask,old,oldsize,0,new,newsize);
+	free(tab);
+}
+
+/* Parse a byte count with an optional K, M or G suffix */
+static off_t parse_size(const char *arg)
+{
+	char *end;
+	off_t n;
+
+	n=strtoll(arg,&end,0);
+	switch(*end) {
+	case 'G': case 'g': n*=1024;
+		/* fallthrough */
+	case 'M': case 'm': n*=1024;
+		/* fallthrough */
+	case 'K': case 'k': n*=1024; end++;
+	}
+	if((*end!=0) || (n<0)) errx(1,"bad size %s",arg);
+	return n;
+}
+
+static void preadall(int fd,const char *name,u_char *buf,off_t len,off_t off)
+{
+	ssize_t ret;
+	struct stats_timer tm;
+
+	stats_start(&tm);
+	STATS_ADD(bytes_read,len);
+	while(len>0) {
+		if((ret=pread(fd,buf,len,off))<=0) err(1,"%s",name);
+		buf+=ret;off+=ret;len-=ret;
 	};
+	stats_stop(&tm,ST_READ);
+}
+
+static void appendfile(FILE *pf,FILE *f,const char *name)
+{
+	char buf[65536];
+	size_t n;
+
+	rewind(f);
+	while((n=fread(buf,1,sizeof(buf),f))>0)
+		if(fwrite(buf,1,n,pf)!=n) err(1,"fwrite(%s)",name);
+	if(ferror(f)) err(1,"tmpfile");
+}
+
+/* Diff in windows so that memory use stays within budget: each segment
+	of the new file is matched against a window of the old file around
+	the same relative position.  The ctrl seeks are absolute-position
+	differences, so the patch is an ordinary one; diff and extra bytes
+	are spooled to temporary files until the ctrl block is complete. */
+static void bsdiff_windowed(struct bsdiff_stream *st,const char *oldname,
+		const char *newname,off_t oldsize,off_t newsize,off_t budget)
+{
+	int oldfd,newfd;
+	u_char *old,*new;
+	off_t *I,*V;
+	off_t wnew,wold,n0,nlen,o0,olen;
+	FILE *dbf,*ebf;
+	struct stats_timer tm;
+
+	/* old + I + V is 17 bytes per old byte, new + db + eb is 3 bytes
+		per new byte; the old window is twice the new segment */
+	wnew=budget/37;
+	if(wnew<4096) errx(1,"memory budget too small");
+	wold=MIN(2*wnew,oldsize);
+
+	if(((oldfd=open(oldname,O_RDONLY,0))<0)) err(1,"%s",oldname);
+	if(((newfd=open(newname,O_RDONLY,0))<0)) err(1,"%s",newname);
+	if(((old=malloc(wold+1))==NULL) ||
+		((I=malloc((wold+1)*sizeof(off_t)))==NULL) ||
+		((V=malloc((wold+1)*sizeof(off_t)))==NULL) ||
+		((new=malloc(wnew+1))==NULL) ||
+		((st->db=malloc(wnew+1))==NULL) ||
+		((st->eb=malloc(wnew+1))==NULL)) err(1,NULL);
+	if(((dbf=tmpfile())==NULL) || ((ebf=tmpfile())==NULL))
+		err(1,"tmpfile");
+
+	for(n0=0;n0<newsize;n0+=nlen) {
+		nlen=MIN(wnew,newsize-n0);
+
+		/* Center the old window on the matching relative offset */
+		o0=(off_t)((double)(n0+nlen/2)*oldsize/newsize)-wold/2;
+		if(o0>oldsize-wold) o0=oldsize-wold;
+		if(o0<0) o0=0;
+		olen=wold;
+
+		preadall(oldfd,oldname,old,olen,o0);
+		preadall(newfd,newname,new,nlen,n0);
+		qsufsort(I,V,old,olen);
+
+		st->dblen=0;st->eblen=0;
+		bsdiff_scan(st,I,old,olen,o0,new,nlen);
+		if((fwrite(st->db,1,st->dblen,dbf)!=st->dblen) ||
+			(fwrite(st->eb,1,st->eblen,ebf)!=st->eblen))
+			err(1,"tmpfile");
+	};
+
+	/* Every ctrl tuple is out, now the diff and extra blocks */
+	stats_start(&tm);
+	st->dblen=ftello(dbf);
+	st->eblen=ftello(ebf);
+	appendfile(st->pf,dbf,"diff");
+	appendfile(st->pf,ebf,"extra");
+	stats_stop(&tm,ST_WRITE);
+
+	fclose(dbf);
+	fclose(ebf);
+	close(oldfd);
+	close(newfd);
+	free(st->db);
+	free(st->eb);
+	free(new);
+	free(V);
+	free(I);
+	free(old);
+}
+
+/* Diff the files in one go, holding both of them in memory */
+static void bsdiff_whole(struct bsdiff_stream *st,const char *oldname,
+		const char *newname,off_t oldsize,off_t newsize)
+{
+	int fd;
+	u_char *old,*new;
+	off_t *I,*V,*cached;
+	struct stat sb;
+	struct stats_timer tm;
+
+	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
+		that we never try to malloc(0) and get a NULL pointer */
+	stats_start(&tm);
+	if(((fd=open(oldname,O_RDONLY,0))<0) ||
+		(fstat(fd,&sb)==-1) ||
+		((old=malloc(oldsize+1))==NULL) ||
+		(read(fd,old,oldsize)!=oldsize) ||
+		(close(fd)==-1)) err(1,"%s",oldname);
+	stats_stop(&tm,ST_READ);
+
+	/* The suffix array only depends on old, so a cached one is as good */
+	I=cached=cache_dir ? sa_load(&sb,oldsize) : NULL;
+	if(!cached) {
+		if(((I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
+			((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) err(1,NULL);
+
+		qsufsort(I,V,old,oldsize);
+
+		free(V);
+		if(cache_dir) sa_store(&sb,I,oldsize);
+	}
+
+	/* Allocate newsize+1 bytes instead of newsize bytes to ensure
+		that we never try to malloc(0) and get a NULL pointer */
+	stats_start(&tm);
+	if(((fd=open(newname,O_RDONLY,0))<0) ||
+		((new=malloc(newsize+1))==NULL) ||
+		(read(fd,new,newsize)!=newsize) ||
+		(close(fd)==-1)) err(1,"%s",newname);
+	stats_stop(&tm,ST_READ);
+	STATS_ADD(bytes_read,oldsize+newsize);
+
+	if(((st->db=malloc(newsize+1))==NULL) ||
+		((st->eb=malloc(newsize+1))==NULL)) err(1,NULL);
+
+	/* Compute the differences, writing ctrl as we go */
+	//if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
+	//	errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+	bsdiff_scan(st,I,old,oldsize,0,new,newsize);
 	//BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
 	//if (bz2err != BZ_OK)
 	//	errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
 
-	/* Compute size of compressed ctrl data */
-	if ((len = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(len-32, header + 8);
-
 	/* Write compressed diff data */
-	fwrite(db, dblen, 1, pf);
+	stats_start(&tm);
+	fwrite(st->db, st->dblen, 1, st->pf);
 	//if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
 	//	errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
 	//BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
@@ -374,13 +724,8 @@ int main(int argc,char *argv[])
 	//if (bz2err != BZ_OK)
 	//	errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
 
-	/* Compute size of compressed diff data */
-	if ((newsize = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(newsize - len, header + 16);
-
 	/* Write compressed extra data */
-	fwrite(eb, eblen, 1, pf);
+	fwrite(st->eb, st->eblen, 1, st->pf);
 	//if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
 	//	errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
 	//BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
@@ -389,21 +734,488 @@ int main(int argc,char *argv[])
 	//BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
 	//if (bz2err != BZ_OK)
 	//	errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	stats_stop(&tm,ST_WRITE);
+
+	/* Free the memory we used */
+	free(st->db);
+	free(st->eb);
+	if(cached) munmap(cached-2,(oldsize+1)*sizeof(off_t)+16);
+	else free(I);
+	free(old);
+	free(new);
+}
+
+/* Diff the files with the rolling-hash matcher, straight from the
+	page cache.  The block index and db and eb are the only heap; when
+	they do not fit in budget, new is diffed a segment at a time and db
+	and eb are spooled to temporary files as in bsdiff_windowed. */
+static void bsdiff_mapped(struct bsdiff_stream *st,const char *oldname,
+		const char *newname,off_t oldsize,off_t newsize,off_t budget)
+{
+	int fd;
+	u_char *old,*new;
+	struct fastslot *tab;
+	off_t mask,wnew,n0,nlen;
+	FILE *dbf,*ebf;
+	struct stats_timer tm;
+
+	old=new=(u_char *)"";
+	if(((fd=open(oldname,O_RDONLY,0))<0) ||
+		(oldsize && ((old=mmap(NULL,oldsize,PROT_READ,MAP_PRIVATE,
+			fd,0))==MAP_FAILED)) ||
+		(close(fd)==-1)) err(1,"%s",oldname);
+	if(((fd=open(newname,O_RDONLY,0))<0) ||
+		(newsize && ((new=mmap(NULL,newsize,PROT_READ,MAP_PRIVATE,
+			fd,0))==MAP_FAILED)) ||
+		(close(fd)==-1)) err(1,"%s",newname);
+	if(oldsize) madvise(old,oldsize,MADV_SEQUENTIAL);
+	if(newsize) madvise(new,newsize,MADV_SEQUENTIAL);
+
+	tab=fast_index(old,oldsize,&mask);
+	wnew=newsize;
+	if(budget && ((mask+1)*(off_t)sizeof(*tab)+2*newsize>budget)) {
+		wnew=(budget-(mask+1)*(off_t)sizeof(*tab))/2;
+		if(wnew<4096) errx(1,"memory budget too small");
+	}
+	if(((st->db=malloc(wnew+1))==NULL) ||
+		((st->eb=malloc(wnew+1))==NULL)) err(1,NULL);
+
+	STATS_ADD(bytes_read,oldsize+newsize);
+	if(wnew==newsize) {
+		fast_scan(st,tab,mask,old,oldsize,0,new,newsize);
+
+		stats_start(&tm);
+		fwrite(st->db, st->dblen, 1, st->pf);
+		fwrite(st->eb, st->eblen, 1, st->pf);
+		stats_stop(&tm,ST_WRITE);
+	} else {
+		if(((dbf=tmpfile())==NULL) || ((ebf=tmpfile())==NULL))
+			err(1,"tmpfile");
+		for(n0=0;n0<newsize;n0+=nlen) {
+			nlen=MIN(wnew,newsize-n0);
+			st->dblen=0;st->eblen=0;
+			fast_scan(st,tab,mask,old,oldsize,st->oldpos,new+n0,nlen);
+			if((fwrite(st->db,1,st->dblen,dbf)!=st->dblen) ||
+				(fwrite(st->eb,1,st->eblen,ebf)!=st->eblen))
+				err(1,"tmpfile");
+		};
+
+		stats_start(&tm);
+		st->dblen=ftello(dbf);
+		st->eblen=ftello(ebf);
+		appendfile(st->pf,dbf,"diff");
+		appendfile(st->pf,ebf,"extra");
+		stats_stop(&tm,ST_WRITE);
+
+		fclose(dbf);
+		fclose(ebf);
+	}
+
+	free(tab);
+	free(st->db);
+	free(st->eb);
+	if(oldsize) munmap(old,oldsize);
+	if(newsize) munmap(new,newsize);
+}
+
+/* Content-defined segmentation: a gear hash over the data declares a
+	boundary wherever its low bits are zero, so an insertion only moves
+	the boundaries next to it.  Old and new boundaries with the same
+	hash are taken to be the same place in the data. */
+#define SEGMIN (16*1024*1024)
+
+struct segpoint {
+	off_t pos;
+	u_int32_t hash;
+};
+
+static u_int32_t gear[256];
+
+static void gear_init(void)
+{
+	u_int32_t x=2463534242u;
+	int i;
+
+	for(i=0;i<256;i++) {
+		x^=x<<13;x^=x>>17;x^=x<<5;
+		gear[i]=x;
+	};
+}
+
+/* Boundaries of buf roughly every avg bytes, never closer than avg/4
+	nor further apart than avg*4.  The list starts with 0. */
+static struct segpoint *segsplit(u_char *buf,off_t size,off_t avg,off_t *n)
+{
+	struct segpoint *pts;
+	u_int32_t h,mask;
+	off_t i,last,max;
+
+	for(mask=1;mask<avg;mask<<=1);
+	mask=(mask-1)<<(32-__builtin_ctz(mask));
+
+	max=size/(avg/4)+2;
+	if((pts=malloc(max*sizeof(*pts)))==NULL) err(1,NULL);
+	pts[0].pos=0;pts[0].hash=0;
+	*n=1;
+
+	h=0;last=0;
+	for(i=0;i<size;i++) {
+		h=(h<<1)+gear[buf[i]];
+		if(i+1-last<avg/4) continue;
+		if(((h&mask)==0) || (i+1-last>=avg*4)) {
+			if(i+1==size) break;
+			pts[*n].pos=i+1;pts[*n].hash=h;
+			(*n)++;
+			last=i+1;
+		};
+	};
+	return pts;
+}
+
+/* Where the new boundary p sits in old, or -1 */
+static off_t segmatch(struct segpoint *opts,off_t on,struct segpoint *p,
+		off_t expect)
+{
+	off_t i,best;
+
+	best=-1;
+	for(i=1;i<on;i++)
+		if((opts[i].hash==p->hash) && ((best<0) ||
+			(llabs(opts[i].pos-expect)<llabs(best-expect))))
+			best=opts[i].pos;
+	return best;
+}
+
+/* Segment workers are forked: exit() would run the parent's atexit
+	handlers and flush the stdio buffers they inherited, pf among them */
+static void segfail(const char *what)
+{
+	char msg[256];
+	int len;
+
+	len=snprintf(msg,sizeof(msg),"bsdiff: %s: %s\n",what,strerror(errno));
+	if(len>0) write(2,msg,MIN(len,(int)sizeof(msg)-1));
+	_exit(1);
+}
+
+/* Diff one segment of new against a window of old into out, as a
+	standalone patch whose ctrl tuples assume the applier at o0 */
+static void bsdiff_segment(const struct bsdiff_level *lvl,int fast,
+		u_char *oldmap,off_t o0,off_t olen,u_char *newmap,off_t n0,off_t nlen,
+		FILE *out)
+{
+	struct bsdiff_stream st;
+	u_char header[32];
+	off_t *I,*V;
+	u_char *old=oldmap+o0,*new=newmap+n0;
+
+	st.lvl=lvl;
+	st.pf=out;
+	st.dblen=0;st.eblen=0;
+	st.oldpos=o0;
+	if(((st.db=malloc(nlen+1))==NULL) ||
+		((st.eb=malloc(nlen+1))==NULL)) segfail("malloc");
+
+	memset(header,0,sizeof(header));
+	if (fwrite(header, 32, 1, out) != 1)
+		segfail("tmpfile");
+
+	if(fast) {
+		bsdiff_fast(&st,old,olen,new,nlen);
+	} else {
+		if(((I=malloc((olen+1)*sizeof(off_t)))==NULL) ||
+			((V=malloc((olen+1)*sizeof(off_t)))==NULL)) segfail("malloc");
+		qsufsort(I,V,old,olen);
+		free(V);
+		bsdiff_scan(&st,I,old,olen,o0,new,nlen);
+		free(I);
+	};
+
+	offtout(ftello(out)-32, header + 8);
+	offtout(st.dblen, header + 16);
+	offtout(nlen, header + 24);
+	if((fwrite(st.db,1,st.dblen,out)!=st.dblen) ||
+		(fwrite(st.eb,1,st.eblen,out)!=st.eblen) ||
+		fseeko(out,0,SEEK_SET) ||
+		(fwrite(header,32,1,out)!=1) || fflush(out))
+		segfail("tmpfile");
+
+	free(st.db);
+	free(st.eb);
+}
+
+static void copyrange(FILE *pf,FILE *f,off_t off,off_t len)
+{
+	char buf[65536];
+	size_t n;
+
+	if(fseeko(f,off,SEEK_SET)) err(1,"fseeko");
+	while(len>0) {
+		n=fread(buf,1,MIN(len,(off_t)sizeof(buf)),f);
+		if(n==0) errx(1,"short segment patch");
+		if(fwrite(buf,1,n,pf)!=n) err(1,"fwrite");
+		len-=n;
+	};
+}
+
+/* Split new at content-defined boundaries and diff the segments in up
+	to jobs child processes at once.  The segment patches are then
+	stitched into one ordinary patch: their ctrl tuples in order, with
+	a seek between segments, followed by all diff and then all extra
+	bytes. */
+static void bsdiff_segmented(struct bsdiff_stream *st,const char *oldname,
+		const char *newname,off_t oldsize,off_t newsize,off_t budget,
+		int jobs,int fast)
+{
+	int fd,running,status;
+	pid_t pid;
+	u_char *old,*new;
+	u_char header[32],buf[24];
+	struct segpoint *opts,*npts;
+	off_t on,nn,avg,k,i,n0,n1,o0,o1,slack,len;
+	off_t *oldb,*base;
+	FILE **seg;
+
+	old=new=(u_char *)"";
+	if(((fd=open(oldname,O_RDONLY,0))<0) ||
+		(oldsize && ((old=mmap(NULL,oldsize,PROT_READ,MAP_SHARED,
+			fd,0))==MAP_FAILED)) ||
+		(close(fd)==-1)) err(1,"%s",oldname);
+	if(((fd=open(newname,O_RDONLY,0))<0) ||
+		((new=mmap(NULL,newsize,PROT_READ,MAP_SHARED,
+			fd,0))==MAP_FAILED) ||
+		(close(fd)==-1)) err(1,"%s",newname);
+
+	/* Four segments per job keeps the children busy; a budget is
+		shared by all jobs, at 37 bytes per new byte as in
+		bsdiff_windowed(), and segments run up to four times avg */
+	avg=newsize/(jobs*4);
+	if(budget && (avg>budget/jobs/37/4)) avg=budget/jobs/37/4;
+	if(avg<SEGMIN/4) avg=SEGMIN/4;
+	if(avg>(1<<30)) avg=1<<30;
+
+	STATS_ADD(bytes_read,oldsize+newsize);
+	gear_init();
+	opts=segsplit(old,oldsize,avg,&on);
+	npts=segsplit(new,newsize,avg,&nn);
+
+	/* Old offset of every new boundary, guessed from the relative
+		position when no old boundary matches */
+	if(((oldb=malloc((nn+1)*sizeof(off_t)))==NULL) ||
+		((base=malloc(nn*sizeof(off_t)))==NULL) ||
+		((seg=calloc(nn,sizeof(*seg)))==NULL)) err(1,NULL);
+	oldb[0]=0;
+	oldb[nn]=oldsize;
+	for(k=1;k<nn;k++) {
+		o0=(off_t)((double)npts[k].pos*oldsize/newsize);
+		if((oldb[k]=segmatch(opts,on,&npts[k],o0))<0) oldb[k]=o0;
+	};
+
+	running=0;
+	for(k=0;k<nn;k++) {
+		n0=npts[k].pos;
+		n1=(k+1<nn) ? npts[k+1].pos : newsize;
+
+		/* The old range between the matching boundaries, with some
+			slack either side for edits that straddle them */
+		o0=MIN(oldb[k],oldb[k+1]);
+		o1=oldb[k]+oldb[k+1]-o0;
+		o1=MIN(o1,o0+2*(n1-n0));
+		slack=(n1-n0)/4;
+		o0=(o0>slack) ? o0-slack : 0;
+		o1=MIN(o1+slack,oldsize);
+		if(budget) o1=MIN(o1,o0+(budget/jobs-3*(n1-n0))/17);
+		base[k]=o0;
+
+		if((seg[k]=tmpfile())==NULL) err(1,"tmpfile");
+
+		for(;running>=jobs;running--) {
+			if(wait(&status)<0) err(1,"wait");
+			if(!WIFEXITED(status) || WEXITSTATUS(status))
+				errx(1,"segment diff failed");
+		};
+		/* nothing buffered for a failing child to write twice */
+		fflush(NULL);
+		if((pid=fork())<0) err(1,"fork");
+		if(pid==0) {
+			bsdiff_segment(st->lvl,fast,old,o0,o1-o0,new,n0,n1-n0,seg[k]);
+			_exit(0);
+		};
+		running++;
+	};
+	for(;running>0;running--) {
+		if(wait(&status)<0) err(1,"wait");
+		if(!WIFEXITED(status) || WEXITSTATUS(status))
+			errx(1,"segment diff failed");
+	};
+
+	/* Ctrl tuples, with a seek to each segment's window */
+	for(k=0;k<nn;k++) {
+		rewind(seg[k]);
+		if(fread(header,32,1,seg[k])!=1) errx(1,"short segment patch");
+		if(st->oldpos!=base[k])
+			ctrlout(st,0,0,base[k]-st->oldpos);
+		for(i=offtin(header+8);i>0;i-=24) {
+			if(fread(buf,24,1,seg[k])!=1) errx(1,"short segment patch");
+			ctrlout(st,offtin(buf),offtin(buf+8),offtin(buf+16));
+		};
+	};
+
+	/* Then every segment's diff bytes, then every segment's extras */
+	for(k=0;k<nn;k++) {
+		rewind(seg[k]);
+		if(fread(header,32,1,seg[k])!=1) errx(1,"short segment patch");
+		len=offtin(header+16);
+		copyrange(st->pf,seg[k],32+offtin(header+8),len);
+		st->dblen+=len;
+	};
+	for(k=0;k<nn;k++) {
+		if(fseeko(seg[k],0,SEEK_END)) err(1,"fseeko");
+		len=ftello(seg[k]);
+		rewind(seg[k]);
+		if(fread(header,32,1,seg[k])!=1) errx(1,"short segment patch");
+		o0=32+offtin(header+8)+offtin(header+16);
+		copyrange(st->pf,seg[k],o0,len-o0);
+		st->eblen+=len-o0;
+		fclose(seg[k]);
+	};
+
+	free(seg);
+	free(base);
+	free(oldb);
+	free(opts);
+	free(npts);
+	if(oldsize) munmap(old,oldsize);
+	munmap(new,newsize);
+}
+
+int main(int argc,char *argv[])
+{
+	int fd,ch;
+	off_t oldsize,newsize;
+	off_t len,budget;
+	int fast,level,jobs,dostats;
+	char *statspath;
+	static struct option longopts[] = {
+		{ "stats", optional_argument, NULL, 'S' },
+		{ "cache-budget", required_argument, NULL, 'B' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct bsdiff_stream st;
+	u_char header[32];
+	FILE * pf;
+	//BZFILE * pfbz2;
+	//int bz2err;
+
+	budget=0;fast=0;level=9;jobs=1;
+	dostats=0;statspath=NULL;
+	while((ch=getopt_long(argc,argv,"123456789c:fj:m:",longopts,NULL))!=-1) {
+		switch(ch) {
+		case '1': case '2': case '3': case '4': case '5':
+		case '6': case '7': case '8': case '9':
+			level=ch-'0';
+			break;
+		case 'c':
+			cache_dir=optarg;
+			break;
+		case 'B':
+			cache_budget=parse_size(optarg);
+			break;
+		case 'f':
+			fast=1;
+			break;
+		case 'j':
+			jobs=atoi(optarg);
+			if(jobs<1) errx(1,"bad job count %s",optarg);
+			break;
+		case 'm':
+			budget=parse_size(optarg);
+			break;
+		case 'S':
+			dostats=1;
+			statspath=optarg;
+			break;
+		default:
+			errx(1,"usage: %s [-1..-9] [-c cachedir] [-f] [-j jobs] [-m budget] [--cache-budget size] [--stats[=file]] oldfile newfile patchfile\n",argv[0]);
+		}
+	}
+	if(argc-optind!=3) errx(1,"usage: %s [-1..-9] [-c cachedir] [-f] [-j jobs] [-m budget] [--cache-budget size] [--stats[=file]] oldfile newfile patchfile\n",argv[0]);
+	argv+=optind;
+	if(dostats) stats_init();
+
+	if(((fd=open(argv[0],O_RDONLY,0))<0) ||
+		((oldsize=lseek(fd,0,SEEK_END))==-1) ||
+		(close(fd)==-1)) err(1,"%s",argv[0]);
+	if(((fd=open(argv[1],O_RDONLY,0))<0) ||
+		((newsize=lseek(fd,0,SEEK_END))==-1) ||
+		(close(fd)==-1)) err(1,"%s",argv[1]);
+
+	/* Create the patch file */
+	if ((pf = fopen(argv[2], "w")) == NULL)
+		err(1, "%s", argv[2]);
+
+	/* Header is
+		0	8	 "BSDIFFXX"
+		8	8	length of ctrl block
+		16	8	length of diff block
+		24	8	length of new file */
+	/* File is
+		0	32	Header
+		32	??	ctrl block
+		??	??	diff block
+		??	??	extra block */
+	memcpy(header,"BSDIFFXX",8);
+	offtout(0, header + 8);
+	offtout(0, header + 16);
+	offtout(newsize, header + 24);
+	if (fwrite(header, 32, 1, pf) != 1)
+		err(1, "fwrite(%s)", argv[2]);
+
+	st.lvl=&levels[level];
+	st.pf=pf;
+	st.dblen=0;st.eblen=0;
+	st.oldpos=0;
+
+	/* A job needs room for the largest segment, SEGMIN at the smallest
+		avg, so a budget too small for that takes fewer jobs */
+	if(budget && (jobs>1) && (budget/jobs<37*(off_t)SEGMIN))
+		jobs=budget/(37*(off_t)SEGMIN);
+
+	/* Whole-file diffing peaks at old+I+V, then old+I+new+db+eb; -f
+		only needs its block index whole, and a budget too small even
+		for that gets windows instead */
+	if((jobs>1) && (newsize>=SEGMIN))
+		bsdiff_segmented(&st,argv[0],argv[1],oldsize,newsize,budget,
+				jobs,fast);
+	else if(fast && (!budget ||
+			fast_slots(oldsize)*(off_t)sizeof(struct fastslot)+8192<=budget))
+		bsdiff_mapped(&st,argv[0],argv[1],oldsize,newsize,budget);
+	else if(budget && (oldsize*17+newsize*3>budget))
+		bsdiff_windowed(&st,argv[0],argv[1],oldsize,newsize,budget);
+	else
+		bsdiff_whole(&st,argv[0],argv[1],oldsize,newsize);
+
+	/* Compute size of compressed ctrl and diff data */
+	if ((len = ftello(pf)) == -1)
+		err(1, "ftello");
+	offtout(len-32-st.dblen-st.eblen, header + 8);
+	offtout(st.dblen, header + 16);
 
 	/* Seek to the beginning, write the header, and close the file */
+	STATS_ADD(bytes_written,len);
 	if (fseeko(pf, 0, SEEK_SET))
 		err(1, "fseeko");
 	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", argv[3]);
+		err(1, "fwrite(%s)", argv[2]);
 	if (fclose(pf))
 		err(1, "fclose");
 
-	/* Free the memory we used */
-	free(db);
-	free(eb);
-	free(I);
-	free(old);
-	free(new);
+	/* fsdiff trims once per run, bsdiff on its own after every diff */
+#ifndef main
+	if(cache_dir) cache_trim(cache_budget,0);
+#endif
+
+	if(dostats) stats_print("bsdiff",statspath);
 
 	return 0;
 }
@@ -35,6 +35,9 @@ __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bspatch/bspatch.c,v 1.1 2005/08/06 01:59:
 #include <err.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
+
+#include "stats.c"
 
 static off_t offtin(u_char *buf)
 {
@@ -68,8 +71,28 @@ int main(int argc,char * argv[])
 	off_t ctrl[3];
 	off_t lenread;
 	off_t i;
+	int ch,dostats;
+	char *statspath;
+	struct stats_timer tm;
+	static struct option longopts[] = {
+		{ "stats", optional_argument, NULL, 'S' },
+		{ NULL, 0, NULL, 0 }
+	};
 
-	if(argc!=4) errx(1,"usage: %s oldfile newfile patchfile\n",argv[0]);
+	dostats=0;statspath=NULL;
+	while((ch=getopt_long(argc,argv,"",longopts,NULL))!=-1) {
+		switch(ch) {
+		case 'S':
+			dostats=1;
+			statspath=optarg;
+			break;
+		default:
+			errx(1,"usage: %s [--stats[=file]] oldfile newfile patchfile\n",argv[0]);
+		}
+	}
+	if(argc-optind!=3) errx(1,"usage: %s [--stats[=file]] oldfile newfile patchfile\n",argv[0]);
+	argv+=optind-1;
+	if(dostats) stats_init();
 
 	/* Open patch file */
 	if ((f = fopen(argv[3], "r")) == NULL)
@@ -132,6 +155,7 @@ int main(int argc,char * argv[])
 	//if ((epfbz2 = BZ2_bzReadOpen(&ebz2err, epf, 0, 0, NULL, 0)) == NULL)
 	//	errx(1, "BZ2_bzReadOpen, bz2err = %d", ebz2err);
 
+	stats_start(&tm);
 	if(((fd=open(argv[1],O_RDONLY,0))<0) ||
 		((oldsize=lseek(fd,0,SEEK_END))==-1) ||
 		((old=malloc(oldsize+1))==NULL) ||
@@ -139,6 +163,9 @@ int main(int argc,char * argv[])
 		(read(fd,old,oldsize)!=oldsize) ||
 		(close(fd)==-1)) err(1,"%s",argv[1]);
 	if((new=malloc(newsize+1))==NULL) err(1,NULL);
+	stats_stop(&tm,ST_READ);
+
+	stats_start(&tm);
 
 	oldpos=0;newpos=0;
 	while(newpos<newsize) {
@@ -194,14 +221,21 @@ int main(int argc,char * argv[])
 	//BZ2_bzReadClose(&ebz2err, epfbz2);
 	if (fclose(cpf) || fclose(dpf) || fclose(epf))
 		err(1, "fclose(%s)", argv[3]);
+	stats_stop(&tm,ST_APPLY);
 
 	/* Write the new file */
+	stats_start(&tm);
 	if(((fd=open(argv[2],O_CREAT|O_TRUNC|O_WRONLY,0666))<0) ||
 		(write(fd,new,newsize)!=newsize) || (close(fd)==-1))
 		err(1,"%s",argv[2]);
+	stats_stop(&tm,ST_WRITE);
+	STATS_ADD(bytes_read,oldsize+newpos);
+	STATS_ADD(bytes_written,newsize);
 
 	free(new);
 	free(old);
 
+	if(dostats) stats_print("bspatch",statspath);
+
 	return 0;
 }
@@ -0,0 +1,200 @@
+/*
+ * On-disk cache for --cache-dir: suffix arrays of old files and the
+ * per-tree checksum manifests of fsdiff, each named after the identity
+ * (device, inode, size, mtime and ctime) of what it was built from, so a
+ * file that changed never hits a stale entry.  Entries are written to a
+ * temporary name and renamed into place, their mtime is the LRU clock,
+ * and cache_trim() drops the least recently used ones over the budget.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char *cache_dir;
+static off_t cache_budget = 1LL << 30;
+
+#define SA_MAGIC	"SUFARR00"
+
+static void cache_name(char *buf, size_t len, const struct stat *sb,
+		const char *ext)
+{
+	snprintf(buf, len, "%s/%llx-%llx-%llx-%llx.%09ld-%llx.%09ld.%s",
+		cache_dir, (unsigned long long)sb->st_dev,
+		(unsigned long long)sb->st_ino, (unsigned long long)sb->st_size,
+		(unsigned long long)sb->st_mtim.tv_sec, sb->st_mtim.tv_nsec,
+		(unsigned long long)sb->st_ctim.tv_sec, sb->st_ctim.tv_nsec, ext);
+}
+
+/* write len bytes to a temporary file and rename it to name */
+static void cache_store(const char *name, const void *hdr, size_t hlen,
+		const void *buf, size_t len)
+{
+	char tmp[PATH_MAX];
+	int fd;
+
+	if(snprintf(tmp, sizeof(tmp), "%s.%d.tmp", name,
+			(int)getpid()) >= (int)sizeof(tmp) ||
+			(fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0)
+		return;
+	if(write(fd, hdr, hlen) != (ssize_t)hlen ||
+			write(fd, buf, len) != (ssize_t)len ||
+			close(fd) != 0 || rename(tmp, name) != 0)
+		unlink(tmp);
+}
+
+/* The suffix array of the old file behind sb, mapped from the cache, or
+ * NULL on a miss.  Unmap (oldsize+1)*sizeof(off_t)+16 bytes at I-2. */
+static off_t *sa_load(const struct stat *sb, off_t oldsize)
+{
+	char name[PATH_MAX];
+	struct stat csb;
+	size_t len = (oldsize + 1) * sizeof(off_t) + 16;
+	off_t *p;
+	int fd;
+
+	cache_name(name, sizeof(name), sb, "sa");
+	if((fd = open(name, O_RDONLY)) < 0) {
+		STATS_ADD(cache_misses, 1);
+		return NULL;
+	}
+	p = MAP_FAILED;
+	if(fstat(fd, &csb) == 0 && csb.st_size == (off_t)len)
+		p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(p != MAP_FAILED && (memcmp(p, SA_MAGIC, 8) || p[1] != oldsize)) {
+		munmap(p, len);
+		p = MAP_FAILED;
+	}
+	if(p == MAP_FAILED) {
+		close(fd);
+		STATS_ADD(cache_misses, 1);
+		return NULL;
+	}
+	futimens(fd, NULL);
+	close(fd);
+	STATS_ADD(cache_hits, 1);
+	return p + 2;
+}
+
+/* an array that cannot fit in the budget would only be trimmed again */
+static void sa_store(const struct stat *sb, const off_t *I, off_t oldsize)
+{
+	char name[PATH_MAX];
+	off_t hdr[2];
+
+	if((oldsize + 1) * (off_t)sizeof(off_t) + 16 > cache_budget)
+		return;
+	cache_name(name, sizeof(name), sb, "sa");
+	memcpy(hdr, SA_MAGIC, 8);
+	hdr[1] = oldsize;
+	cache_store(name, hdr, sizeof(hdr), I, (oldsize + 1) * sizeof(off_t));
+}
+
+struct cache_ent {
+	char *name;
+	off_t size;
+	struct timespec used;
+	void *map;
+};
+
+/* the entries the daemon holds mapped, in no particular order */
+static struct cache_ent *cache_maps;
+static size_t ncache_maps;
+
+static int cache_entcmp(const void *a, const void *b)
+{
+	const struct cache_ent *x = a, *y = b;
+
+	if(x->used.tv_sec != y->used.tv_sec)
+		return x->used.tv_sec < y->used.tv_sec ? 1 : -1;
+	if(x->used.tv_nsec != y->used.tv_nsec)
+		return x->used.tv_nsec < y->used.tv_nsec ? 1 : -1;
+	return 0;
+}
+
+/* Remove the least recently used entries until the rest fit in budget.
+ * With resident set, the survivors stay mapped with MADV_WILLNEED so
+ * the daemon keeps them in the page cache for the next request. */
+static void cache_trim(off_t budget, int resident)
+{
+	DIR *dir;
+	struct dirent *dp;
+	struct stat sb;
+	struct cache_ent *v = NULL;
+	size_t n = 0, size = 0, i, j;
+	char name[PATH_MAX];
+	off_t total = 0;
+	int fd;
+
+	if(!cache_dir || (dir = opendir(cache_dir)) == NULL)
+		return;
+	while((dp = readdir(dir)) != NULL) {
+		i = strlen(dp->d_name);
+		if(i < 3 || (strcmp(dp->d_name + i - 3, ".sa") &&
+				strcmp(dp->d_name + i - 3, ".mf")))
+			continue;
+		snprintf(name, sizeof(name), "%s/%s", cache_dir, dp->d_name);
+		if(stat(name, &sb) != 0)
+			continue;
+		if(n == size) {
+			size = size ? size * 2 : 64;
+			if((v = realloc(v, size * sizeof(*v))) == NULL) {
+				perror("cache");
+				exit(EXIT_FAILURE);
+			}
+		}
+		v[n].name = strdup(name);
+		v[n].size = sb.st_size;
+		v[n].used = sb.st_mtim;
+		v[n].map = NULL;
+		n++;
+	}
+	closedir(dir);
+	qsort(v, n, sizeof(*v), cache_entcmp);
+
+	for(i = 0; i < n; i++) {
+		total += v[i].size;
+		if(total > budget) {
+			unlink(v[i].name);
+			continue;
+		}
+		if(!resident || !v[i].size)
+			continue;
+		for(j = 0; j < ncache_maps; j++)
+			if(cache_maps[j].map && cache_maps[j].size == v[i].size &&
+					!strcmp(cache_maps[j].name, v[i].name)) {
+				v[i].map = cache_maps[j].map;
+				cache_maps[j].map = NULL;
+				break;
+			}
+		if(v[i].map || (fd = open(v[i].name, O_RDONLY)) < 0)
+			continue;
+		v[i].map = mmap(NULL, v[i].size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(v[i].map == MAP_FAILED)
+			v[i].map = NULL;
+		else
+			madvise(v[i].map, v[i].size, MADV_WILLNEED);
+	}
+
+	for(j = 0; j < ncache_maps; j++) {
+		if(cache_maps[j].map)
+			munmap(cache_maps[j].map, cache_maps[j].size);
+		free(cache_maps[j].name);
+	}
+	free(cache_maps);
+	cache_maps = v;
+	ncache_maps = n;
+	if(!resident) {
+		for(j = 0; j < n; j++)
+			free(v[j].name);
+		free(v);
+		cache_maps = NULL;
+		ncache_maps = 0;
+	}
+}
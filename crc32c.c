@@ -0,0 +1,213 @@
+/*
+ * CRC32C (Castagnoli) for the per-file checksums in the archive.  Uses
+ * the SSE4.2 crc32 instruction or the ARMv8 CRC extension when the CPU
+ * has it and a slicing-by-8 table otherwise.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table(void)
+{
+	uint32_t i, j, c;
+
+	for(i = 0; i < 256; i++) {
+		c = i;
+		for(j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crc32c_table[0][i] = c;
+	}
+	for(i = 0; i < 256; i++)
+		for(j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j-1][i] & 0xff];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint32_t lo, hi;
+
+	for(; len >= 8; p += 8, len -= 8) {
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = crc32c_table[7][lo & 0xff] ^
+			crc32c_table[6][(lo >> 8) & 0xff] ^
+			crc32c_table[5][(lo >> 16) & 0xff] ^
+			crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xff] ^
+			crc32c_table[2][(hi >> 8) & 0xff] ^
+			crc32c_table[1][(hi >> 16) & 0xff] ^
+			crc32c_table[0][hi >> 24];
+	}
+	while(len--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c, v;
+
+	for(; len && ((uintptr_t)p & 7); len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	c = crc;
+	for(; len >= 8; p += 8, len -= 8) {
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	crc = c;
+	while(len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+
+static int crc32c_hw_ok(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t v;
+
+	for(; len && ((uintptr_t)p & 7); len--)
+		crc = __crc32cb(crc, *p++);
+	for(; len >= 8; p += 8, len -= 8) {
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+	}
+	while(len--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+
+static int crc32c_hw_ok(void)
+{
+	return 1;
+}
+#else
+#define crc32c_hw crc32c_sw
+static int crc32c_hw_ok(void)
+{
+	return 0;
+}
+#endif
+
+/* continue crc over len bytes of buf, start with crc 0 */
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	static int hw = -1;
+
+	if(hw < 0) {
+		hw = crc32c_hw_ok();
+		if(!hw)
+			crc32c_init_table();
+	}
+	crc = ~crc;
+	crc = hw ? crc32c_hw(crc, buf, len) : crc32c_sw(crc, buf, len);
+	return ~crc;
+}
+
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for(; vec; vec >>= 1, mat++)
+		if(vec & 1)
+			sum ^= *mat;
+	return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for(n = 0; n < 32; n++)
+		square[n] = gf2_times(mat, mat[n]);
+}
+
+/* crc followed by len zero bytes in O(log len), as zlib's crc32_combine:
+ * a zero byte is a linear map on the CRC register, raised to the len-th
+ * power by repeated squaring */
+static uint32_t crc32c_zeros(uint32_t crc, off_t len)
+{
+	uint32_t even[32], odd[32], row, reg = ~crc;
+	int n;
+
+	if(len <= 0)
+		return crc;
+	odd[0] = 0x82f63b78;
+	for(n = 1, row = 1; n < 32; n++, row <<= 1)
+		odd[n] = row;
+	gf2_square(even, odd);
+	gf2_square(odd, even);
+	for(;;) {
+		gf2_square(even, odd);
+		if(len & 1)
+			reg = gf2_times(even, reg);
+		if((len >>= 1) == 0)
+			break;
+		gf2_square(odd, even);
+		if(len & 1)
+			reg = gf2_times(odd, reg);
+		if((len >>= 1) == 0)
+			break;
+	}
+	return ~reg;
+}
+
+/* checksum the whole file behind fd, size gets the number of bytes;
+ * holes found with SEEK_DATA/SEEK_HOLE are folded in without reading */
+static int crc32c_fd(int fd, off_t *size, uint32_t *crc)
+{
+	static unsigned char *buf;
+	ssize_t ret;
+	off_t off = 0, data, hole;
+
+	if(!buf && (buf = malloc(1 << 20)) == NULL)
+		return -1;
+	*crc = 0;
+	for(;;) {
+		data = lseek(fd, off, SEEK_DATA);
+		if(data < 0 && errno == ENXIO) {
+			/* only a hole, or nothing, up to the end */
+			data = lseek(fd, 0, SEEK_END);
+			*crc = crc32c_zeros(*crc, data - off);
+			off = data;
+			break;
+		}
+		hole = -1;
+		if(data >= 0) {
+			*crc = crc32c_zeros(*crc, data - off);
+			off = data;
+			hole = lseek(fd, off, SEEK_HOLE);
+		}
+		/* without SEEK_DATA support this reads to the end */
+		while(hole < 0 || off < hole) {
+			ret = pread(fd, buf, hole < 0 || hole - off > (1 << 20) ?
+					1 << 20 : hole - off, off);
+			if(ret < 0) {
+				if(errno == EINTR)
+					continue;
+				return -1;
+			}
+			if(ret == 0)
+				goto out;
+			*crc = crc32c(*crc, buf, ret);
+			off += ret;
+		}
+	}
+out:
+	*size = off;
+	return 0;
+}
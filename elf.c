@@ -0,0 +1,594 @@
+/*
+ * ELF executables for "elfdiff/" entries, after Courgette.  Relinking
+ * moves code, and every rel32 call or jump and every absolute address in
+ * the relocation and symbol tables that points past the move changes with
+ * it.  Both files are rewritten with those addresses replaced by labels:
+ * the old file numbers its addresses in order, the new one reuses the
+ * label of the old address each of its own corresponds to, so code that
+ * only moved reads the same.  The payload is
+ *
+ *	"ELFDIFF0" size nlabel nrun nextra nexc
+ *	{ label len delta }[nrun] { addr }[nextra] { off }[nexc] patch
+ *
+ * all numbers 8 bytes as in the bsdiff header, followed by a bsdiff patch
+ * from the rewritten old file to the rewritten new one.  A run gives len
+ * labels from label the old file's addresses plus delta, and the extra
+ * addresses take the labels after the old file's.  Only x86-64 is
+ * handled.  rel32 operands are found by scanning the executable sections
+ * for E8, E9 and 0F 8x that land in them, and for the common opcodes
+ * whose ModRM byte addresses rip+disp32 that land in the image.
+ * Rewritten they read ELF_TAG | label, and exc lists the offsets of the
+ * opcodes where that test decides otherwise than the scan of the new
+ * file did.
+ */
+#include <elf.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ELFDIFF_MAGIC	"ELFDIFF0"
+#define ELFDIFF_HEADER	48
+#define ELF_TAG		0x5a000000u
+#define ELF_MAXLABEL	(1 << 24)
+#define ELF_WINDOW	16
+
+enum { ELF_FIND, ELF_LABELS, ELF_EXC };
+
+struct elfsite {
+	off_t off;
+	uint64_t addr;		/* target, or label in a rewritten file */
+	uint64_t next;		/* rel32: address of the next instruction */
+};
+
+struct elfsites {
+	struct elfsite *v;
+	size_t n, cap;
+};
+
+struct elf {
+	struct {
+		off_t off, end;
+		uint64_t addr;
+	} x[32];		/* executable sections, by offset */
+	size_t nx;
+	uint64_t lo, hi;	/* the addresses they cover */
+	uint64_t ilo, ihi;	/* and all allocated sections */
+	struct elfsites rel, abs;
+	off_t *exc;
+	size_t nexc, exccap;
+};
+
+struct elfrun {
+	uint64_t label, len;
+	int64_t delta;
+};
+
+static uint64_t elf_get(const u_char *p, int len)
+{
+	uint64_t v = 0;
+
+	while(len--)
+		v = v << 8 | p[len];
+	return v;
+}
+
+static void elf_put(u_char *p, uint64_t v, int len)
+{
+	for(; len--; v >>= 8)
+		*p++ = v;
+}
+
+static void *elf_grow(void *v, size_t *cap, size_t n, size_t size)
+{
+	if(n < *cap)
+		return v;
+	*cap = *cap ? 2 * *cap : 256;
+	if((v = realloc(v, *cap * size)) == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	return v;
+}
+
+static void elf_site(struct elfsites *s, off_t off, uint64_t addr,
+		uint64_t next)
+{
+	s->v = elf_grow(s->v, &s->cap, s->n, sizeof(*s->v));
+	s->v[s->n].off = off;
+	s->v[s->n].addr = addr;
+	s->v[s->n].next = next;
+	s->n++;
+}
+
+static int elf_sitecmp(const void *a, const void *b)
+{
+	const struct elfsite *x = a, *y = b;
+
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+static void elf_free(struct elf *e)
+{
+	free(e->rel.v);
+	free(e->abs.v);
+	free(e->exc);
+	memset(e, 0, sizeof(*e));
+}
+
+/* The executable sections of buf and the absolute addresses of its
+ * relocation and symbol tables, which are found by position alone and so
+ * read the same way from a rewritten file.  -1 if it is not an x86-64
+ * ELF file this can rewrite. */
+static int elf_parse(struct elf *e, const u_char *buf, off_t size)
+{
+	Elf64_Ehdr eh;
+	Elf64_Shdr sh;
+	off_t off, end;
+	size_t i, j;
+	unsigned type, shndx;
+
+	memset(e, 0, sizeof(*e));
+	if(size < (off_t)sizeof(eh))
+		return -1;
+	memcpy(&eh, buf, sizeof(eh));
+	if(memcmp(eh.e_ident, ELFMAG, SELFMAG) ||
+			eh.e_ident[EI_CLASS] != ELFCLASS64 ||
+			eh.e_ident[EI_DATA] != ELFDATA2LSB ||
+			eh.e_machine != EM_X86_64 ||
+			eh.e_shentsize != sizeof(sh) || eh.e_shoff > (uint64_t)size ||
+			eh.e_shnum > (size - eh.e_shoff) / sizeof(sh))
+		return -1;
+	for(i = 0; i < eh.e_shnum; i++) {
+		memcpy(&sh, buf + eh.e_shoff + i * sizeof(sh), sizeof(sh));
+		if(sh.sh_type == SHT_NOBITS || sh.sh_offset > (uint64_t)size ||
+				sh.sh_size > size - sh.sh_offset)
+			continue;
+		off = sh.sh_offset;
+		end = off + sh.sh_size;
+		if((sh.sh_flags & SHF_ALLOC) && sh.sh_size) {
+			if(!e->ilo || sh.sh_addr < e->ilo)
+				e->ilo = sh.sh_addr;
+			if(sh.sh_addr + sh.sh_size > e->ihi)
+				e->ihi = sh.sh_addr + sh.sh_size;
+		}
+		if(sh.sh_type == SHT_PROGBITS && (sh.sh_flags & SHF_EXECINSTR) &&
+				sh.sh_size >= 5 &&
+				e->nx < sizeof(e->x) / sizeof(*e->x)) {
+			for(j = e->nx++; j > 0 && e->x[j-1].off > off; j--)
+				e->x[j] = e->x[j-1];
+			e->x[j].off = off;
+			e->x[j].end = end;
+			e->x[j].addr = sh.sh_addr;
+			if(!e->lo || sh.sh_addr < e->lo)
+				e->lo = sh.sh_addr;
+			if(sh.sh_addr + sh.sh_size > e->hi)
+				e->hi = sh.sh_addr + sh.sh_size;
+		} else if(sh.sh_type == SHT_RELA && sh.sh_entsize == 24) {
+			for(; off + 24 <= end; off += 24) {
+				elf_site(&e->abs, off, elf_get(buf + off, 8), 0);
+				type = elf_get(buf + off + 8, 4);
+				if(type == R_X86_64_RELATIVE || type == R_X86_64_IRELATIVE)
+					elf_site(&e->abs, off + 16,
+							elf_get(buf + off + 16, 8), 0);
+			}
+		} else if((sh.sh_type == SHT_SYMTAB || sh.sh_type == SHT_DYNSYM) &&
+				sh.sh_entsize == 24) {
+			for(; off + 24 <= end; off += 24) {
+				shndx = elf_get(buf + off + 6, 2);
+				if(shndx != SHN_UNDEF && shndx < SHN_LORESERVE)
+					elf_site(&e->abs, off + 8,
+							elf_get(buf + off + 8, 8), 0);
+			}
+		}
+	}
+	if(!e->nx) {
+		elf_free(e);
+		return -1;
+	}
+	/* overlapping tables could not be rewritten and restored */
+	qsort(e->abs.v, e->abs.n, sizeof(*e->abs.v), elf_sitecmp);
+	for(i = 0, j = 0; i < e->abs.n; i++) {
+		if(i && e->abs.v[i].off < e->abs.v[i-1].off + 8)
+			break;
+		while(j < e->nx && e->x[j].end <= e->abs.v[i].off)
+			j++;
+		if(j < e->nx && e->x[j].off < e->abs.v[i].off + 8)
+			break;
+	}
+	for(j = 1; i == e->abs.n && j < e->nx; j++)
+		if(e->x[j].off < e->x[j-1].end)
+			break;
+	if(i < e->abs.n || j < e->nx) {
+		elf_free(e);
+		return -1;
+	}
+	return 0;
+}
+
+/* opcodes taking a ModRM operand, one byte and after 0F, as 1 + the size
+ * of the immediate that follows; a wrong guess only costs a label */
+static const u_char elf_modrm1[256] = {
+	[0x01] = 1, [0x03] = 1, [0x09] = 1, [0x0b] = 1, [0x11] = 1, [0x13] = 1,
+	[0x19] = 1, [0x1b] = 1, [0x21] = 1, [0x23] = 1, [0x29] = 1, [0x2b] = 1,
+	[0x31] = 1, [0x33] = 1, [0x39] = 1, [0x3b] = 1, [0x63] = 1, [0x84] = 1,
+	[0x85] = 1, [0x86] = 1, [0x87] = 1, [0x88] = 1, [0x89] = 1, [0x8a] = 1,
+	[0x8b] = 1, [0x8d] = 1, [0xd1] = 1, [0xd3] = 1, [0xfe] = 1, [0xff] = 1,
+	[0x6b] = 2, [0x80] = 2, [0x82] = 2, [0x83] = 2, [0xc0] = 2, [0xc1] = 2,
+	[0xc6] = 2, [0xf6] = 2,
+	[0x69] = 5, [0x81] = 5, [0xc7] = 5, [0xf7] = 5,
+};
+static const u_char elf_modrm2[256] = {
+	[0x10] = 1, [0x11] = 1, [0x12] = 1, [0x13] = 1, [0x16] = 1, [0x17] = 1,
+	[0x28] = 1, [0x29] = 1, [0x2a] = 1, [0x2c] = 1, [0x2d] = 1, [0x2e] = 1,
+	[0x2f] = 1, [0x40] = 1, [0x41] = 1, [0x42] = 1, [0x43] = 1, [0x44] = 1,
+	[0x45] = 1, [0x46] = 1, [0x47] = 1, [0x48] = 1, [0x49] = 1, [0x4a] = 1,
+	[0x4b] = 1, [0x4c] = 1, [0x4d] = 1, [0x4e] = 1, [0x4f] = 1, [0x51] = 1,
+	[0x54] = 1, [0x55] = 1, [0x56] = 1, [0x57] = 1, [0x58] = 1, [0x59] = 1,
+	[0x5a] = 1, [0x5b] = 1, [0x5c] = 1, [0x5d] = 1, [0x5e] = 1, [0x5f] = 1,
+	[0x6e] = 1, [0x6f] = 1, [0x7e] = 1, [0x7f] = 1, [0xaf] = 1, [0xb6] = 1,
+	[0xb7] = 1, [0xbe] = 1, [0xbf] = 1, [0xd6] = 1, [0xe7] = 1,
+	[0x70] = 2, [0xba] = 2, [0xc2] = 2, [0xc6] = 2,
+};
+
+/* Find the rel32 operands of the executable sections of buf.  ELF_FIND
+ * keeps those that land in them.  ELF_LABELS keeps those that read as one
+ * of nlabel labels, except at the offsets in e->exc.  ELF_EXC decides as
+ * ELF_LABELS would without exceptions and lists those where it disagrees
+ * with truth, the ELF_FIND sites of the file before rewriting. */
+static void elf_scan(struct elf *e, const u_char *buf, int mode,
+		uint64_t nlabel, const struct elf *truth)
+{
+	size_t i, k = 0, t = 0;
+	off_t p, d;
+	uint64_t v, next, addr;
+	int site, guess, branch, imm;
+
+	e->rel.n = 0;
+	if(mode == ELF_EXC)
+		e->nexc = 0;
+	for(i = 0; i < e->nx; i++)
+		for(p = e->x[i].off; p + 5 <= e->x[i].end; ) {
+			branch = 1;
+			imm = 0;
+			if(buf[p] == 0xe8 || buf[p] == 0xe9)
+				d = p + 1;
+			else if(buf[p] == 0x0f && (buf[p+1] & 0xf0) == 0x80)
+				d = p + 2;
+			else if((branch = 0) || (buf[p] == 0x0f &&
+					elf_modrm2[buf[p+1]] && (buf[p+2] & 0xc7) == 0x05)) {
+				d = p + 3;
+				imm = elf_modrm2[buf[p+1]] - 1;
+			} else if(elf_modrm1[buf[p]] && (buf[p+1] & 0xc7) == 0x05) {
+				d = p + 2;
+				imm = elf_modrm1[buf[p]] - 1;
+			} else {
+				p++;
+				continue;
+			}
+			if(d + 4 > e->x[i].end)
+				break;
+			v = elf_get(buf + d, 4);
+			next = e->x[i].addr + (d + 4 + imm - e->x[i].off);
+			if(mode == ELF_FIND) {
+				addr = next + (int64_t)(int32_t)v;
+				site = branch ? addr >= e->lo && addr < e->hi :
+					addr >= e->ilo && addr < e->ihi;
+			} else {
+				addr = v & (ELF_MAXLABEL - 1);
+				site = (v & ~(uint64_t)(ELF_MAXLABEL - 1)) == ELF_TAG &&
+					addr < nlabel;
+			}
+			if(mode == ELF_LABELS) {
+				while(k < e->nexc && e->exc[k] < p)
+					k++;
+				if(k < e->nexc && e->exc[k] == p)
+					site = !site;
+			} else if(mode == ELF_EXC) {
+				while(t < truth->rel.n && truth->rel.v[t].off < d)
+					t++;
+				guess = site;
+				site = t < truth->rel.n && truth->rel.v[t].off == d;
+				if(site != guess) {
+					e->exc = elf_grow(e->exc, &e->exccap, e->nexc,
+							sizeof(*e->exc));
+					e->exc[e->nexc++] = p;
+				}
+			}
+			if(!site) {
+				p++;
+				continue;
+			}
+			elf_site(&e->rel, d, addr, next);
+			p = d + 4;
+		}
+}
+
+static int elf_addrcmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* the distinct addresses the sites of e refer to, in order */
+static uint64_t *elf_addrs(const struct elf *e, size_t *n)
+{
+	uint64_t *v;
+	size_t i, j;
+
+	if((v = malloc((e->rel.n + e->abs.n + 1) * sizeof(*v))) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < e->rel.n; i++)
+		v[i] = e->rel.v[i].addr;
+	for(j = 0; j < e->abs.n; j++)
+		v[i + j] = e->abs.v[j].addr;
+	qsort(v, i + j, sizeof(*v), elf_addrcmp);
+	for(*n = 0, j = 0; j < i + e->abs.n; j++)
+		if(!*n || v[*n-1] != v[j])
+			v[(*n)++] = v[j];
+	return v;
+}
+
+static size_t elf_index(const uint64_t *v, size_t n, uint64_t addr)
+{
+	size_t lo = 0, hi = n, mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(v[mid] < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* what precedes a site: the opcode and a few bytes before it, which stay
+ * the same when only addresses change */
+static uint64_t elf_key(const u_char *buf, off_t off, int abs)
+{
+	return (off >= 6 ? elf_get(buf + off - 6, 6) : 0) << 1 | abs;
+}
+
+struct elfvote {
+	size_t j, i, n;
+};
+
+static int elf_votecmp(const void *a, const void *b)
+{
+	const struct elfvote *x = a, *y = b;
+
+	if(x->j != y->j)
+		return x->j < y->j ? -1 : 1;
+	return x->i < y->i ? -1 : x->i > y->i;
+}
+
+static int elf_votencmp(const void *a, const void *b)
+{
+	const struct elfvote *x = a, *y = b;
+
+	return x->n > y->n ? -1 : x->n < y->n;
+}
+
+/* the sites of e, rel32 then absolute, as keys and address indices */
+static size_t elf_seq(const struct elf *e, const u_char *buf,
+		const uint64_t *addrs, size_t n, uint64_t **key, size_t **idx)
+{
+	size_t i, k = 0, len = e->rel.n + e->abs.n;
+
+	if((*key = malloc((len + 1) * sizeof(**key))) == NULL ||
+			(*idx = malloc((len + 1) * sizeof(**idx))) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < e->rel.n; i++, k++) {
+		(*key)[k] = elf_key(buf, e->rel.v[i].off - 1, 0);
+		(*idx)[k] = elf_index(addrs, n, e->rel.v[i].addr);
+	}
+	for(i = 0; i < e->abs.n; i++, k++) {
+		(*key)[k] = elf_key(buf, e->abs.v[i].off, 1);
+		(*idx)[k] = elf_index(addrs, n, e->abs.v[i].addr);
+	}
+	return len;
+}
+
+/* Give the new addresses b the labels of the old addresses a they stand
+ * for.  The sites of both files are paired up in order by what precedes
+ * them, resynchronising on two equal keys within ELF_WINDOW after a
+ * mismatch, and every pair votes for its old address as the label of its
+ * new one.  Addresses left over take the label the delta of the nearest
+ * labelled address gives them if that one is free, and the rest become
+ * extra labels after the old ones, which nothing in the rewritten old
+ * file reads.  NULL when there are too many labels. */
+__attribute__((unused))
+static uint32_t *elf_align(const struct elf *oe, const u_char *obuf,
+		const uint64_t *a, size_t n, const struct elf *ne,
+		const u_char *nbuf, const uint64_t *b, size_t m,
+		struct elfrun **runs, size_t *nrun, uint64_t **extra,
+		size_t *nextra)
+{
+	uint32_t *labels;
+	uint64_t *okey, *nkey, delta;
+	size_t *oidx, *nidx, *owner, no, nn, i, j, k, di, dj, w, nv = 0;
+	size_t runcap = 0, extracap = 0;
+	struct elfvote *v;
+	int found, pass;
+
+	*runs = NULL;
+	*extra = NULL;
+	*nrun = *nextra = 0;
+	if(n >= ELF_MAXLABEL)
+		return NULL;
+	no = elf_seq(oe, obuf, a, n, &okey, &oidx);
+	nn = elf_seq(ne, nbuf, b, m, &nkey, &nidx);
+	labels = malloc((m + 1) * sizeof(*labels));
+	owner = malloc((n + 1) * sizeof(*owner));
+	v = malloc((nn + 1) * sizeof(*v));
+	if(!labels || !owner || !v) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0, j = 0; i < no && j < nn; ) {
+		if(okey[i] == nkey[j]) {
+			v[nv].j = nidx[j++];
+			v[nv].i = oidx[i++];
+			v[nv++].n = 1;
+			continue;
+		}
+		for(found = 0, w = 1; !found && w < ELF_WINDOW; w++)
+			for(di = 0; di <= w; di++) {
+				dj = w - di;
+				if(i + di + 1 < no && j + dj + 1 < nn &&
+						okey[i+di] == nkey[j+dj] &&
+						okey[i+di+1] == nkey[j+dj+1]) {
+					found = 1;
+					break;
+				}
+			}
+		if(found) {
+			i += di;
+			j += dj;
+		} else {
+			i++;
+			j++;
+		}
+	}
+
+	/* the old address most pairs vote for, strongest claims first */
+	qsort(v, nv, sizeof(*v), elf_votecmp);
+	for(k = 0, i = 0; i < nv; i++) {
+		if(k && v[k-1].j == v[i].j && v[k-1].i == v[i].i) {
+			v[k-1].n++;
+			continue;
+		}
+		if(k && v[k-1].j == v[i].j && v[k-1].n > 1)
+			continue;
+		v[k++] = v[i];
+	}
+	nv = k;
+	qsort(v, nv, sizeof(*v), elf_votencmp);
+	for(i = 0; i < n; i++)
+		owner[i] = m;
+	for(j = 0; j < m; j++)
+		labels[j] = ELF_MAXLABEL;
+	for(k = 0; k < nv; k++)
+		if(labels[v[k].j] == ELF_MAXLABEL && owner[v[k].i] == m) {
+			labels[v[k].j] = v[k].i;
+			owner[v[k].i] = v[k].j;
+		}
+
+	/* the rest by the delta of a labelled neighbour, either side */
+	for(pass = 0; pass < 2; pass++)
+		for(k = 0, delta = 0, found = 0; k < m; k++) {
+			j = pass ? m - 1 - k : k;
+			if(labels[j] != ELF_MAXLABEL) {
+				delta = b[j] - a[labels[j]];
+				found = 1;
+				continue;
+			}
+			if(!found)
+				continue;
+			i = elf_index(a, n, b[j] - delta);
+			if(i < n && a[i] == b[j] - delta && owner[i] == m) {
+				labels[j] = i;
+				owner[i] = j;
+			}
+		}
+
+	for(i = 0; i < n; i++) {
+		if(owner[i] == m)
+			continue;
+		delta = b[owner[i]] - a[i];
+		if(!*nrun || (*runs)[*nrun-1].delta != (int64_t)delta ||
+				(*runs)[*nrun-1].label + (*runs)[*nrun-1].len != i) {
+			*runs = elf_grow(*runs, &runcap, *nrun, sizeof(**runs));
+			(*runs)[*nrun].label = i;
+			(*runs)[*nrun].len = 0;
+			(*runs)[*nrun].delta = delta;
+			(*nrun)++;
+		}
+		(*runs)[*nrun-1].len++;
+	}
+	for(j = 0; j < m; j++) {
+		if(labels[j] != ELF_MAXLABEL)
+			continue;
+		if(n + *nextra + 1 >= ELF_MAXLABEL) {
+			free(labels);
+			free(*runs);
+			free(*extra);
+			labels = NULL;
+			break;
+		}
+		*extra = elf_grow(*extra, &extracap, *nextra, sizeof(**extra));
+		(*extra)[*nextra] = b[j];
+		labels[j] = n + (*nextra)++;
+	}
+	free(okey);
+	free(nkey);
+	free(oidx);
+	free(nidx);
+	free(owner);
+	free(v);
+	return labels;
+}
+
+/* the address of every label of the new file, from the old addresses a */
+static uint64_t *elf_table(const uint64_t *a, size_t n, const struct elfrun *runs,
+		size_t nrun, const uint64_t *extra, size_t nextra)
+{
+	uint64_t *addr;
+	size_t i, k;
+
+	if((addr = calloc(n + nextra + 1, sizeof(*addr))) == NULL)
+		return NULL;
+	for(i = 0; i < nrun; i++) {
+		if(runs[i].label > n || runs[i].len > n - runs[i].label) {
+			free(addr);
+			return NULL;
+		}
+		for(k = 0; k < runs[i].len; k++)
+			addr[runs[i].label + k] = a[runs[i].label + k] + runs[i].delta;
+	}
+	memcpy(addr + n, extra, nextra * sizeof(*extra));
+	return addr;
+}
+
+/* replace the address of every site by its label: its index in addrs,
+ * or labels[] of that index */
+static void elf_encode(const struct elf *e, u_char *buf, const uint64_t *addrs,
+		size_t n, const uint32_t *labels)
+{
+	size_t i, k;
+
+	for(i = 0; i < e->rel.n; i++) {
+		k = elf_index(addrs, n, e->rel.v[i].addr);
+		elf_put(buf + e->rel.v[i].off, ELF_TAG | (labels ? labels[k] : k), 4);
+	}
+	for(i = 0; i < e->abs.n; i++) {
+		k = elf_index(addrs, n, e->abs.v[i].addr);
+		elf_put(buf + e->abs.v[i].off, labels ? labels[k] : k, 8);
+	}
+}
+
+/* the inverse, for e scanned with ELF_LABELS and addr from elf_table() */
+static int elf_decode(const struct elf *e, u_char *buf, const uint64_t *addr,
+		uint64_t nlabel)
+{
+	size_t i;
+
+	for(i = 0; i < e->rel.n; i++) {
+		if(e->rel.v[i].addr >= nlabel)
+			return -1;
+		elf_put(buf + e->rel.v[i].off,
+				addr[e->rel.v[i].addr] - e->rel.v[i].next, 4);
+	}
+	for(i = 0; i < e->abs.n; i++) {
+		if(e->abs.v[i].addr >= nlabel)
+			return -1;
+		elf_put(buf + e->abs.v[i].off, addr[e->abs.v[i].addr], 8);
+	}
+	return 0;
+}
@@ -0,0 +1,1032 @@
+/*
+ * fscompose: squash a chain of fsdiff archives, v1->v2, v2->v3, ..., into
+ * one v1->vN archive using only the archives.
+ *
+ * The contents of every file that changes are kept as a list of segments
+ * relative to v1: a copy from the v1 file plus bsdiff diff bytes, literal
+ * bytes, or zeros.  A bsdiff patch maps the list of the previous version
+ * onto a new one, which composes the ctrl streams without the base, and
+ * a sparse payload overlays it.  Added files start out as one literal
+ * segment, so later diffs of them are applied in memory.  A "zdiff/" or
+ * "elfdiff/" is passed through as it is.
+ *
+ * The result lists deletes first, children before their parents, then
+ * adds and diffs, parents first, then copies and hard links.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <libtar.h>
+
+#include "stats.c"
+#include "sparse.c"
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+
+/* the v1 file, wider than any real one: bspatch reads past its end as
+ * zeros, just like a copy past the end of a composed identity */
+#define IDENTITY ((off_t)1 << 62)
+
+enum { SEG_COPY, SEG_DATA, SEG_ZERO };
+
+struct seg {
+	off_t at, len;
+	off_t pos;		/* SEG_COPY: offset in the v1 file */
+	const u_char *data;	/* diff bytes (NULL for none) or literal bytes */
+	int kind;
+};
+
+struct segs {
+	struct seg *v;
+	size_t n, cap;
+	off_t size;
+};
+
+enum { R_NONE, R_DELETED, R_FILE, R_ENTRY };
+
+struct rec {
+	char *path;
+	int state;
+	int inv1;		/* the path exists in v1 */
+	int diff;		/* R_FILE contents are relative to the v1 file */
+	int sparse;		/* a sparse payload took part */
+	int linked;		/* archive a hard link entry came from */
+	int copy;		/* R_ENTRY is a "copy/" of linkname */
+	const char *opaque;	/* R_FILE is a payload of this verb, kept as is */
+	int touched;		/* archive of the last change */
+	struct segs segs;
+	struct tar_header th, delth;
+	char *linkname;
+	/* checksums: the v1 file and the latest result */
+	int haspre, haspost, sumarch;
+	unsigned long long presize, postsize, ksumpre, ksumpost;
+	unsigned int precrc, postcrc, ksumprecrc, ksumpostcrc;
+};
+
+static struct rec *recs;
+static size_t nrecs, recscap, *rechash, rechashsize;
+static int nosums;
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if(!p) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void die(const char *path, const char *msg)
+{
+	fprintf(stderr, "%s: %s\n", path, msg);
+	exit(EXIT_FAILURE);
+}
+
+static off_t offtin(const u_char *buf)
+{
+	off_t y;
+
+	y=buf[7]&0x7F;
+	y=y*256;y+=buf[6];
+	y=y*256;y+=buf[5];
+	y=y*256;y+=buf[4];
+	y=y*256;y+=buf[3];
+	y=y*256;y+=buf[2];
+	y=y*256;y+=buf[1];
+	y=y*256;y+=buf[0];
+
+	if(buf[7]&0x80) y=-y;
+
+	return y;
+}
+
+static void offtout(off_t x, u_char *buf)
+{
+	off_t y;
+
+	if(x<0) y=-x; else y=x;
+
+		buf[0]=y%256;y-=buf[0];
+	y=y/256;buf[1]=y%256;y-=buf[1];
+	y=y/256;buf[2]=y%256;y-=buf[2];
+	y=y/256;buf[3]=y%256;y-=buf[3];
+	y=y/256;buf[4]=y%256;y-=buf[4];
+	y=y/256;buf[5]=y%256;y-=buf[5];
+	y=y/256;buf[6]=y%256;y-=buf[6];
+	y=y/256;buf[7]=y%256;
+
+	if(x<0) buf[7]|=0x80;
+}
+
+/* append a segment, merged into the last one when it continues it */
+static void seg_push(struct segs *s, int kind, off_t pos, off_t len,
+		const u_char *data)
+{
+	struct seg *l = s->n ? &s->v[s->n-1] : NULL;
+
+	if(len <= 0)
+		return;
+	if(l && l->kind == kind && (kind == SEG_ZERO ||
+			((kind == SEG_DATA || l->pos + l->len == pos) &&
+			(l->data ? data == l->data + l->len : !data)))) {
+		l->len += len;
+		s->size += len;
+		return;
+	}
+	if(s->n == s->cap) {
+		s->cap = s->cap ? 2 * s->cap : 16;
+		if((s->v = realloc(s->v, s->cap * sizeof(*s->v))) == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	l = &s->v[s->n++];
+	l->at = s->size;
+	l->len = len;
+	l->pos = pos;
+	l->data = data;
+	l->kind = kind;
+	s->size += len;
+}
+
+/* index of the segment holding byte off, which must be < s->size */
+static size_t seg_find(const struct segs *s, off_t off)
+{
+	size_t lo = 0, hi = s->n;
+
+	while(hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if(s->v[mid].at <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* append bytes [from, to) of cur to out */
+static void seg_copy(const struct segs *cur, struct segs *out, off_t from,
+		off_t to)
+{
+	const struct seg *s;
+	size_t i;
+	off_t k, n;
+
+	for(i = from < to ? seg_find(cur, from) : 0; from < to; i++) {
+		s = &cur->v[i];
+		k = from - s->at;
+		n = MIN(to - from, s->len - k);
+		if(s->kind == SEG_COPY)
+			seg_push(out, SEG_COPY, s->pos + k, n, s->data ? s->data + k : NULL);
+		else
+			seg_push(out, s->kind, 0, n, s->data ? s->data + k : NULL);
+		from += n;
+	}
+}
+
+/* bytes of a plus diff bytes d, a may be NULL for zeros */
+static const u_char *add_bytes(const u_char *a, const u_char *d, off_t n)
+{
+	u_char *p;
+	off_t i;
+
+	if(!a)
+		return d;
+	p = xmalloc(n);
+	for(i = 0; i < n; i++)
+		p[i] = a[i] + d[i];
+	return p;
+}
+
+/* Map cur through a bsdiff patch: each copy of [oldpos, oldpos+x) is cut
+ * at cur's segment boundaries and its diff bytes folded into them */
+static int apply_bsdiff(struct segs *cur, const u_char *p, off_t len)
+{
+	struct segs out = { NULL, 0, 0, 0 };
+	const u_char *ctrl, *diff, *extra, *end = p + len;
+	off_t ctrllen, difflen, newsize, oldpos = 0, x, y, z, pos, n;
+	const struct seg *s;
+	off_t k;
+
+	if(len < 32 || memcmp(p, "BSDIFFXX", 8))
+		return -1;
+	ctrllen = offtin(p + 8);
+	difflen = offtin(p + 16);
+	newsize = offtin(p + 24);
+	if(ctrllen < 0 || difflen < 0 || newsize < 0 || ctrllen % 24 ||
+			ctrllen > len - 32 || difflen > len - 32 - ctrllen)
+		return -1;
+	ctrl = p + 32;
+	diff = ctrl + ctrllen;
+	extra = diff + difflen;
+	for(; ctrl < p + 32 + ctrllen; ctrl += 24) {
+		x = offtin(ctrl);
+		y = offtin(ctrl + 8);
+		z = offtin(ctrl + 16);
+		if(x < 0 || y < 0 || x > p + 32 + ctrllen + difflen - diff ||
+				y > end - extra || out.size + x + y > newsize)
+			return -1;
+		for(pos = oldpos; pos < oldpos + x; pos += n, diff += n) {
+			if(pos < 0 || pos >= cur->size) {
+				/* bspatch reads zeros outside the old file */
+				n = pos < 0 ? MIN(oldpos + x - pos, -pos) : oldpos + x - pos;
+				seg_push(&out, SEG_DATA, 0, n, diff);
+				continue;
+			}
+			s = &cur->v[seg_find(cur, pos)];
+			k = pos - s->at;
+			n = MIN(oldpos + x - pos, s->len - k);
+			if(s->kind == SEG_COPY)
+				seg_push(&out, SEG_COPY, s->pos + k, n,
+					add_bytes(s->data ? s->data + k : NULL, diff, n));
+			else
+				seg_push(&out, SEG_DATA, 0, n,
+					add_bytes(s->data ? s->data + k : NULL, diff, n));
+		}
+		seg_push(&out, SEG_DATA, 0, y, extra);
+		extra += y;
+		oldpos += x + z;
+	}
+	seg_push(&out, SEG_ZERO, 0, newsize - out.size, NULL);
+	free(cur->v);
+	*cur = out;
+	return 0;
+}
+
+/* Overlay a sparse payload (see sparse.c) onto cur */
+static int apply_sparse(struct segs *cur, const u_char *p, off_t len)
+{
+	struct segs out = { NULL, 0, 0, 0 };
+	const u_char *rec, *data;
+	off_t size, n, i, off, l, pos = 0, keep;
+
+	if(len < SPARSE_HEADER || memcmp(p, SPARSE_MAGIC, 8))
+		return -1;
+	size = offtin(p + 8);
+	n = offtin(p + 16);
+	if(size < 0 || n < 0 || n > (len - SPARSE_HEADER) / 16)
+		return -1;
+	rec = p + SPARSE_HEADER;
+	data = rec + 16 * n;
+	keep = MIN(size, cur->size);
+	for(i = 0; i < n; i++, rec += 16) {
+		off = offtin(rec);
+		l = offtin(rec + 8);
+		if(off < pos || (l > 0 && l > p + len - data))
+			return -1;
+		if(off >= size)
+			break;
+		seg_copy(cur, &out, pos, MIN(off, keep));
+		seg_push(&out, SEG_ZERO, 0, off - out.size, NULL);
+		if(l > 0) {
+			seg_push(&out, SEG_DATA, 0, MIN(l, size - off), data);
+			data += l;
+		} else
+			seg_push(&out, SEG_ZERO, 0, MIN(-l, size - off), NULL);
+		pos = out.size;
+	}
+	seg_copy(cur, &out, pos, keep);
+	seg_push(&out, SEG_ZERO, 0, size - out.size, NULL);
+	free(cur->v);
+	*cur = out;
+	return 0;
+}
+
+static size_t hashstr(const char *s)
+{
+	size_t h = 5381;
+
+	while(*s)
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
+static struct rec *rec_find(const char *path)
+{
+	size_t h;
+
+	if(!rechashsize)
+		return NULL;
+	for(h = hashstr(path) & (rechashsize - 1); rechash[h];
+			h = (h + 1) & (rechashsize - 1))
+		if(!strcmp(recs[rechash[h]-1].path, path))
+			return &recs[rechash[h]-1];
+	return NULL;
+}
+
+static struct rec *rec_get(const char *path)
+{
+	struct rec *r = rec_find(path);
+	size_t i, h;
+
+	if(r)
+		return r;
+	if(2 * (nrecs + 1) > rechashsize) {
+		free(rechash);
+		rechashsize = rechashsize ? 2 * rechashsize : 1024;
+		rechash = calloc(rechashsize, sizeof(*rechash));
+		if(!rechash) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for(i = 0; i < nrecs; i++) {
+			for(h = hashstr(recs[i].path) & (rechashsize - 1); rechash[h];
+					h = (h + 1) & (rechashsize - 1))
+				;
+			rechash[h] = i + 1;
+		}
+	}
+	if(nrecs == recscap) {
+		recscap = recscap ? 2 * recscap : 1024;
+		if((recs = realloc(recs, recscap * sizeof(*recs))) == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	r = &recs[nrecs];
+	memset(r, 0, sizeof(*r));
+	r->path = strdup(path);
+	r->sumarch = -1;
+	for(h = hashstr(path) & (rechashsize - 1); rechash[h];
+			h = (h + 1) & (rechashsize - 1))
+		;
+	rechash[h] = ++nrecs;
+	return r;
+}
+
+/* the whole payload of the current entry, its padding is consumed */
+static u_char *read_payload(TAR *t, off_t size)
+{
+	off_t pad = (T_BLOCKSIZE - size % T_BLOCKSIZE) % T_BLOCKSIZE;
+	u_char *p = xmalloc(size + pad);
+	off_t done;
+	ssize_t ret;
+
+	for(done = 0; done < size + pad; done += ret) {
+		ret = read(tar_fd(t), p + done, size + pad - done);
+		if(ret == -1 && errno == EINTR)
+			ret = 0;
+		else if(ret <= 0)
+			return NULL;
+	}
+	STATS_ADD(bytes_read, size + pad);
+	return p;
+}
+
+static void keep_header(TAR *t, struct tar_header *th)
+{
+	*th = t->th_buf;
+	th->gnu_longname = NULL;
+	th->gnu_longlink = NULL;
+}
+
+/* note the checksum records of archive k on their paths */
+static void read_sums(const char *buf, size_t size, int k)
+{
+	const char *p;
+	unsigned long long presize, postsize;
+	unsigned int precrc, postcrc;
+	char verb;
+	int len;
+	struct rec *r;
+
+	for(p = buf; p < buf + size; p += strlen(p) + 1) {
+		if(sscanf(p, "%c %llx %x %llx %x %n", &verb, &presize, &precrc,
+				&postsize, &postcrc, &len) != 5)
+			continue;
+		r = rec_get(p + len);
+		r->sumarch = k;
+		r->ksumpre = presize;
+		r->ksumprecrc = precrc;
+		r->ksumpost = postsize;
+		r->ksumpostcrc = postcrc;
+	}
+}
+
+/* the latest contents of r came from archive k */
+static void take_sum(struct rec *r, int k, int first)
+{
+	r->haspost = r->sumarch == k;
+	r->postsize = r->ksumpost;
+	r->postcrc = r->ksumpostcrc;
+	if(first) {
+		r->haspre = r->sumarch == k;
+		r->presize = r->ksumpre;
+		r->precrc = r->ksumprecrc;
+	}
+}
+
+/* the first change of a path that was not added must be to a v1 entry,
+ * whose header is kept for deleting it */
+static void first_touch(TAR *t, struct rec *r)
+{
+	if(r->touched)
+		return;
+	r->inv1 = 1;
+	keep_header(t, &r->delth);
+}
+
+static void op_delete(TAR *t, struct rec *r, int k)
+{
+	if(r->state == R_DELETED || (r->state == R_NONE && r->touched))
+		die(r->path, "deleted but not there");
+	first_touch(t, r);
+	r->state = r->inv1 ? R_DELETED : R_NONE;
+	r->haspost = 0;
+	r->touched = k;
+}
+
+static void op_add(TAR *t, struct rec *r, int k, int sparse, int *tarerr)
+{
+	off_t size = th_get_size(t);
+	u_char *p;
+
+	/* fsdiff deletes whatever an add replaces */
+	if(r->state == R_FILE || r->state == R_ENTRY)
+		die(r->path, "added over an existing entry");
+	keep_header(t, &r->th);
+	free(r->linkname);
+	r->linkname = NULL;
+	free(r->segs.v);
+	memset(&r->segs, 0, sizeof(r->segs));
+	r->copy = 0;
+	r->opaque = NULL;
+	r->diff = 0;
+	r->sparse = sparse;
+	r->touched = k;
+	r->haspre = 0;
+	if(!TH_ISREG(t) && !sparse) {
+		r->state = R_ENTRY;
+		if(TH_ISLNK(t) || TH_ISSYM(t))
+			r->linkname = strdup(th_get_linkname(t));
+		r->linked = k;
+		r->haspost = 0;
+		return;
+	}
+	r->state = R_FILE;
+	if((p = read_payload(t, size)) == NULL) {
+		*tarerr = 1;
+		return;
+	}
+	if(sparse) {
+		if(apply_sparse(&r->segs, p, size) != 0)
+			die(r->path, "corrupt sparse payload");
+	} else
+		seg_push(&r->segs, SEG_DATA, 0, size, p);
+	take_sum(r, k, 0);
+}
+
+static void op_diff(TAR *t, struct rec *r, int k, int sparse, int *tarerr)
+{
+	off_t size = th_get_size(t);
+	int first = 0;
+	u_char *p;
+	struct stats_timer tm;
+
+	if(r->state == R_NONE && !r->touched) {
+		first_touch(t, r);
+		r->diff = 1;
+		r->state = R_FILE;
+		seg_push(&r->segs, SEG_COPY, 0, IDENTITY, NULL);
+		first = 1;
+	}
+	if(r->state != R_FILE)
+		die(r->path, "patched but not a file at that point");
+	if(r->opaque)
+		die(r->path, "patched after a zdiff or elfdiff, use fsdiff "
+			"--no-zdiff --no-elfdiff");
+	keep_header(t, &r->th);
+	r->sparse |= sparse;
+	r->touched = k;
+	if((p = read_payload(t, size)) == NULL) {
+		*tarerr = 1;
+		return;
+	}
+	stats_start(&tm);
+	if((sparse ? apply_sparse(&r->segs, p, size) :
+			apply_bsdiff(&r->segs, p, size)) != 0)
+		die(r->path, "corrupt patch");
+	stats_stop(&tm, ST_APPLY);
+	take_sum(r, k, first);
+}
+
+/* A "zdiff/" or "elfdiff/" is made against a rewritten form of the v1
+ * file, which the segments cannot express; it goes through as it is when
+ * it is the only change of the path */
+static void op_opaque(TAR *t, struct rec *r, int k, const char *verb,
+		int *tarerr)
+{
+	off_t size = th_get_size(t);
+	u_char *p;
+
+	if(r->state != R_NONE || r->touched)
+		die(r->path, "zdiff or elfdiff of a changed file, use fsdiff "
+			"--no-zdiff --no-elfdiff");
+	first_touch(t, r);
+	keep_header(t, &r->th);
+	r->state = R_FILE;
+	r->diff = 1;
+	r->opaque = verb;
+	r->touched = k;
+	if((p = read_payload(t, size)) == NULL) {
+		*tarerr = 1;
+		return;
+	}
+	seg_push(&r->segs, SEG_DATA, 0, size, p);
+	take_sum(r, k, 1);
+}
+
+/* A "copy/" takes the contents its source has in archive k.  Contents
+ * held in memory are copied over as an add; a source that is a diff of
+ * its own v1 file stays a copy entry, as does a copy of a copy, which is
+ * pointed at the original source. */
+static void op_copy(TAR *t, struct rec *r, int k)
+{
+	struct rec *src = rec_find(th_get_linkname(t));
+	char *linkname;
+
+	if(!src || src->touched != k ||
+			(src->state != R_FILE && (src->state != R_ENTRY || !src->copy)))
+		die(r->path, "copy of a file the archive did not write");
+	if(r->state == R_FILE || r->state == R_ENTRY)
+		die(r->path, "copied over an existing entry");
+	keep_header(t, &r->th);
+	memset(r->th.linkname, 0, sizeof(r->th.linkname));
+	linkname = strdup(src->state == R_FILE ? src->path : src->linkname);
+	free(r->linkname);
+	r->linkname = NULL;
+	free(r->segs.v);
+	memset(&r->segs, 0, sizeof(r->segs));
+	r->touched = k;
+	r->haspre = 0;
+	r->copy = 0;
+	r->opaque = NULL;
+	if(src->state == R_FILE && !src->diff) {
+		r->state = R_FILE;
+		r->diff = 0;
+		r->sparse = src->sparse;
+		r->segs = src->segs;
+		r->segs.cap = r->segs.n;
+		r->segs.v = xmalloc(r->segs.n * sizeof(*r->segs.v));
+		memcpy(r->segs.v, src->segs.v, r->segs.n * sizeof(*r->segs.v));
+		take_sum(r, k, 0);
+		free(linkname);
+		return;
+	}
+	r->state = R_ENTRY;
+	r->copy = 1;
+	r->linkname = linkname;
+	r->linked = k;
+	r->haspost = 0;
+}
+
+/* A hard link or copy made by archive k refers to its target as of
+ * archive k, so the target must not change afterwards unless the entry
+ * is made again */
+static void check_links(void)
+{
+	struct rec *target;
+	size_t i;
+
+	for(i = 0; i < nrecs; i++) {
+		if(recs[i].state != R_ENTRY ||
+				(recs[i].th.typeflag != LNKTYPE && !recs[i].copy))
+			continue;
+		target = rec_find(recs[i].linkname);
+		if(target && target->touched > recs[i].linked) {
+			fprintf(stderr, "%s: %s %s, which changes later\n",
+					recs[i].path, recs[i].copy ?
+					"copy of" : "hard link to", recs[i].linkname);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static tartype_t type = { open, close, read, write };
+
+static void read_archive(const char *path, int k)
+{
+	TAR *t;
+	char *name, *slash, *verb;
+	size_t len;
+	int ret, tarerr = 0, hassums = 0;
+	u_char *p;
+	struct stats_timer tm;
+
+	if(tar_open(&t, path, &type, O_RDONLY, 0, TAR_GNU) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	while(!tarerr && (ret = th_read(t)) == 0) {
+		stats_start(&tm);
+		name = th_get_pathname(t);
+		if(!strcmp(name, "sums")) {
+			if((p = read_payload(t, th_get_size(t))) == NULL)
+				tarerr = 1;
+			else
+				read_sums((char *)p, th_get_size(t), k);
+			hassums = 1;
+			free(name);
+			stats_stop(&tm, ST_READ);
+			continue;
+		}
+		len = strlen(name);
+		while(len > 1 && name[len-1] == '/')
+			name[--len] = 0;
+		if((slash = strchr(name, '/')) == NULL)
+			die(path, "entry without a verb");
+		*slash = 0;
+		verb = name;
+		if(!strcmp(verb, "delete"))
+			op_delete(t, rec_get(slash + 1), k);
+		else if(!strcmp(verb, "add"))
+			op_add(t, rec_get(slash + 1), k, 0, &tarerr);
+		else if(!strcmp(verb, "sparse"))
+			op_add(t, rec_get(slash + 1), k, 1, &tarerr);
+		else if(!strcmp(verb, "diff"))
+			op_diff(t, rec_get(slash + 1), k, 0, &tarerr);
+		else if(!strcmp(verb, "sparsediff"))
+			op_diff(t, rec_get(slash + 1), k, 1, &tarerr);
+		else if(!strcmp(verb, "zdiff"))
+			op_opaque(t, rec_get(slash + 1), k, "zdiff", &tarerr);
+		else if(!strcmp(verb, "elfdiff"))
+			op_opaque(t, rec_get(slash + 1), k, "elfdiff", &tarerr);
+		else if(!strcmp(verb, "copy"))
+			op_copy(t, rec_get(slash + 1), k);
+		else
+			die(verb, "unknown verb");
+		free(name);
+		stats_stop(&tm, ST_READ);
+	}
+	if(tarerr || ret < 0) {
+		fprintf(stderr, "%s: read error\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if(!hassums)
+		nosums = 1;
+	tar_close(t);
+	check_links();
+}
+
+static int write_all(int fd, const void *buf, off_t len)
+{
+	static const u_char zero[65536];
+	const u_char *p = buf ? buf : zero;
+	ssize_t ret;
+	off_t n;
+
+	for(; len > 0; len -= ret) {
+		n = buf ? len : MIN(len, (off_t)sizeof(zero));
+		ret = write(fd, p, n);
+		if(ret == -1 && errno == EINTR)
+			ret = 0;
+		else if(ret <= 0)
+			return -1;
+		if(buf)
+			p += ret;
+	}
+	return 0;
+}
+
+static TAR *out;
+
+/* header for verb/path with size, the payload is written by the caller */
+static void put_header(struct tar_header *th, const char *verb,
+		const char *path, const char *linkname, off_t size)
+{
+	char *name = xmalloc(strlen(verb) + strlen(path) + 2);
+
+	sprintf(name, "%s/%s", verb, path);
+	out->th_buf = *th;
+	th_set_path(out, name);
+	if(linkname)
+		th_set_link(out, (char *)linkname);
+	th_set_size(out, size);
+	th_finish(out);
+	if(th_write(out) != 0) {
+		perror("th_write");
+		exit(EXIT_FAILURE);
+	}
+	free(name);
+}
+
+static void put_pad(off_t size)
+{
+	if(write_all(tar_fd(out), NULL,
+			(T_BLOCKSIZE - size % T_BLOCKSIZE) % T_BLOCKSIZE) != 0) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+	STATS_ADD(bytes_written, size + (T_BLOCKSIZE - size % T_BLOCKSIZE) % T_BLOCKSIZE);
+}
+
+/* write the bytes of every segment of the given kinds, in order */
+static void put_segs(const struct segs *s, int copies)
+{
+	size_t i;
+
+	for(i = 0; i < s->n; i++)
+		if((s->v[i].kind == SEG_COPY) == copies &&
+				write_all(tar_fd(out), s->v[i].data, s->v[i].len) != 0) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+}
+
+/* the segments as one bsdiff patch against the v1 file */
+static void put_bsdiff(struct rec *r)
+{
+	const struct segs *s = &r->segs;
+	u_char *ctrl = NULL, hdr[32];
+	size_t i, n = 0, cap = 0;
+	off_t x = 0, y = 0, opos = 0, difflen = 0, size;
+
+	for(i = 0; i <= s->n; i++) {
+		const struct seg *g = i < s->n ? &s->v[i] : NULL;
+		if(g && g->kind != SEG_COPY) {
+			y += g->len;
+			continue;
+		}
+		if(g && !y && opos + x == g->pos) {
+			x += g->len;
+			difflen += g->len;
+			continue;
+		}
+		if(x || y || (g && opos != g->pos)) {
+			if(n == cap) {
+				cap = cap ? 2 * cap : 64;
+				if((ctrl = realloc(ctrl, cap * 24)) == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			offtout(x, ctrl + 24 * n);
+			offtout(y, ctrl + 24 * n + 8);
+			offtout(g ? g->pos - opos - x : 0, ctrl + 24 * n + 16);
+			n++;
+		}
+		if(g) {
+			opos = g->pos;
+			x = g->len;
+			y = 0;
+			difflen += g->len;
+		}
+	}
+	size = 32 + 24 * n + s->size;
+	memcpy(hdr, "BSDIFFXX", 8);
+	offtout(24 * n, hdr + 8);
+	offtout(difflen, hdr + 16);
+	offtout(s->size, hdr + 24);
+	put_header(&r->th, "diff", r->path, NULL, size);
+	if(write_all(tar_fd(out), hdr, 32) != 0 ||
+			write_all(tar_fd(out), ctrl, 24 * n) != 0) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+	put_segs(s, 1);
+	put_segs(s, 0);
+	put_pad(size);
+	free(ctrl);
+}
+
+/* the segments as a sparse payload; an add leaves zeros as holes, a diff
+ * punches them and keeps the identity copies of v1 */
+static void put_sparse(struct rec *r)
+{
+	const struct segs *s = &r->segs;
+	u_char *hdr;
+	size_t i, n = 0;
+	off_t size = SPARSE_HEADER;
+
+	hdr = xmalloc(SPARSE_HEADER + 16 * s->n);
+	for(i = 0; i < s->n; i++) {
+		const struct seg *g = &s->v[i];
+		if(g->kind == SEG_COPY || (g->kind == SEG_ZERO && !r->diff))
+			continue;
+		offtout(g->at, hdr + SPARSE_HEADER + 16 * n);
+		offtout(g->kind == SEG_DATA ? g->len : -g->len,
+				hdr + SPARSE_HEADER + 16 * n + 8);
+		if(g->kind == SEG_DATA)
+			size += g->len;
+		n++;
+	}
+	size += 16 * n;
+	memcpy(hdr, SPARSE_MAGIC, 8);
+	offtout(s->size, hdr + 8);
+	offtout(n, hdr + 16);
+	put_header(&r->th, r->diff ? "sparsediff" : "sparse", r->path, NULL, size);
+	if(write_all(tar_fd(out), hdr, SPARSE_HEADER + 16 * n) != 0) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < s->n; i++)
+		if(s->v[i].kind == SEG_DATA &&
+				write_all(tar_fd(out), s->v[i].data, s->v[i].len) != 0) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+	put_pad(size);
+	free(hdr);
+}
+
+/* a sparse diff only fits when v1 is never moved or changed */
+static int sparse_fits(const struct rec *r)
+{
+	size_t i;
+
+	for(i = 0; i < r->segs.n; i++)
+		if(r->segs.v[i].kind == SEG_COPY &&
+				(r->segs.v[i].data || r->segs.v[i].pos != r->segs.v[i].at))
+			return 0;
+	return 1;
+}
+
+static void put_file(struct rec *r)
+{
+	size_t i;
+	int zeros = 0;
+
+	if(r->diff) {
+		STATS_ADD(changed, 1);
+		if(r->opaque) {
+			put_header(&r->th, r->opaque, r->path, NULL, r->segs.size);
+			put_segs(&r->segs, 0);
+			put_pad(r->segs.size);
+		} else if(r->sparse && sparse_fits(r))
+			put_sparse(r);
+		else
+			put_bsdiff(r);
+		return;
+	}
+	STATS_ADD(added, 1);
+	for(i = 0; i < r->segs.n; i++)
+		zeros |= r->segs.v[i].kind == SEG_ZERO;
+	if(r->sparse || zeros) {
+		put_sparse(r);
+		return;
+	}
+	put_header(&r->th, "add", r->path, NULL, r->segs.size);
+	put_segs(&r->segs, 0);
+	put_pad(r->segs.size);
+}
+
+static void put_sums(void)
+{
+	struct stat sb;
+	char *buf = NULL, rec[64];
+	size_t i, len = 0, cap = 0, n;
+	struct rec *r;
+
+	for(i = 0; i < nrecs; i++) {
+		r = &recs[i];
+		if(r->state != R_FILE || !r->haspost || (r->diff && !r->haspre))
+			continue;
+		n = snprintf(rec, sizeof(rec), "%c %llx %08x %llx %08x ",
+				r->diff ? 'd' : 'a',
+				r->diff ? r->presize : 0, r->diff ? r->precrc : 0,
+				r->postsize, r->postcrc);
+		if(len + n + strlen(r->path) + 1 > cap) {
+			cap = 2 * (len + n + strlen(r->path) + 1);
+			if((buf = realloc(buf, cap)) == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		memcpy(buf + len, rec, n);
+		strcpy(buf + len + n, r->path);
+		len += n + strlen(r->path) + 1;
+	}
+	if(!len)
+		return;
+	memset(&sb, 0, sizeof(sb));
+	sb.st_mode = S_IFREG | 0644;
+	sb.st_uid = getuid();
+	sb.st_gid = getgid();
+	sb.st_mtime = time(NULL);
+	th_set_from_stat(out, &sb);
+	th_set_path(out, "sums");
+	th_set_size(out, len);
+	th_finish(out);
+	if(th_write(out) != 0 || write_all(tar_fd(out), buf, len) != 0) {
+		perror("sums");
+		exit(EXIT_FAILURE);
+	}
+	put_pad(len);
+	free(buf);
+}
+
+static int pathcmp(const void *a, const void *b)
+{
+	return strcmp((*(struct rec **)a)->path, (*(struct rec **)b)->path);
+}
+
+static void write_archive(void)
+{
+	struct rec **order = xmalloc(nrecs * sizeof(*order));
+	struct rec *r;
+	size_t i;
+	struct stats_timer tm;
+
+	stats_start(&tm);
+	for(i = 0; i < nrecs; i++)
+		order[i] = &recs[i];
+	qsort(order, nrecs, sizeof(*order), pathcmp);
+	if(!nosums)
+		put_sums();
+
+	/* whatever v1 had in the way, deepest first */
+	for(i = nrecs; i-- > 0; ) {
+		r = order[i];
+		if(!r->inv1 || (r->state == R_FILE && r->diff))
+			continue;
+		STATS_ADD(deleted, r->state == R_DELETED);
+		put_header(&r->delth, "delete", r->path, NULL, 0);
+	}
+	for(i = 0; i < nrecs; i++) {
+		r = order[i];
+		if(r->state == R_FILE)
+			put_file(r);
+		else if(r->state == R_ENTRY && r->th.typeflag != LNKTYPE &&
+				!r->copy) {
+			STATS_ADD(added, 1);
+			put_header(&r->th, "add", r->path, r->linkname, 0);
+		}
+	}
+	/* copies and hard links last, their sources are in place by now */
+	for(i = 0; i < nrecs; i++) {
+		r = order[i];
+		if(r->state == R_ENTRY && r->copy) {
+			STATS_ADD(deduped, 1);
+			put_header(&r->th, "copy", r->path, r->linkname, 0);
+		}
+	}
+	for(i = 0; i < nrecs; i++) {
+		r = order[i];
+		if(r->state == R_ENTRY && r->th.typeflag == LNKTYPE) {
+			STATS_ADD(added, 1);
+			put_header(&r->th, "add", r->path, r->linkname, 0);
+		}
+	}
+	free(order);
+	stats_stop(&tm, ST_ARCHIVE);
+}
+
+int main(int argc, char **argv)
+{
+	int i, ch, ret, dostats = 0;
+	char *statspath = NULL;
+	static struct option longopts[] = {
+		{ "stats", optional_argument, NULL, 'S' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+		switch(ch) {
+		case 'S':
+			dostats = 1;
+			statspath = optarg;
+			break;
+		default:
+			argc = 0;
+		}
+	}
+	if(argc - optind < 2) {
+		fprintf(stderr, "Usage: %s [--stats[=file]] patch1.tar [patch2.tar ...] out.tar\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	argc -= optind;
+	argv += optind;
+	if(dostats)
+		stats_init();
+
+	for(i = 0; i < argc - 1; i++)
+		read_archive(argv[i], i + 1);
+
+	if(!strcmp(argv[argc-1], "-"))
+		ret = tar_fdopen(&out, 1, "stdout", &type, O_WRONLY|O_CREAT, 0644, TAR_GNU);
+	else
+		ret = tar_open(&out, argv[argc-1], &type, O_WRONLY|O_CREAT|O_TRUNC, 0644, TAR_GNU);
+	if(ret != 0) {
+		perror(argv[argc-1]);
+		exit(EXIT_FAILURE);
+	}
+	write_archive();
+	tar_append_eof(out);
+	tar_close(out);
+
+	if(dostats)
+		stats_print("fscompose", statspath);
+
+	return 0;
+}
@@ -1,4 +1,4 @@
-#define _BSD_SOURCE
+#define _GNU_SOURCE
 #include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,8 +6,15 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <string.h>
+#include <getopt.h>
 
 #include <libtar.h>
 
@@ -15,10 +22,48 @@
 #include "bsdiff.c"
 #undef main
 
-static int bsdiff(char *oldfile, char *newfile, char *patchfile)
+#include "crc32c.c"
+#include "sparse.c"
+#include "zchunk.c"
+#include "elf.c"
+
+static char *budget;
+static char *jobs;
+static char level[3];
+static off_t fast_above = -1;
+
+/* scratch files in the working directory, per process under --serve */
+static char tmppatch[32] = "patch", tmpsums[32] = "sums";
+
+/* cache is 0 for temporaries, whose suffix arrays could never be
+ * looked up again */
+static int bsdiff(char *oldfile, char *newfile, char *patchfile, int fast,
+		int cache)
 {
-	int cpid, ret;
-	char *argv[5] = { "bsdiff", oldfile, newfile, patchfile, NULL};
+	int cpid, ret, argc = 0;
+	char *argv[13];
+
+	argv[argc++] = "bsdiff";
+	if(level[0])
+		argv[argc++] = level;
+	if(fast)
+		argv[argc++] = "-f";
+	if(jobs) {
+		argv[argc++] = "-j";
+		argv[argc++] = jobs;
+	}
+	if(budget) {
+		argv[argc++] = "-m";
+		argv[argc++] = budget;
+	}
+	if(cache_dir && cache) {
+		argv[argc++] = "-c";
+		argv[argc++] = (char *)cache_dir;
+	}
+	argv[argc++] = oldfile;
+	argv[argc++] = newfile;
+	argv[argc++] = patchfile;
+	argv[argc] = NULL;
 
 	cpid = fork();
 	if (cpid == -1) {
@@ -26,7 +71,11 @@ static int bsdiff(char *oldfile, char *newfile, char *patchfile)
 		return 1;
 	}
 	if (cpid == 0) {
-		ret = bsdiff_main(4, argv);
+		optind = 1;
+		/* bsdiff_main shares cache_dir with us */
+		if(!cache)
+			cache_dir = NULL;
+		ret = bsdiff_main(argc, argv);
 		exit(ret);
 	} else {
 		wait(&ret);
@@ -36,83 +85,1048 @@ static int bsdiff(char *oldfile, char *newfile, char *patchfile)
 
 TAR *t;
 
-static char *base1;
-static char *base2;
-static char prefix[PATH_MAX];
+static ssize_t tar_write(int fd, const void *buf, size_t count)
+{
+	ssize_t ret = write(fd, buf, count);
+	if(ret > 0)
+		STATS_ADD(bytes_written, ret);
+	return ret;
+}
+
+static tartype_t type = { open, close, read, tar_write };
+
 
 static int filter(const struct dirent *d)
 {
 	return strcmp(d->d_name, ".") && strcmp(d->d_name, "..");
 }
 
+/* Growable path buffer, names are pushed and popped as the walk descends
+ * so full paths are never reformatted per entry */
+struct path {
+	char *buf;
+	size_t len, cap;
+};
+
+static struct path oldp, newp, relp, savep;
+
+static void path_reserve(struct path *p, size_t len)
+{
+	if(p->len + len + 1 <= p->cap)
+		return;
+	if(!p->cap)
+		p->cap = 256;
+	while(p->cap < p->len + len + 1)
+		p->cap *= 2;
+	if((p->buf = realloc(p->buf, p->cap)) == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void path_set(struct path *p, const char *s, size_t len)
+{
+	p->len = 0;
+	path_reserve(p, len);
+	memcpy(p->buf, s, len);
+	p->len = len;
+	p->buf[len] = 0;
+}
+
+/* append "/name", returns the length to restore with path_pop() */
+static size_t path_push(struct path *p, const char *name, size_t len)
+{
+	size_t old = p->len;
+	path_reserve(p, len + 1);
+	p->buf[p->len++] = '/';
+	memcpy(p->buf + p->len, name, len);
+	p->len += len;
+	p->buf[p->len] = 0;
+	return old;
+}
+
+static void path_pop(struct path *p, size_t len)
+{
+	p->len = len;
+	p->buf[len] = 0;
+}
+
+static void path_cat(struct path *p, const char *s, size_t len)
+{
+	path_reserve(p, len);
+	memcpy(p->buf + p->len, s, len);
+	p->len += len;
+	p->buf[p->len] = 0;
+}
+
+/* archive name: verb followed by the current relative path */
+static char *savename(const char *verb)
+{
+	path_set(&savep, verb, strlen(verb));
+	path_cat(&savep, relp.buf, relp.len);
+	return savep.buf;
+}
+
+/* Regular files with more than one link in the new tree, by inode.  The
+ * first name written carries the contents and later names are archived as
+ * hard links to it.  ready is set once that name holds the new contents
+ * in the patched tree, oldino is the inode it had in the old tree. */
+struct inode {
+	dev_t dev, olddev;
+	ino_t ino, oldino;
+	size_t name;
+	int ready;
+};
+
+static struct inode *inodes;
+static size_t ninodes, inodessize;
+static struct path inodenames;
+
+static size_t inode_hash(dev_t dev, ino_t ino)
+{
+	return (ino * 0x9e3779b97f4a7c15ULL ^ dev) & (inodessize - 1);
+}
+
+static struct inode *inode_find(const struct stat *sb)
+{
+	size_t h;
+
+	if(!inodessize || sb->st_nlink < 2 || !S_ISREG(sb->st_mode))
+		return NULL;
+	for(h = inode_hash(sb->st_dev, sb->st_ino); inodes[h].ino;
+			h = (h + 1) & (inodessize - 1))
+		if(inodes[h].ino == sb->st_ino && inodes[h].dev == sb->st_dev)
+			return &inodes[h];
+	return NULL;
+}
+
+static const char *inode_name(const struct inode *in)
+{
+	return inodenames.buf + in->name;
+}
+
+/* remember name, relative to the tree, for sb's inode */
+static void inode_add(const struct stat *sb, const struct stat *old,
+		const char *name, int ready)
+{
+	struct inode *v = inodes;
+	size_t i, h, size = inodessize;
+
+	if(sb->st_nlink < 2 || !S_ISREG(sb->st_mode))
+		return;
+	if(2 * (ninodes + 1) > inodessize) {
+		inodessize = inodessize ? 2 * inodessize : 256;
+		if((inodes = calloc(inodessize, sizeof(*inodes))) == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for(i = 0; i < size; i++) {
+			if(!v[i].ino)
+				continue;
+			for(h = inode_hash(v[i].dev, v[i].ino); inodes[h].ino;
+					h = (h + 1) & (inodessize - 1))
+				;
+			inodes[h] = v[i];
+		}
+		free(v);
+	}
+	for(h = inode_hash(sb->st_dev, sb->st_ino); inodes[h].ino;
+			h = (h + 1) & (inodessize - 1))
+		;
+	inodes[h].dev = sb->st_dev;
+	inodes[h].ino = sb->st_ino;
+	inodes[h].olddev = old ? old->st_dev : 0;
+	inodes[h].oldino = old ? old->st_ino : 0;
+	inodes[h].name = inodenames.len;
+	inodes[h].ready = ready;
+	path_cat(&inodenames, name, strlen(name));
+	inodenames.len++;
+	ninodes++;
+}
+
+/* name now holds the new contents of sb's inode in the patched tree;
+ * the first name written is the one every later name links to, even when
+ * the walk registered another one that is written after it */
+static void inode_written(const struct stat *sb, const char *name)
+{
+	struct inode *in = inode_find(sb);
+
+	if(!in)
+		inode_add(sb, NULL, name, 1);
+	else if(!in->ready) {
+		if(strcmp(inode_name(in), name)) {
+			in->name = inodenames.len;
+			path_cat(&inodenames, name, strlen(name));
+			inodenames.len++;
+		}
+		in->ready = 1;
+	}
+}
+
+/* Directory entries are packed into one arena used as a stack: each
+ * cmpdir() level appends its entries plus a sorted index and drops them
+ * on return, so the walk does no per-entry malloc/free.  Entries are
+ * referred to by offset since growing the arena may move it. */
+struct entry {
+	off_t prefetched;	/* charged to the prefetch window */
+	unsigned char type;
+	unsigned short len;
+	char name[];
+};
+
+static struct {
+	char *buf;
+	size_t len, cap;
+} arena;
+
+#define ENTRY(off) ((struct entry *)(arena.buf + (off)))
+#define ENTRYSIZE(len) ((sizeof(struct entry) + (len) + 1 + 7) & ~(size_t)7)
+
+static size_t arena_alloc(size_t len)
+{
+	size_t off;
+
+	if(arena.len + len > arena.cap) {
+		if(!arena.cap)
+			arena.cap = 65536;
+		while(arena.cap < arena.len + len)
+			arena.cap *= 2;
+		if((arena.buf = realloc(arena.buf, arena.cap)) == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	off = arena.len;
+	arena.len += len;
+	return off;
+}
+
+static int entrycmp(const void *a, const void *b)
+{
+	return strcoll(ENTRY(*(size_t *)a)->name, ENTRY(*(size_t *)b)->name);
+}
+
+/* scandir() replacement, returns the arena offset of n sorted entry
+ * offsets or sets n to -1 */
+static size_t scanentries(const char *dir, int *n)
+{
+	DIR *d;
+	struct dirent *dp;
+	size_t first, idx, off, *v;
+	int i, count = 0;
+
+	*n = -1;
+	if((d = opendir(dir)) == NULL)
+		return 0;
+	first = arena.len;
+	while((dp = readdir(d)) != NULL) {
+		size_t len;
+		if(!filter(dp))
+			continue;
+		len = strlen(dp->d_name);
+		off = arena_alloc(ENTRYSIZE(len));
+		ENTRY(off)->prefetched = 0;
+		ENTRY(off)->type = dp->d_type;
+		ENTRY(off)->len = len;
+		memcpy(ENTRY(off)->name, dp->d_name, len + 1);
+		count++;
+	}
+	closedir(d);
+
+	idx = arena_alloc(count * sizeof(size_t));
+	v = (size_t *)(arena.buf + idx);
+	for(i = 0, off = first; i < count; i++) {
+		v[i] = off;
+		off += ENTRYSIZE(ENTRY(off)->len);
+	}
+	qsort(v, count, sizeof(*v), entrycmp);
+	*n = count;
+	return idx;
+}
+
+static struct entry *entry_at(size_t idx, int i)
+{
+	return ENTRY(((size_t *)(arena.buf + idx))[i]);
+}
+
 static int cmpfiles(const char* a, const char* b, size_t len)
 {
 	// add error checking
-	int fd1, fd2, ret;
-	void *p1, *p2;
+	int fd1, fd2, ret = 0;
+	char *p1, *p2;
+	off_t pos = 0, s1, e1, s2, e2, s, e;
+	int h1, h2;
+	struct stats_timer tm;
+	stats_start(&tm);
 	fd1 = open(a, O_RDONLY);
 	fd2 = open(b, O_RDONLY);
 	p1 = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd1, 0);
 	p2 = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd2, 0);
-	ret = memcmp(p1, p2, len);
+	/* only where either file has data, a hole in one reads as zeros */
+	while(ret == 0) {
+		h1 = next_extent(fd1, pos, len, &s1, &e1);
+		h2 = next_extent(fd2, pos, len, &s2, &e2);
+		if(h1 && h2)
+			break;
+		if(h1 || (!h2 && s2 < s1)) {
+			s = s2;
+			e = e2;
+		} else if(h2 || s1 < s2) {
+			s = s1;
+			e = e1;
+		} else {
+			s = s1;
+			e = e1 > e2 ? e1 : e2;
+		}
+		STATS_ADD(bytes_read, 2 * (e - s));
+		ret = memcmp(p1 + s, p2 + s, e - s);
+		pos = e;
+	}
 	munmap(p1, len);
 	munmap(p2, len);
 	close(fd1);
 	close(fd2);
+	stats_stop(&tm, ST_COMPARE);
 	return ret;
 }
 
-static int do_add(struct dirent *d)
+/* move len bytes from in to out without bouncing through user space
+ * where the kernel allows it, falling back to read/write otherwise */
+static off_t copy_fd(int in, int out, off_t len)
 {
-	int ret;
-	char realname[PATH_MAX];
-	char savename[PATH_MAX];
+	ssize_t ret;
+	off_t done = 0;
+	int mode = 0;
+	char buf[65536];
+
+	while(done < len) {
+		size_t count = len - done;
+		if(mode == 0) {
+			ret = copy_file_range(in, NULL, out, NULL, count, 0);
+			if(ret < 0 && errno != EINTR) {
+				mode = 1;
+				continue;
+			}
+		} else if(mode == 1) {
+			ret = sendfile(out, in, NULL, count);
+			if(ret < 0 && errno != EINTR) {
+				mode = 2;
+				continue;
+			}
+		} else {
+			if(count > sizeof(buf))
+				count = sizeof(buf);
+			ret = read(in, buf, count);
+			if(ret > 0 && write(out, buf, ret) != ret)
+				return -1;
+		}
+		if(ret == -1 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -1;
+		if(ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static int write_zeros(int fd, off_t len)
+{
+	static const char zero[T_BLOCKSIZE];
+	ssize_t ret;
+
+	while(len > 0) {
+		ret = write(fd, zero, MIN(len, T_BLOCKSIZE));
+		if(ret < 0)
+			return -1;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* fewer blocks allocated than the size needs */
+static int is_sparse(const struct stat *sb)
+{
+	return S_ISREG(sb->st_mode) && (off_t)sb->st_blocks * 512 < sb->st_size;
+}
+
+/* Extent records of the sparse payload being built, see sparse.c */
+#define SPARSE_BLOCK 4096
+
+static struct {
+	off_t *v;
+	size_t n, cap;
+	off_t data;
+} ext;
+
+static void ext_add(off_t off, off_t len)
+{
+	off_t *last = ext.n ? ext.v + 2 * (ext.n - 1) : NULL;
 
-	sprintf(realname, "%s%s/%s", base2, prefix, d->d_name);
-	sprintf(savename, "%s%s/%s", "add", prefix, d->d_name);
+	if(len > 0)
+		ext.data += len;
+	if(last && (last[1] > 0) == (len > 0) &&
+			last[0] + (last[1] > 0 ? last[1] : -last[1]) == off) {
+		last[1] += len;
+		return;
+	}
+	if(ext.n == ext.cap) {
+		ext.cap = ext.cap ? 2 * ext.cap : 64;
+		if((ext.v = realloc(ext.v, 2 * ext.cap * sizeof(off_t))) == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	ext.v[2 * ext.n] = off;
+	ext.v[2 * ext.n + 1] = len;
+	ext.n++;
+}
+
+/* new [p, q) equals old, which reads as zeros past its end */
+static int same_block(const u_char *o, off_t oldsize, const u_char *n,
+		off_t p, off_t q)
+{
+	static const u_char zero[SPARSE_BLOCK];
+	off_t k = MIN(q, oldsize > p ? oldsize : p);
+
+	if(k > p && memcmp(o + p, n + p, k - p))
+		return 0;
+	return k == q || !memcmp(n + k, zero, q - k);
+}
+
+/* Records turning old, or nothing when oldfd < 0, into new.  Only the
+ * data extents of either file are read; a changed block is sent, or
+ * punched when new has a hole there. */
+static int sparse_extents(int oldfd, off_t oldsize, int newfd, off_t newsize)
+{
+	u_char *o = NULL, *n = NULL;
+	off_t pos = 0, s, e, os, oe, ns, ne, p, q, cs = 0, ce = 0;
+	int ho, hn, nhole = 0;
+
+	ext.n = 0;
+	ext.data = 0;
+	if(oldfd < 0) {
+		for(; next_extent(newfd, pos, newsize, &s, &e) == 0; pos = e)
+			ext_add(s, e - s);
+		return 0;
+	}
+	if(newsize && (n = mmap(NULL, newsize, PROT_READ, MAP_PRIVATE,
+			newfd, 0)) == MAP_FAILED)
+		return -1;
+	if(oldsize && (o = mmap(NULL, oldsize, PROT_READ, MAP_PRIVATE,
+			oldfd, 0)) == MAP_FAILED) {
+		if(n)
+			munmap(n, newsize);
+		return -1;
+	}
+	for(;;) {
+		ho = next_extent(oldfd, pos, MIN(oldsize, newsize), &os, &oe);
+		hn = next_extent(newfd, pos, newsize, &ns, &ne);
+		if(ho && hn)
+			break;
+		if(ho || (!hn && ns < os)) {
+			s = ns;
+			e = ne;
+		} else if(hn || os < ns) {
+			s = os;
+			e = oe;
+		} else {
+			s = os;
+			e = oe > ne ? oe : ne;
+		}
+		s -= s % SPARSE_BLOCK;
+		e = MIN(newsize, (e + SPARSE_BLOCK - 1) / SPARSE_BLOCK * SPARSE_BLOCK);
+		STATS_ADD(bytes_read, 2 * (e - s));
+		for(p = s; p < e; p = q) {
+			q = MIN(p + SPARSE_BLOCK, e);
+			if(same_block(o, oldsize, n, p, q))
+				continue;
+			if(!nhole && p >= ce)
+				nhole = next_extent(newfd, p, newsize, &cs, &ce);
+			ext_add(p, nhole || q <= cs ? p - q : q - p);
+		}
+		pos = e;
+	}
+	if(n)
+		munmap(n, newsize);
+	if(o)
+		munmap(o, oldsize);
+	return 0;
+}
+
+static off_t sparse_size(void)
+{
+	return SPARSE_HEADER + 16 * ext.n + ext.data;
+}
+
+/* write the payload for the records in ext with the data from fd */
+static off_t sparse_write(int out, int fd, off_t size)
+{
+	u_char *hdr;
+	size_t i, len = SPARSE_HEADER + 16 * ext.n;
+	off_t done;
+
+	if((hdr = malloc(len)) == NULL)
+		return -1;
+	memcpy(hdr, SPARSE_MAGIC, 8);
+	offtout(size, hdr + 8);
+	offtout(ext.n, hdr + 16);
+	for(i = 0; i < ext.n; i++) {
+		offtout(ext.v[2 * i], hdr + SPARSE_HEADER + 16 * i);
+		offtout(ext.v[2 * i + 1], hdr + SPARSE_HEADER + 16 * i + 8);
+	}
+	done = write(out, hdr, len) == len ? len : -1;
+	free(hdr);
+	for(i = 0; done >= 0 && i < ext.n; i++) {
+		off_t l = ext.v[2 * i + 1];
+		if(l <= 0)
+			continue;
+		if(lseek(fd, ext.v[2 * i], SEEK_SET) < 0 || copy_fd(fd, out, l) != l)
+			return -1;
+		done += l;
+	}
+	if(done > 0)
+		STATS_ADD(bytes_written, done);
+	return done;
+}
+
+/* a sparse regular file goes in as "sparse/" with an extent payload */
+static int tar_append_sparse(TAR *t, int fd, struct stat *sb, char *savename)
+{
+	static struct path name;
+	char *slash = strchr(savename, '/');
+	off_t size;
+
+	if(sparse_extents(-1, 0, fd, sb->st_size) != 0)
+		return -1;
+	path_set(&name, "sparse", 6);
+	path_cat(&name, slash, strlen(slash));
+	size = sparse_size();
+	th_set_from_stat(t, sb);
+	th_set_path(t, name.buf);
+	th_set_size(t, size);
+	th_finish(t);
+	if(t->options & TAR_VERBOSE)
+		th_print_long_ls(t);
+	if(th_write(t) != 0 || sparse_write(tar_fd(t), fd, sb->st_size) != size)
+		return -1;
+	return write_zeros(tar_fd(t), (T_BLOCKSIZE - size % T_BLOCKSIZE) % T_BLOCKSIZE);
+}
+
+/* sparse counterpart of bsdiff(), the payload holds only changed blocks */
+static int sparse_diff(char *oldfile, char *newfile, char *patchfile)
+{
+	int oldfd, newfd, out, ret = -1;
+	struct stat osb, nsb;
+
+	if((oldfd = open(oldfile, O_RDONLY)) < 0)
+		return -1;
+	if((newfd = open(newfile, O_RDONLY)) < 0) {
+		close(oldfd);
+		return -1;
+	}
+	out = open(patchfile, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if(out >= 0 && fstat(oldfd, &osb) == 0 && fstat(newfd, &nsb) == 0 &&
+			sparse_extents(oldfd, osb.st_size, newfd, nsb.st_size) == 0 &&
+			sparse_write(out, newfd, nsb.st_size) == sparse_size())
+		ret = 0;
+	if(out >= 0)
+		close(out);
+	close(oldfd);
+	close(newfd);
+	return ret;
+}
+
+static int nozdiff;
+
+static u_char *map_file(const char *path, off_t *size)
+{
+	struct stat sb;
+	u_char *p;
+	int fd;
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	p = NULL;
+	if(fstat(fd, &sb) == 0 && sb.st_size > 0) {
+		p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p == MAP_FAILED)
+			p = NULL;
+	}
+	close(fd);
+	*size = sb.st_size;
+	return p;
+}
+
+static int write_file(const char *path, const u_char *buf, off_t len)
+{
+	int fd, ret;
+
+	if((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0)
+		return -1;
+	ret = write(fd, buf, len) == len ? 0 : -1;
+	close(fd);
+	return ret;
+}
 
-	fprintf(stderr, "%s/%s was added\n", prefix, d->d_name);
+/* bsdiff() between the rewritten forms of a file pair, written to
+ * patchfile after hdr, what fspatch needs to undo the rewrite */
+static int diff_rewritten(const u_char *old, off_t oldlen, const u_char *new,
+		off_t newlen, const u_char *hdr, size_t hlen, char *patchfile,
+		int fast)
+{
+	char oldname[48], newname[48], patch[48];
+	struct stat sb;
+	int fd, in, ret = -1;
+
+	snprintf(oldname, sizeof(oldname), "%s.old", tmppatch);
+	snprintf(newname, sizeof(newname), "%s.new", tmppatch);
+	snprintf(patch, sizeof(patch), "%s.rw", tmppatch);
+	if(write_file(oldname, old, oldlen) == 0 &&
+			write_file(newname, new, newlen) == 0 &&
+			bsdiff(oldname, newname, patch, fast, 0) == 0 &&
+			(in = open(patch, O_RDONLY)) >= 0) {
+		if(fstat(in, &sb) == 0 &&
+				(fd = open(patchfile, O_WRONLY|O_CREAT|O_TRUNC, 0600)) >= 0) {
+			if(write(fd, hdr, hlen) == (ssize_t)hlen &&
+					copy_fd(in, fd, sb.st_size) == sb.st_size)
+				ret = 0;
+			close(fd);
+		}
+		close(in);
+	}
+	unlink(oldname);
+	unlink(newname);
+	unlink(patch);
+	return ret;
+}
+
+/* Compressed counterpart of bsdiff(): when both files are gzip, zip or xz
+ * and most of the new one recompresses bit-exactly, diff the expanded
+ * forms instead.  Nonzero means use bsdiff(). */
+static int zdiff(char *oldfile, char *newfile, char *patchfile, int fast)
+{
+	struct zfile oz, nz;
+	u_char *obuf, *nbuf, *hdr;
+	off_t osize, nsize, covered;
+	int ret = 1;
+	size_t i;
+
+	if(nozdiff)
+		return 1;
+	if((nbuf = map_file(newfile, &nsize)) == NULL)
+		return 1;
+	if((obuf = map_file(oldfile, &osize)) == NULL) {
+		munmap(nbuf, nsize);
+		return 1;
+	}
+	memset(&oz, 0, sizeof(oz));
+	memset(&nz, 0, sizeof(nz));
+	if(!zparse(&nz, nbuf, nsize) || !zparse(&oz, obuf, osize))
+		goto out;
+	covered = zfind_params(&nz, nbuf);
+	if(covered < nsize / 2 ||
+			(hdr = malloc(ZDIFF_HEADER + ZDIFF_CHUNK * nz.n)) == NULL)
+		goto out;
+	memcpy(hdr, ZDIFF_MAGIC, 8);
+	offtout(oz.expsize, hdr + 8);
+	offtout(nsize, hdr + 16);
+	offtout(nz.n, hdr + 24);
+	for(i = 0; i < nz.n; i++) {
+		u_char *c = hdr + ZDIFF_HEADER + ZDIFF_CHUNK * i;
+		offtout(nz.v[i].kind, c);
+		offtout(nz.v[i].len, c + 8);
+		offtout(nz.v[i].explen, c + 16);
+		offtout(nz.v[i].param, c + 24);
+	}
+	ret = diff_rewritten(oz.exp, oz.expsize, nz.exp, nz.expsize, hdr,
+			ZDIFF_HEADER + ZDIFF_CHUNK * nz.n, patchfile, fast);
+	free(hdr);
+	if(ret == 0)
+		STATS_ADD(zdiffs, 1);
+out:
+	zfree(&oz);
+	zfree(&nz);
+	munmap(obuf, osize);
+	munmap(nbuf, nsize);
+	return ret;
+}
+
+static int noelfdiff;
+
+/* Executable counterpart of bsdiff(): diff x86-64 ELF files with their
+ * branch targets and table addresses turned into labels, see elf.c.
+ * Nonzero means use bsdiff(). */
+static int elfdiff(char *oldfile, char *newfile, char *patchfile, int fast)
+{
+	struct elf oe, ne, te;
+	struct elfrun *runs = NULL;
+	uint64_t *a = NULL, *b = NULL, *extra = NULL, *addr = NULL;
+	uint32_t *labels = NULL;
+	u_char *obuf, *nbuf, *told = NULL, *tnew = NULL, *check = NULL, *hdr, *p;
+	off_t osize, nsize;
+	size_t n, m, nrun, nextra, nlabel, i, hlen;
+	int ret = 1;
+
+	if(noelfdiff)
+		return 1;
+	if((nbuf = map_file(newfile, &nsize)) == NULL)
+		return 1;
+	if((obuf = map_file(oldfile, &osize)) == NULL) {
+		munmap(nbuf, nsize);
+		return 1;
+	}
+	memset(&te, 0, sizeof(te));
+	if(elf_parse(&ne, nbuf, nsize) != 0) {
+		memset(&oe, 0, sizeof(oe));
+		goto out;
+	}
+	if(elf_parse(&oe, obuf, osize) != 0)
+		goto out;
+	elf_scan(&oe, obuf, ELF_FIND, 0, NULL);
+	elf_scan(&ne, nbuf, ELF_FIND, 0, NULL);
+	a = elf_addrs(&oe, &n);
+	b = elf_addrs(&ne, &m);
+	if(!ne.rel.n || (labels = elf_align(&oe, obuf, a, n, &ne, nbuf, b, m,
+			&runs, &nrun, &extra, &nextra)) == NULL)
+		goto out;
+	nlabel = n + nextra;
+	if((told = malloc(osize)) == NULL || (tnew = malloc(nsize)) == NULL ||
+			(check = malloc(nsize)) == NULL)
+		goto out;
+	memcpy(told, obuf, osize);
+	elf_encode(&oe, told, a, n, NULL);
+	memcpy(tnew, nbuf, nsize);
+	elf_encode(&ne, tnew, b, m, labels);
+
+	/* undo it as fspatch will before relying on it */
+	if(elf_parse(&te, tnew, nsize) != 0)
+		goto out;
+	elf_scan(&te, tnew, ELF_EXC, nlabel, &ne);
+	memcpy(check, tnew, nsize);
+	elf_scan(&te, check, ELF_LABELS, nlabel, NULL);
+	if((addr = elf_table(a, n, runs, nrun, extra, nextra)) == NULL ||
+			elf_decode(&te, check, addr, nlabel) != 0 ||
+			memcmp(check, nbuf, nsize))
+		goto out;
+
+	hlen = ELFDIFF_HEADER + 24 * nrun + 8 * (nextra + te.nexc);
+	if((hdr = malloc(hlen)) == NULL)
+		goto out;
+	memcpy(hdr, ELFDIFF_MAGIC, 8);
+	offtout(nsize, hdr + 8);
+	offtout(nlabel, hdr + 16);
+	offtout(nrun, hdr + 24);
+	offtout(nextra, hdr + 32);
+	offtout(te.nexc, hdr + 40);
+	p = hdr + ELFDIFF_HEADER;
+	for(i = 0; i < nrun; i++, p += 24) {
+		offtout(runs[i].label, p);
+		offtout(runs[i].len, p + 8);
+		offtout(runs[i].delta, p + 16);
+	}
+	for(i = 0; i < nextra; i++, p += 8)
+		offtout(extra[i], p);
+	for(i = 0; i < te.nexc; i++, p += 8)
+		offtout(te.exc[i], p);
+	ret = diff_rewritten(told, osize, tnew, nsize, hdr, hlen, patchfile, fast);
+	free(hdr);
+	if(ret == 0)
+		STATS_ADD(elfdiffs, 1);
+out:
+	elf_free(&oe);
+	elf_free(&ne);
+	elf_free(&te);
+	free(a);
+	free(b);
+	free(labels);
+	free(runs);
+	free(extra);
+	free(addr);
+	free(told);
+	free(tnew);
+	free(check);
+	munmap(obuf, osize);
+	munmap(nbuf, nsize);
+	return ret;
+}
+
+/* savename as a hard link to target, a path relative to the tree */
+static int tar_append_link(TAR *t, struct stat *sb, char *savename,
+		const char *target)
+{
+	th_set_from_stat(t, sb);
+	t->th_buf.typeflag = LNKTYPE;
+	th_set_link(t, (char *)target);
+	th_set_path(t, savename);
+	th_set_size(t, 0);
+	th_finish(t);
+	if(t->options & TAR_VERBOSE)
+		th_print_long_ls(t);
+	return th_write(t);
+}
+
+/* Payloads already in the archive by content, so a file whose contents
+ * were written under another name becomes a "copy/" entry naming it.
+ * Candidates are found by size, and only then are CRC32Cs computed and
+ * the bytes compared. */
+struct blob {
+	off_t size;
+	uint32_t crc;
+	int hascrc;
+	size_t name;	/* relative to the tree */
+};
+
+static struct blob *blobs;
+static size_t nblobs, blobssize;
+static struct path blobnames, blobp;
+static const char *newroot;
+static int nodedup;
+
+static size_t blob_hash(off_t size)
+{
+	return (size * 0x9e3779b97f4a7c15ULL) >> 17 & (blobssize - 1);
+}
+
+static int blob_crc(const char *path, uint32_t *crc)
+{
+	int fd, ret;
+	off_t len;
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	ret = crc32c_fd(fd, &len, crc);
+	STATS_ADD(bytes_read, len);
+	close(fd);
+	return ret;
+}
+
+/* an earlier payload with the contents of the file at path, or NULL */
+static const char *blob_find(const char *path, const struct stat *sb,
+		uint32_t *crc, int *hascrc)
+{
+	struct blob *b;
+	size_t h;
+
+	*hascrc = 0;
+	if(nodedup || !blobssize || !sb->st_size)
+		return NULL;
+	for(h = blob_hash(sb->st_size); blobs[h].size;
+			h = (h + 1) & (blobssize - 1)) {
+		b = &blobs[h];
+		if(b->size != sb->st_size)
+			continue;
+		if(!*hascrc && blob_crc(path, crc) != 0)
+			return NULL;
+		*hascrc = 1;
+		path_set(&blobp, newroot, strlen(newroot));
+		path_push(&blobp, blobnames.buf + b->name,
+				strlen(blobnames.buf + b->name));
+		if(!b->hascrc && blob_crc(blobp.buf, &b->crc) == 0)
+			b->hascrc = 1;
+		if(b->hascrc && b->crc == *crc &&
+				cmpfiles(blobp.buf, path, sb->st_size) == 0)
+			return blobnames.buf + b->name;
+	}
+	return NULL;
+}
+
+/* the payload of name, relative to the tree, is now in the archive */
+static void blob_add(const char *name, const struct stat *sb, uint32_t crc,
+		int hascrc)
+{
+	struct blob *v = blobs;
+	size_t i, h, size = blobssize;
+
+	if(nodedup || !sb->st_size)
+		return;
+	if(2 * (nblobs + 1) > blobssize) {
+		blobssize = blobssize ? 2 * blobssize : 256;
+		if((blobs = calloc(blobssize, sizeof(*blobs))) == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for(i = 0; i < size; i++) {
+			if(!v[i].size)
+				continue;
+			for(h = blob_hash(v[i].size); blobs[h].size;
+					h = (h + 1) & (blobssize - 1))
+				;
+			blobs[h] = v[i];
+		}
+		free(v);
+	}
+	for(h = blob_hash(sb->st_size); blobs[h].size; h = (h + 1) & (blobssize - 1))
+		;
+	blobs[h].size = sb->st_size;
+	blobs[h].crc = crc;
+	blobs[h].hascrc = hascrc;
+	blobs[h].name = blobnames.len;
+	path_cat(&blobnames, name, strlen(name));
+	blobnames.len++;
+	nblobs++;
+}
+
+/* a "copy/" entry for rel, both it and source relative to the tree */
+static int tar_append_copy(TAR *t, struct stat *sb, const char *rel,
+		const char *source)
+{
+	static struct path name;
+
+	path_set(&name, "copy/", 5);
+	path_cat(&name, rel, strlen(rel));
+	th_set_from_stat(t, sb);
+	th_set_link(t, (char *)source);
+	th_set_path(t, name.buf);
+	th_set_size(t, 0);
+	th_finish(t);
+	if(t->options & TAR_VERBOSE)
+		th_print_long_ls(t);
+	STATS_ADD(deduped, 1);
+	return th_write(t);
+}
+
+/* tar_append_file replacement that moves regular file payloads with
+ * copy_fd() instead of libtar's block-at-a-time read/write */
+static int tar_append_fast(TAR *t, char *realname, char *savename)
+{
+	int fd;
+	off_t len, pad;
+	struct stat sb;
+	struct inode *in;
+	const char *rel, *source;
+	uint32_t crc;
+	int hascrc;
+
+	if(lstat(realname, &sb) != 0)
+		return -1;
+	if(!S_ISREG(sb.st_mode))
+		return tar_append_file(t, realname, savename);
+	if((in = inode_find(&sb)) != NULL && in->ready)
+		return tar_append_link(t, &sb, savename, inode_name(in));
+	rel = strchr(savename, '/') + 1;
+	if(!is_sparse(&sb) &&
+			(source = blob_find(realname, &sb, &crc, &hascrc)) != NULL) {
+		inode_written(&sb, rel);
+		return tar_append_copy(t, &sb, rel, source);
+	}
+	if((fd = open(realname, O_RDONLY)) < 0)
+		return -1;
+	inode_written(&sb, rel);
+	if(is_sparse(&sb)) {
+		len = tar_append_sparse(t, fd, &sb, savename);
+		close(fd);
+		return len;
+	}
+	blob_add(rel, &sb, crc, hascrc);
+
+	th_set_from_stat(t, &sb);
+	th_set_path(t, savename);
+	th_finish(t);
+	if(t->options & TAR_VERBOSE)
+		th_print_long_ls(t);
+	if(th_write(t) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	len = copy_fd(fd, tar_fd(t), sb.st_size);
+	close(fd);
+	if(len < 0)
+		return -1;
+	STATS_ADD(bytes_read, len);
+	STATS_ADD(bytes_written, len);
+
+	/* file shrank underneath us, keep the archive consistent */
+	pad = sb.st_size - len;
+	pad += (T_BLOCKSIZE - sb.st_size % T_BLOCKSIZE) % T_BLOCKSIZE;
+	return write_zeros(tar_fd(t), pad);
+}
+
+/* add the directory at real to the archive as save, both paths are
+ * extended in place while recursing */
+static int tar_append_tree_fast(TAR *t, struct path *real, struct path *save)
+{
+	DIR *dir;
+	struct dirent *dp;
+	size_t rlen, slen, len;
+
+	if(tar_append_file(t, real->buf, save->buf) != 0)
+		return -1;
+	if((dir = opendir(real->buf)) == NULL)
+		return -1;
+	while((dp = readdir(dir)) != NULL) {
+		int ret;
+		if(!filter(dp))
+			continue;
+		len = strlen(dp->d_name);
+		rlen = path_push(real, dp->d_name, len);
+		slen = path_push(save, dp->d_name, len);
+		if(dp->d_type == DT_DIR)
+			ret = tar_append_tree_fast(t, real, save);
+		else
+			ret = tar_append_fast(t, real->buf, save->buf);
+		path_pop(real, rlen);
+		path_pop(save, slen);
+		if(ret != 0)
+			break;
+	}
+	closedir(dir);
+	return dp ? -1 : 0;
+}
+
+/* the do_* verbs act on the entry last pushed onto oldp/newp/relp */
+static int do_add(int type)
+{
+	int ret;
+	struct stats_timer tm;
+
+	fprintf(stderr, "%s was added\n", relp.buf);
+	STATS_ADD(added, 1);
 	if(!t) return 0;
 
-	if(d->d_type == DT_DIR)
-		ret = tar_append_tree(t, realname, savename);
+	stats_start(&tm);
+	savename("add");
+	if(type == DT_DIR)
+		ret = tar_append_tree_fast(t, &newp, &savep);
 	else
-		ret = tar_append_file(t, realname, savename);
+		ret = tar_append_fast(t, newp.buf, savep.buf);
 	if(ret < 0)
 		perror("tar_append_file");
+	stats_file(savep.buf, stats_stop(&tm, ST_ARCHIVE));
 }
 
-static int do_delete(struct dirent *d)
+static int do_delete(int type)
 {
 	int ret;
 	struct stat sb;
-	char realname[PATH_MAX];
-	char savename[PATH_MAX];
-
-	sprintf(realname, "%s%s/%s", base1, prefix, d->d_name);
-	sprintf(savename, "%s%s/%s", "delete", prefix, d->d_name);
 
-	if(d->d_type == DT_DIR) {
+	if(type == DT_DIR) {
 		DIR *dir;
 		struct dirent *dp;
-		int len = strlen(prefix);
-		strcat(prefix, "/");
-		strcat(prefix, d->d_name);
-		dir = opendir(realname);
+		size_t olen, rlen, len;
+		dir = opendir(oldp.buf);
 		while ((dp = readdir(dir)) != NULL) {
 			if (!filter(dp))
 				continue;
-			do_delete(dp);
+			len = strlen(dp->d_name);
+			olen = path_push(&oldp, dp->d_name, len);
+			rlen = path_push(&relp, dp->d_name, len);
+			do_delete(dp->d_type);
+			path_pop(&oldp, olen);
+			path_pop(&relp, rlen);
 		}
-		prefix[len] = 0;
+		closedir(dir);
 	}
 
-	fprintf(stderr, "%s/%s was deleted\n", prefix, d->d_name);
+	fprintf(stderr, "%s was deleted\n", relp.buf);
+	STATS_ADD(deleted, 1);
 	if(!t) return 0;
 
-	ret = lstat(realname, &sb);
+	ret = lstat(oldp.buf, &sb);
 	th_set_from_stat(t, &sb);
-	th_set_path(t, savename);
+	th_set_path(t, savename("delete"));
 	th_set_size(t, 0);
 	th_finish(t);
 	if(t->options & TAR_VERBOSE)
@@ -120,20 +1134,20 @@ static int do_delete(struct dirent *d)
 	th_write(t);
 }
 
-static int do_diff(struct dirent *d1, struct dirent *d2)
+static int do_diff(void)
 {
-	int ret;
-	struct stat sb;
-	char realname1[PATH_MAX];
-	char realname2[PATH_MAX];
-	char savename[PATH_MAX];
+	int ret, sparse, hascrc, fast, exe = 0, compressed = 0;
+	uint32_t crc;
+	const char *source;
+	struct stat sb, osb;
+	struct inode *in;
+	struct stats_timer tm;
 	//char cmd[4096];
-	fprintf(stderr, "%s/%s differs\n", prefix, d1->d_name);
+	fprintf(stderr, "%s differs\n", relp.buf);
+	STATS_ADD(changed, 1);
 	if(!t) return 0;
 
-	sprintf(realname1, "%s%s/%s", base1, prefix, d1->d_name);
-	sprintf(realname2, "%s%s/%s", base2, prefix, d2->d_name);
-	sprintf(savename, "%s%s/%s", "diff", prefix, d1->d_name);
+	stats_start(&tm);
 
 	//sprintf(cmd, "cp %s patch", realname2);
 	//sprintf(cmd, "/home/stephan/rdiff %s %s patch", realname1, realname2);
@@ -142,129 +1156,1002 @@ static int do_diff(struct dirent *d1, struct dirent *d2)
 	//sprintf(cmd, "/usr/bin/bsdiff %s %s patch", realname1, realname2);
 	//sprintf(cmd, "/home/stephan/src/fsdiff/bsdiff %s %s patch", realname1, realname2);
 	//system(cmd);
-	bsdiff(realname1, realname2, "patch");
+	ret = lstat(newp.buf, &sb);
+	/* a name inside an added directory was written first */
+	if((in = inode_find(&sb)) != NULL && in->ready &&
+			strcmp(inode_name(in), relp.buf + 1)) {
+		lstat(oldp.buf, &osb);
+		th_set_from_stat(t, &osb);
+		th_set_path(t, savename("delete"));
+		th_set_size(t, 0);
+		th_finish(t);
+		th_write(t);
+		if(tar_append_link(t, &sb, savename("add"), inode_name(in)) != 0)
+			perror(relp.buf);
+		stats_file(savename("add"), stats_stop(&tm, ST_DIFF));
+		return 0;
+	}
+	sparse = is_sparse(&sb) || (lstat(oldp.buf, &osb) == 0 && is_sparse(&osb));
+	/* the same new contents were already diffed or added elsewhere */
+	if(!is_sparse(&sb) &&
+			(source = blob_find(newp.buf, &sb, &crc, &hascrc)) != NULL) {
+		/* a copy stands for an add, so the old file goes first */
+		lstat(oldp.buf, &osb);
+		th_set_from_stat(t, &osb);
+		th_set_path(t, savename("delete"));
+		th_set_size(t, 0);
+		th_finish(t);
+		th_write(t);
+		if(tar_append_copy(t, &sb, relp.buf + 1, source) != 0)
+			perror(relp.buf);
+		inode_written(&sb, relp.buf + 1);
+		stats_file(savename("copy"), stats_stop(&tm, ST_DIFF));
+		return 0;
+	}
+	fast = fast_above >= 0 && sb.st_size > fast_above;
+	if(sparse) {
+		if(sparse_diff(oldp.buf, newp.buf, tmppatch) != 0)
+			perror(relp.buf);
+	} else if(!(exe = elfdiff(oldp.buf, newp.buf, tmppatch, fast) == 0) &&
+			!(compressed = zdiff(oldp.buf, newp.buf, tmppatch, fast) == 0))
+		bsdiff(oldp.buf, newp.buf, tmppatch, fast, 1);
 
-	ret = lstat(realname2, &sb);
 	th_set_from_stat(t, &sb);
-	th_set_path(t, savename);
-	ret = lstat("patch", &sb);
+	th_set_path(t, savename(sparse ? "sparsediff" : exe ? "elfdiff" :
+				compressed ? "zdiff" : "diff"));
+	ret = lstat(tmppatch, &sb);
 	th_set_size(t, sb.st_size);
 	th_finish(t);
 	if(t->options & TAR_VERBOSE)
 		th_print_long_ls(t);
 	th_write(t);
-	tar_append_regfile(t, "patch");
+	tar_append_regfile(t, tmppatch);
 	//system("rm patch");
-	unlink("patch");
+	unlink(tmppatch);
+	if(lstat(newp.buf, &sb) == 0) {
+		inode_written(&sb, relp.buf + 1);
+		if(!sparse)
+			blob_add(relp.buf + 1, &sb, crc, hascrc);
+	}
+	stats_file(savep.buf, stats_stop(&tm, ST_DIFF));
+}
+
+/* another name for a file written, or left in place, earlier */
+static int do_link(const char *target)
+{
+	struct stat sb;
+
+	fprintf(stderr, "%s is a link to %s\n", relp.buf, target);
+	STATS_ADD(added, 1);
+	if(!t) return 0;
+
+	if(lstat(newp.buf, &sb) != 0 ||
+			tar_append_link(t, &sb, savename("add"), target) != 0) {
+		perror(relp.buf);
+		return -1;
+	}
+	return 0;
+}
+
+/* The walk only records what changed; the archive is written from this
+ * list afterwards so that the checksum manifest can lead it.  Records
+ * are the verb, the d_type and the relative path with its NUL, links
+ * are followed by their target. */
+enum { PLAN_ADD = 'a', PLAN_DELETE = 'r', PLAN_DIFF = 'd', PLAN_LINK = 'l' };
+
+static struct path plan, sums;
+static const char *oldroot;
+static int nosums;
+
+/* Lookahead for the walk and the replay: files they are about to read
+ * are handed to posix_fadvise(WILLNEED), which queues asynchronous
+ * reads, so the disk works while the current pair is compared or diffed.
+ * Up to --prefetch bytes (default 64M, 0 for none) are requested ahead of
+ * the reader, and no more than that of any one file. */
+static off_t prefetch_window = 64 << 20;
+static off_t prefetch_ahead;
+
+static off_t prefetch_len(off_t size)
+{
+	return size < prefetch_window ? size : prefetch_window;
+}
+
+/* start reading the regular file at path, returns the bytes charged to
+ * the window, which prefetch_done() gives back once it has been read */
+static off_t prefetch(const char *path)
+{
+	struct stat sb;
+	off_t len;
+	int fd;
+
+	if((fd = open(path, O_RDONLY|O_NOFOLLOW|O_NONBLOCK)) < 0)
+		return 0;
+	len = 0;
+	if(fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size) {
+		len = prefetch_len(sb.st_size);
+		posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+	}
+	close(fd);
+	prefetch_ahead += len;
+	return len;
+}
+
+static void prefetch_done(off_t len)
+{
+	prefetch_ahead -= len;
+}
+
+/* the files the plan entry at off will read, bsdiff reads both sides of
+ * a diff and an add of a regular file reads it; returns the bytes
+ * charged */
+static off_t prefetch_entry(size_t off)
+{
+	static struct path pf;
+	const char *rel = plan.buf + off + 2;
+	int verb = plan.buf[off], type = (unsigned char)plan.buf[off + 1];
+	off_t len = 0;
+
+	if(verb == PLAN_DIFF) {
+		path_set(&pf, oldroot, strlen(oldroot));
+		path_cat(&pf, rel, strlen(rel));
+		len += prefetch(pf.buf);
+	}
+	if(verb == PLAN_DIFF || (verb == PLAN_ADD && type == DT_REG)) {
+		path_set(&pf, newroot, strlen(newroot));
+		path_cat(&pf, rel, strlen(rel));
+		len += prefetch(pf.buf);
+	}
+	return len;
+}
+
+static size_t plan_next(size_t off)
+{
+	size_t len = strlen(plan.buf + off + 2);
+
+	if(plan.buf[off] == PLAN_LINK)
+		len += strlen(plan.buf + off + 2 + len + 1) + 1;
+	return off + 2 + len + 1;
+}
+
+static void plan_entry(int verb, int type)
+{
+	path_reserve(&plan, 2 + relp.len);
+	plan.buf[plan.len++] = verb;
+	plan.buf[plan.len++] = type;
+	memcpy(plan.buf + plan.len, relp.buf, relp.len + 1);
+	plan.len += relp.len + 1;
+}
+
+static void plan_link(const struct inode *in)
+{
+	const char *target = inode_name(in);
+
+	plan_entry(PLAN_LINK, DT_REG);
+	path_cat(&plan, target, strlen(target));
+	plan.len++;
 }
 
-static int cmpdir(const char* a, const char* b)
+/* With --cache-dir, the CRC32C of every file summed so far is kept per
+ * tree root with the identity the file had, so diffs against a base that
+ * was seen before do not read it again.  Records are "dev ino size mtime
+ * ctime crc path" NUL terminated, numbers in hex, times as sec.nsec. */
+struct mfent {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime, ctime;
+	uint32_t crc;
+	size_t path;
+};
+
+struct manifest {
+	char name[PATH_MAX];
+	struct mfent *v;
+	size_t n, size;
+	size_t *hash, hashsize;	/* index+1 into v, 0 is empty */
+	struct path paths;
+	int dirty;
+};
+
+static struct manifest oldmf, newmf;
+
+static size_t mf_hash(const struct manifest *m, const char *path)
 {
-	struct dirent **namelist1, **namelist2;
+	size_t h = 14695981039346656037ULL;
+
+	for(; *path; path++)
+		h = (h ^ (unsigned char)*path) * 1099511628211ULL;
+	return h & (m->hashsize - 1);
+}
+
+static struct mfent *mf_find(const struct manifest *m, const char *path)
+{
+	size_t h;
+
+	if(!m->hashsize)
+		return NULL;
+	for(h = mf_hash(m, path); m->hash[h]; h = (h + 1) & (m->hashsize - 1))
+		if(!strcmp(m->paths.buf + m->v[m->hash[h] - 1].path, path))
+			return &m->v[m->hash[h] - 1];
+	return NULL;
+}
+
+static struct mfent *mf_insert(struct manifest *m, const char *path)
+{
+	struct mfent *e = mf_find(m, path);
+	size_t i, h;
+
+	if(e)
+		return e;
+	if(m->n == m->size) {
+		m->size = m->size ? 2 * m->size : 256;
+		if((m->v = realloc(m->v, m->size * sizeof(*m->v))) == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(2 * (m->n + 1) > m->hashsize) {
+		free(m->hash);
+		m->hashsize = m->hashsize ? 2 * m->hashsize : 512;
+		if((m->hash = calloc(m->hashsize, sizeof(*m->hash))) == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for(i = 0; i < m->n; i++) {
+			for(h = mf_hash(m, m->paths.buf + m->v[i].path); m->hash[h];
+					h = (h + 1) & (m->hashsize - 1))
+				;
+			m->hash[h] = i + 1;
+		}
+	}
+	e = &m->v[m->n];
+	e->path = m->paths.len;
+	path_cat(&m->paths, path, strlen(path));
+	m->paths.len++;
+	for(h = mf_hash(m, path); m->hash[h]; h = (h + 1) & (m->hashsize - 1))
+		;
+	m->hash[h] = ++m->n;
+	return e;
+}
+
+/* the manifest for the tree at root, named after its real path */
+static void mf_load(struct manifest *m, const char *root)
+{
+	char real[PATH_MAX], *buf, *p, *end;
+	unsigned long long v[8];
+	struct mfent *e;
+	struct stat sb;
+	size_t h = 14695981039346656037ULL;
+	int fd, i;
+
+	if(!cache_dir || !realpath(root, real))
+		return;
+	for(p = real; *p; p++)
+		h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+	snprintf(m->name, sizeof(m->name), "%s/tree-%016llx.mf", cache_dir,
+			(unsigned long long)h);
+	if((fd = open(m->name, O_RDONLY)) < 0)
+		return;
+	if(fstat(fd, &sb) != 0 || !sb.st_size || (buf = mmap(NULL, sb.st_size,
+			PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	futimens(fd, NULL);
+	close(fd);
+	for(p = buf, end = buf + sb.st_size; p < end; p += strlen(p) + 1) {
+		if(!memchr(p, 0, end - p))
+			break;
+		for(i = 0; i < 8; i++)
+			v[i] = strtoull(p, &p, 16), p++;
+		e = mf_insert(m, p);
+		e->dev = v[0];
+		e->ino = v[1];
+		e->size = v[2];
+		e->mtime.tv_sec = v[3];
+		e->mtime.tv_nsec = v[4];
+		e->ctime.tv_sec = v[5];
+		e->ctime.tv_nsec = v[6];
+		e->crc = v[7];
+	}
+	munmap(buf, sb.st_size);
+}
+
+static void mf_save(struct manifest *m)
+{
+	struct path out = { 0 };
+	struct mfent *e;
+	char rec[160];
+	size_t i;
+
+	if(!m->dirty)
+		return;
+	for(i = 0; i < m->n; i++) {
+		e = &m->v[i];
+		snprintf(rec, sizeof(rec), "%llx %llx %llx %llx.%lx %llx.%lx %x ",
+			(unsigned long long)e->dev, (unsigned long long)e->ino,
+			(unsigned long long)e->size,
+			(unsigned long long)e->mtime.tv_sec, e->mtime.tv_nsec,
+			(unsigned long long)e->ctime.tv_sec, e->ctime.tv_nsec, e->crc);
+		path_cat(&out, rec, strlen(rec));
+		path_cat(&out, m->paths.buf + e->path, strlen(m->paths.buf + e->path));
+		out.len++;
+	}
+	cache_store(m->name, "", 0, out.buf, out.len);
+	free(out.buf);
+}
+
+/* crc32c_fd() of the file at rel in m's tree, from the manifest when the
+ * file is still the one that was summed */
+static int mf_crc(struct manifest *m, const char *rel, int fd, off_t *size,
+		uint32_t *crc)
+{
+	struct mfent *e;
+	struct stat sb;
+
+	if(!m->name[0] || fstat(fd, &sb) != 0)
+		return crc32c_fd(fd, size, crc);
+	e = mf_find(m, rel);
+	if(e && e->dev == sb.st_dev && e->ino == sb.st_ino &&
+			e->size == sb.st_size &&
+			e->mtime.tv_sec == sb.st_mtim.tv_sec &&
+			e->mtime.tv_nsec == sb.st_mtim.tv_nsec &&
+			e->ctime.tv_sec == sb.st_ctim.tv_sec &&
+			e->ctime.tv_nsec == sb.st_ctim.tv_nsec) {
+		STATS_ADD(cache_hits, 1);
+		*size = e->size;
+		*crc = e->crc;
+		return 0;
+	}
+	STATS_ADD(cache_misses, 1);
+	if(crc32c_fd(fd, size, crc) != 0)
+		return -1;
+	e = mf_insert(m, rel);
+	e->dev = sb.st_dev;
+	e->ino = sb.st_ino;
+	e->size = sb.st_size;
+	e->mtime = sb.st_mtim;
+	e->ctime = sb.st_ctim;
+	e->crc = *crc;
+	m->dirty = 1;
+	return 0;
+}
+
+/* Manifest records, "verb presize precrc postsize postcrc path" NUL
+ * terminated, sizes and CRC32Cs in hex.  Diffs carry the base file as
+ * the pre-image, adds only a post-image. */
+static void sum_entry(int verb)
+{
+	int fd;
+	off_t presize = 0, postsize = 0;
+	uint32_t precrc = 0, postcrc = 0;
+	char rec[64];
+	struct stats_timer tm;
+
+	stats_start(&tm);
+	if(verb == PLAN_DIFF) {
+		if((fd = open(oldp.buf, O_RDONLY)) < 0 ||
+				mf_crc(&oldmf, relp.buf + 1, fd, &presize, &precrc) != 0) {
+			perror(oldp.buf);
+			if(fd >= 0)
+				close(fd);
+			return;
+		}
+		close(fd);
+	}
+	if((fd = open(newp.buf, O_RDONLY)) < 0 ||
+			mf_crc(&newmf, relp.buf + 1, fd, &postsize, &postcrc) != 0) {
+		perror(newp.buf);
+		if(fd >= 0)
+			close(fd);
+		return;
+	}
+	close(fd);
+	STATS_ADD(bytes_read, presize + postsize);
+	snprintf(rec, sizeof(rec), "%c %llx %08x %llx %08x ", verb,
+			(unsigned long long)presize, precrc,
+			(unsigned long long)postsize, postcrc);
+	path_cat(&sums, rec, strlen(rec));
+	path_cat(&sums, relp.buf + 1, relp.len - 1);
+	sums.len++;
+	stats_stop(&tm, ST_SUM);
+}
+
+/* sum every regular file an add of newp will archive */
+static void sum_add(int type)
+{
+	DIR *dir;
+	struct dirent *dp;
+	struct stat sb;
+	size_t nlen, rlen;
+
+	if(type != DT_DIR) {
+		if(lstat(newp.buf, &sb) == 0 && S_ISREG(sb.st_mode))
+			sum_entry(PLAN_ADD);
+		return;
+	}
+	if((dir = opendir(newp.buf)) == NULL)
+		return;
+	while((dp = readdir(dir)) != NULL) {
+		if(!filter(dp))
+			continue;
+		nlen = path_push(&newp, dp->d_name, strlen(dp->d_name));
+		rlen = path_push(&relp, dp->d_name, strlen(dp->d_name));
+		sum_add(dp->d_type);
+		path_pop(&newp, nlen);
+		path_pop(&relp, rlen);
+	}
+	closedir(dir);
+}
+
+/* the manifest goes first so fspatch can check the tree up front */
+static void write_sums(void)
+{
+	FILE *f;
+	struct stat sb;
+
+	if(!sums.len)
+		return;
+	if((f = fopen(tmpsums, "w")) == NULL ||
+			fwrite(sums.buf, 1, sums.len, f) != sums.len ||
+			fclose(f) != 0) {
+		perror(tmpsums);
+		return;
+	}
+	lstat(tmpsums, &sb);
+	th_set_from_stat(t, &sb);
+	th_set_path(t, "sums");
+	th_finish(t);
+	th_write(t);
+	tar_append_regfile(t, tmpsums);
+	unlink(tmpsums);
+}
+
+/* write the archive entries recorded by cmpdir() */
+static void replay(void)
+{
+	size_t off, len, ahead = 0;
+	int verb, type;
+	const char *rel;
+	/* what each entry from off to ahead was charged, oldest first */
+	off_t *charged = NULL;
+	size_t head = 0, tail = 0, cap = 0;
+
+	for(off = 0; off < plan.len; off += 2 + len + 1) {
+		if(ahead < off)
+			ahead = off;
+		for(; ahead < plan.len && prefetch_ahead < prefetch_window;
+				ahead = plan_next(ahead)) {
+			if(tail == cap) {
+				cap = cap ? cap * 2 : 256;
+				if((charged = realloc(charged,
+						cap * sizeof(*charged))) == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			charged[tail++] = prefetch_entry(ahead);
+		}
+		verb = plan.buf[off];
+		type = (unsigned char)plan.buf[off + 1];
+		rel = plan.buf + off + 2;
+		len = strlen(rel);
+		path_set(&relp, rel, len);
+		path_set(&oldp, oldroot, strlen(oldroot));
+		path_cat(&oldp, rel, len);
+		path_set(&newp, newroot, strlen(newroot));
+		path_cat(&newp, rel, len);
+		if(verb == PLAN_ADD)
+			do_add(type);
+		else if(verb == PLAN_DELETE)
+			do_delete(type);
+		else if(verb == PLAN_LINK) {
+			do_link(rel + len + 1);
+			len += strlen(rel + len + 1) + 1;
+		} else
+			do_diff();
+		if(off < ahead) {
+			prefetch_done(charged[head++]);
+			if(head == tail)
+				head = tail = 0;
+		}
+	}
+	free(charged);
+}
+
+/* Prefetch what the walk reads in this directory ahead of (i1, i2): the
+ * pairs of regular files, compared or summed, and added files that are
+ * summed.  (j1, j2) is how far the lookahead got in the same merge. */
+static void prefetch_dir(size_t idx1, int n1, size_t idx2, int n2,
+		int *j1, int *j2)
+{
+	struct entry *e1, *e2;
+	size_t olen, nlen;
+	int ret;
+
+	while(prefetch_ahead < prefetch_window && (*j1 < n1 || *j2 < n2)) {
+		e1 = *j1 < n1 ? entry_at(idx1, *j1) : NULL;
+		e2 = *j2 < n2 ? entry_at(idx2, *j2) : NULL;
+		ret = !e1 ? 1 : !e2 ? -1 : strcoll(e1->name, e2->name);
+		if(ret < 0) {
+			(*j1)++;
+			continue;
+		}
+		nlen = path_push(&newp, e2->name, e2->len);
+		if(ret > 0) {
+			if(e2->type == DT_REG && t && !nosums)
+				e2->prefetched = prefetch(newp.buf);
+			(*j2)++;
+		} else {
+			if(e1->type == DT_REG && e2->type == DT_REG) {
+				olen = path_push(&oldp, e1->name, e1->len);
+				e2->prefetched = prefetch(oldp.buf);
+				e2->prefetched += prefetch(newp.buf);
+				path_pop(&oldp, olen);
+			}
+			(*j1)++, (*j2)++;
+		}
+		path_pop(&newp, nlen);
+	}
+}
+
+/* compare the directories at oldp and newp */
+static int cmpdir(void)
+{
+	size_t mark, idx1, idx2;
 	int n1, n2;
-	int i1 = 0, i2 = 0;
-	n1 = scandir(a, &namelist1, filter, alphasort);
+	int i1 = 0, i2 = 0, j1 = 0, j2 = 0;
+	struct stats_timer tm;
+	stats_start(&tm);
+	mark = arena.len;
+	idx1 = scanentries(oldp.buf, &n1);
 	if (n1 < 0)
 		perror("scandir");
-	//printf("%d entries in %s\n", n1, a);
-	n2 = scandir(b, &namelist2, filter, alphasort);
+	//printf("%d entries in %s\n", n1, oldp.buf);
+	idx2 = scanentries(newp.buf, &n2);
 	if (n2 < 0)
 		perror("scandir");
-	//printf("%d entries in %s\n", n2, b);
+	//printf("%d entries in %s\n", n2, newp.buf);
+	stats_stop(&tm, ST_WALK);
 	while (i1 < n1 || i2 < n2) {
 		int ret; 
-		if (i1 >= n1)
+		struct entry *e1 = NULL, *e2 = NULL;
+		size_t olen, nlen, rlen;
+		if (j1 < i1 || j2 < i2)
+			j1 = i1, j2 = i2;
+		if (prefetch_window)
+			prefetch_dir(idx1, n1, idx2, n2, &j1, &j2);
+		if (i1 < n1)
+			e1 = entry_at(idx1, i1);
+		if (i2 < n2)
+			e2 = entry_at(idx2, i2);
+		if (!e1)
 			ret = 1;
-		else if (i2 >= n2)
+		else if (!e2)
 			ret = -1;
 		else
-			ret = alphasort((const struct dirent **)namelist1+i1, (const struct dirent **)namelist2+i2);
+			ret = strcoll(e1->name, e2->name);
 
 		if (ret < 0) {
-			do_delete(namelist1[i1]);
-			free(namelist1[i1]);
+			olen = path_push(&oldp, e1->name, e1->len);
+			rlen = path_push(&relp, e1->name, e1->len);
+			plan_entry(PLAN_DELETE, e1->type);
+			path_pop(&oldp, olen);
+			path_pop(&relp, rlen);
 			i1++;
 		} else if (ret > 0) {
-			do_add(namelist2[i2]);
-			free(namelist2[i2]);
+			struct stat sb;
+			struct inode *in = NULL;
+			nlen = path_push(&newp, e2->name, e2->len);
+			rlen = path_push(&relp, e2->name, e2->len);
+			if(e2->type == DT_REG && lstat(newp.buf, &sb) == 0 &&
+					(in = inode_find(&sb)) == NULL)
+				inode_add(&sb, NULL, relp.buf + 1, 0);
+			if(in)
+				plan_link(in);
+			else
+				plan_entry(PLAN_ADD, e2->type);
+			if(t && !nosums && !in)
+				sum_add(e2->type);
+			prefetch_done(e2->prefetched);
+			path_pop(&newp, nlen);
+			path_pop(&relp, rlen);
 			i2++;
 		} else {
-			char buf1[1024], buf2[1024];
-			//printf("%s match (recurse)\n", namelist1[i1]->d_name);
-			sprintf(buf1, "%s/%s", a, namelist1[i1]->d_name);
-			sprintf(buf2, "%s/%s", b, namelist2[i2]->d_name);
-			if(namelist1[i1]->d_type != namelist2[i2]->d_type)
+			//printf("%s match (recurse)\n", e1->name);
+			olen = path_push(&oldp, e1->name, e1->len);
+			nlen = path_push(&newp, e2->name, e2->len);
+			rlen = path_push(&relp, e1->name, e1->len);
+			if(e1->type != e2->type)
 			{
-				fprintf(stderr, "%s types differ, delete then add?\n", namelist1[i1]->d_name);
-			} else if(namelist1[i1]->d_type == DT_LNK) {
+				fprintf(stderr, "%s types differ, delete then add?\n", e1->name);
+			} else if(e1->type == DT_LNK) {
+				static char buf1[PATH_MAX], buf2[PATH_MAX];
 				int len1, len2;
-				len1 = readlink(buf1, buf1, 1024);
-				len2 = readlink(buf2, buf2, 1024);
+				len1 = readlink(oldp.buf, buf1, sizeof(buf1));
+				len2 = readlink(newp.buf, buf2, sizeof(buf2));
 				//printf("SYMLINK %d %d\n", len1, len2);
 				if(len1 != len2 || strncmp(buf1, buf2, len1)) {
-					fprintf(stderr, "%s symlink target mismatch\n", namelist1[i1]->d_name);
+					fprintf(stderr, "%s symlink target mismatch\n", e1->name);
 				}
-			} else if(namelist1[i1]->d_type == DT_DIR) {
-				int len;
-				len = strlen(prefix);
-				strcat(prefix, "/");
-				strcat(prefix, namelist1[i1]->d_name);
-				cmpdir(buf1,buf2);
-				prefix[len] = 0;
+			} else if(e1->type == DT_DIR) {
+				cmpdir();
 			} else {
 				// stat files and compare
 				struct stat sb1, sb2;
-				ret = stat(buf1, &sb1);
+				struct inode *in;
+				stats_start(&tm);
+				ret = stat(oldp.buf, &sb1);
 				if(ret != 0)
-					fprintf(stderr, "couldn't stat %s\n", buf1);
-				ret = stat(buf2, &sb2);
+					fprintf(stderr, "couldn't stat %s\n", oldp.buf);
+				ret = stat(newp.buf, &sb2);
 				if(ret != 0)
-					fprintf(stderr, "couldn't stat %s\n", buf2);
-				if(sb1.st_size != sb2.st_size ||
-						cmpfiles(buf1, buf2, sb1.st_size)) {
-					 do_diff(namelist1[i1], namelist2[i2]);
+					fprintf(stderr, "couldn't stat %s\n", newp.buf);
+				stats_stop(&tm, ST_WALK);
+				if((in = inode_find(&sb2)) != NULL) {
+					/* another name for an inode seen before, only
+					 * a link that is already there can stay */
+					if(in->ready && in->oldino == sb1.st_ino &&
+							in->olddev == sb1.st_dev)
+						STATS_ADD(unchanged, 1);
+					else {
+						plan_entry(PLAN_DELETE, e1->type);
+						plan_link(in);
+					}
+				} else if(sb1.st_size != sb2.st_size ||
+						cmpfiles(oldp.buf, newp.buf, sb1.st_size)) {
+					inode_add(&sb2, &sb1, relp.buf + 1, 0);
+					plan_entry(PLAN_DIFF, e1->type);
+					if(t && !nosums)
+						sum_entry(PLAN_DIFF);
+				} else {
+					inode_add(&sb2, &sb1, relp.buf + 1, 1);
+					STATS_ADD(unchanged, 1);
 				}
+				prefetch_done(e2->prefetched);
 			}
-			free(namelist1[i1]);
-			free(namelist2[i2]);
+			path_pop(&oldp, olen);
+			path_pop(&newp, nlen);
+			path_pop(&relp, rlen);
 			i1++, i2++;
 		}
 	}
-	free(namelist1);
-	free(namelist2);
+	arena.len = mark;
 
 	return 0;
 }
 
-int main(int argc, char **argv)
+/* --serve: a request is its length as an int, sent with the client's
+ * stdout and stderr as SCM_RIGHTS, then the client's working directory
+ * and arguments, each NUL terminated.  A forked child runs it like a
+ * fsdiff invocation of its own and answers with the exit status. */
+static int serve_fd = -1, serve_log = -1, serve_id;
+static pid_t serve_pid;
+static char **serve_argv;
+
+static void serve_done(int status, void *arg)
 {
-	int ret;
-	if(argc < 3) {
-		fprintf(stderr, "Usage: %s old new [patch]\n", argv[0]);
+	FILE *f;
+	int i;
+
+	/* not in the forked bsdiff children */
+	if(getpid() != serve_pid)
+		return;
+	fflush(stdout);
+	fflush(stderr);
+	write(serve_fd, &status, sizeof(status));
+	if(!stats || (f = fdopen(serve_log, "w")) == NULL)
+		return;
+	fprintf(f, "{\"request\":%d,\"pid\":%d,\"status\":%d,\"wall_s\":%.6f,"
+		"\"bytes_read\":%llu,\"bytes_written\":%llu,"
+		"\"files\":{\"added\":%llu,\"deleted\":%llu,\"changed\":%llu,"
+		"\"unchanged\":%llu},\"cache\":{\"hits\":%llu,\"misses\":%llu},"
+		"\"args\":[", serve_id, (int)getpid(), status,
+		(stats_clock(CLOCK_MONOTONIC) - stats->start) / 1e9,
+		stats->bytes_read, stats->bytes_written, stats->added,
+		stats->deleted, stats->changed, stats->unchanged,
+		stats->cache_hits, stats->cache_misses);
+	for(i = 0; serve_argv[i]; i++) {
+		if(i)
+			fputc(',', f);
+		stats_string(f, serve_argv[i]);
+	}
+	fprintf(f, "]}\n");
+	fclose(f);
+}
+
+static int fsdiff(int argc, char **argv);
+
+static int serve_request(int fd)
+{
+	char cbuf[CMSG_SPACE(2 * sizeof(int))], *buf, *p;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	int len, fds[2], argc, i;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if(recvmsg(fd, &msg, 0) != sizeof(len) || len <= 0 || len > 1 << 20 ||
+			(cm = CMSG_FIRSTHDR(&msg)) == NULL ||
+			cm->cmsg_type != SCM_RIGHTS ||
+			cm->cmsg_len != CMSG_LEN(sizeof(fds)))
+		return EXIT_FAILURE;
+	memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+	if((buf = malloc(len + 1)) == NULL)
+		return EXIT_FAILURE;
+	for(i = 0; i < len; i += ret)
+		if((ret = read(fd, buf + i, len - i)) <= 0)
+			return EXIT_FAILURE;
+	buf[len] = 0;
+	for(p = buf, argc = 0; p < buf + len; p += strlen(p) + 1)
+		argc++;
+	if(argc < 1 || (serve_argv = calloc(argc + 1, sizeof(char *))) == NULL)
+		return EXIT_FAILURE;
+	serve_argv[0] = "fsdiff";
+	for(p = buf + strlen(buf) + 1, i = 1; i < argc; p += strlen(p) + 1)
+		serve_argv[i++] = p;
+
+	serve_fd = fd;
+	serve_log = dup(2);
+	dup2(fds[0], 1);
+	dup2(fds[1], 2);
+	close(fds[0]);
+	close(fds[1]);
+	if(chdir(buf) != 0) {
+		perror(buf);
+		return EXIT_FAILURE;
+	}
+	snprintf(tmppatch, sizeof(tmppatch), ".fsdiff.%d.patch", (int)getpid());
+	snprintf(tmpsums, sizeof(tmpsums), ".fsdiff.%d.sums", (int)getpid());
+	stats_init();
+	serve_pid = getpid();
+	on_exit(serve_done, NULL);
+	optind = 0;
+	exit(fsdiff(argc, serve_argv));
+}
+
+/* accept requests on path forever, one child each, running concurrently */
+static int serve(const char *path)
+{
+	struct sockaddr_un sa;
+	struct pollfd pfd;
+	struct stat sb;
+	int fd, cfd, status, done;
+	pid_t pid;
+
+	if(strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "%s: name too long\n", path);
 		exit(EXIT_FAILURE);
 	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if(lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+		unlink(path);
+	umask(077);
+	if((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0 ||
+			bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+			listen(fd, 64) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	cache_trim(cache_budget, 1);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for(;;) {
+		poll(&pfd, 1, 1000);
+		for(done = 0; (pid = waitpid(-1, &status, WNOHANG)) > 0; done++)
+			;
+		if(done)
+			cache_trim(cache_budget, 1);
+		if(!(pfd.revents & POLLIN))
+			continue;
+		if((cfd = accept(fd, NULL, NULL)) < 0)
+			continue;
+		serve_id++;
+		pid = fork();
+		if(pid == 0) {
+			close(fd);
+			exit(serve_request(cfd));
+		}
+		if(pid < 0)
+			perror("fork");
+		close(cfd);
+	}
+}
+
+/* --connect: hand the rest of the command line to a --serve daemon */
+static int connect_serve(const char *path, int argc, char **argv, int skip)
+{
+	struct sockaddr_un sa;
+	char cbuf[CMSG_SPACE(2 * sizeof(int))], cwd[PATH_MAX];
+	struct path req = { 0 };
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	int fd, len, status, fds[2] = { 1, 2 }, i;
+
+	if(strlen(path) >= sizeof(sa.sun_path) || !getcwd(cwd, sizeof(cwd))) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	path_cat(&req, cwd, strlen(cwd));
+	req.len++;
+	for(i = 1; i < argc; i++) {
+		if(i == skip)
+			continue;
+		path_cat(&req, argv[i], strlen(argv[i]));
+		req.len++;
+	}
+	len = req.len;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+			connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+			sendmsg(fd, &msg, 0) != sizeof(len) ||
+			write(fd, req.buf, req.len) != (ssize_t)req.len) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	if(read(fd, &status, sizeof(status)) != sizeof(status))
+		return EXIT_FAILURE;
+	return status;
+}
+
+static int fsdiff(int argc, char **argv)
+{
+	int ret, ch, dostats = 0;
+	char *statspath = NULL, *servepath = NULL;
+	static struct option longopts[] = {
+		{ "fast", no_argument, NULL, 'f' },
+		{ "fast-above", required_argument, NULL, 'F' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "budget", required_argument, NULL, 'm' },
+		{ "no-sums", no_argument, NULL, 'n' },
+		{ "no-dedup", no_argument, NULL, 'D' },
+		{ "no-zdiff", no_argument, NULL, 'Z' },
+		{ "no-elfdiff", no_argument, NULL, 'E' },
+		{ "prefetch", required_argument, NULL, 'P' },
+		{ "stats", optional_argument, NULL, 'S' },
+		{ "cache-dir", required_argument, NULL, 'C' },
+		{ "cache-budget", required_argument, NULL, 'B' },
+		{ "serve", required_argument, NULL, 'L' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while((ch = getopt_long(argc, argv, "123456789fF:j:m:", longopts, NULL)) != -1) {
+		switch(ch) {
+		case '1': case '2': case '3': case '4': case '5':
+		case '6': case '7': case '8': case '9':
+			level[0] = '-';
+			level[1] = ch;
+			break;
+		case 'f':
+			fast_above = 0;
+			break;
+		case 'F':
+			fast_above = parse_size(optarg);
+			break;
+		case 'j':
+			jobs = optarg;
+			break;
+		case 'm':
+			budget = optarg;
+			break;
+		case 'n':
+			nosums = 1;
+			break;
+		case 'D':
+			nodedup = 1;
+			break;
+		case 'Z':
+			nozdiff = 1;
+			break;
+		case 'E':
+			noelfdiff = 1;
+			break;
+		case 'P':
+			prefetch_window = parse_size(optarg);
+			break;
+		case 'S':
+			dostats = 1;
+			statspath = optarg;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 'B':
+			cache_budget = parse_size(optarg);
+			break;
+		case 'L':
+			servepath = serve_fd < 0 ? optarg : NULL;
+			break;
+		default:
+			argc = 0;
+		}
+	}
+	if(servepath && argc == optind)
+		return serve(servepath);
+	if(argc - optind < 2) {
+		fprintf(stderr, "Usage: %s [-1..-9] [--fast] [--fast-above size] [-j jobs] [-m budget] [--no-sums] [--no-dedup] [--no-zdiff] [--no-elfdiff] [--prefetch size] [--stats[=file]] [--cache-dir dir] [--cache-budget size] old new [patch]\n"
+			"       %s --serve=socket [--cache-dir dir] [--cache-budget size]\n"
+			"       %s --connect=socket [options] old new [patch]\n",
+			argv[0], argv[0], argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	argc -= optind;
+	argv += optind;
+	if(dostats)
+		stats_init();
 
 	t = NULL;
 
-	if(argc >= 4) {
-		if(!strcmp(argv[3], "-"))
-			ret = tar_fdopen(&t, 1, "stdout", NULL, O_WRONLY|O_CREAT, 0644, TAR_GNU/*|TAR_VERBOSE*/);
+	if(argc >= 3) {
+		if(!strcmp(argv[2], "-"))
+			ret = tar_fdopen(&t, 1, "stdout", &type, O_WRONLY|O_CREAT, 0644, TAR_GNU/*|TAR_VERBOSE*/);
 		else
-			ret = tar_open(&t, argv[3], NULL, O_WRONLY|O_CREAT, 0644, TAR_GNU/*|TAR_VERBOSE*/);
+			ret = tar_open(&t, argv[2], &type, O_WRONLY|O_CREAT, 0644, TAR_GNU/*|TAR_VERBOSE*/);
 		if(ret != 0) {
 			fprintf(stderr, "%d\n", ret);
 			perror("tar_open");
 		}
 	}
 
-	base1 = argv[1];
-	base2 = argv[2];
-	cmpdir(argv[1], argv[2]);
+	oldroot = argv[0];
+	newroot = argv[1];
+	mf_load(&oldmf, oldroot);
+	mf_load(&newmf, newroot);
+	path_set(&oldp, oldroot, strlen(oldroot));
+	path_set(&newp, newroot, strlen(newroot));
+	path_set(&relp, "", 0);
+	cmpdir();
+	if(t)
+		write_sums();
+	replay();
 
 	if(t) {
 		tar_append_eof(t);
 		tar_close(t);
 	}
+	mf_save(&oldmf);
+	mf_save(&newmf);
+	if(serve_fd < 0)
+		cache_trim(cache_budget, 0);
+
+	if(dostats)
+		stats_print("fsdiff", statspath);
 
 	return 0;
 }
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	for(i = 1; i < argc && strcmp(argv[i], "--"); i++)
+		if(!strncmp(argv[i], "--connect=", 10))
+			return connect_serve(argv[i] + 10, argc, argv, i);
+	return fsdiff(argc, argv);
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -5,16 +6,32 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <getopt.h>
 
 #include <libtar.h>
-#include <utime.h>
+
+#include "stats.c"
+#include "crc32c.c"
+#include "uring.c"
+#include "sparse.c"
+#include "zchunk.c"
+#include "elf.c"
+#include "journal.c"
 
 static TAR *t;
 static const char* base;
 
+/* --sync: nothing, fdatasync every written file and fsync its directory,
+ * or one syncfs() once everything is written */
+enum { SYNC_NONE, SYNC_FILE, SYNC_FS };
+static int durability = SYNC_NONE;
+
 static ssize_t xread(int fd, void *buf, size_t count)
 {
 	int ret, len = 0;
@@ -24,6 +41,8 @@ static ssize_t xread(int fd, void *buf, size_t count)
 			continue;
 		if (ret < 0)
 			return ret;
+		if (ret == 0)
+			break;
 		len += ret;
 	} while (len < count);
 	return len;
@@ -43,64 +62,580 @@ static ssize_t xwrite(int fd, const void *buf, size_t count)
 	return len;
 }
 
-/* libtar */
-#define HAVE_LCHOWN
-static int
-tar_set_file_perms(TAR *t, char *realname)
-{
+/* Directories from the root being patched down to the parent of the
+ * current entry.  Each level is opened relative to the one above, so
+ * moving to the next archive entry only resolves the components that
+ * changed and every operation is done on a (dirfd, name) pair.
+ *
+ * Owner, mode and times are queued on the level holding the entry and
+ * applied when the walk leaves that directory, which also keeps a
+ * directory's mtime and mode from being disturbed by its contents. */
+struct meta {
+	size_t name;
 	mode_t mode;
 	uid_t uid;
 	gid_t gid;
-	struct utimbuf ut;
-	char *filename;
-
-	filename = (realname ? realname : th_get_pathname(t));
-	mode = th_get_mode(t);
-	uid = th_get_uid(t);
-	gid = th_get_gid(t);
-	ut.modtime = ut.actime = th_get_mtime(t);
-
-	/* change owner/group */
-	if (geteuid() == 0)
-#ifdef HAVE_LCHOWN
-		if (lchown(filename, uid, gid) == -1)
-		{
-# ifdef DEBUG
-			fprintf(stderr, "lchown(\"%s\", %d, %d): %s\n",
-				filename, uid, gid, strerror(errno));
-# endif
-#else /* ! HAVE_LCHOWN */
-		if (!TH_ISSYM(t) && chown(filename, uid, gid) == -1)
-		{
-# ifdef DEBUG
-			fprintf(stderr, "chown(\"%s\", %d, %d): %s\n",
-				filename, uid, gid, strerror(errno));
-# endif
-#endif /* HAVE_LCHOWN */
+	time_t mtime;
+	int sym;
+};
+
+struct level {
+	int fd;
+	size_t len;		/* strlen(dirpath) at this level */
+	size_t nmeta;		/* first queued meta of this level */
+};
+
+static struct level *levels;
+static size_t nlevels, levelscap;
+static char *dirpath;
+static size_t dirpathcap;
+static struct meta *metas;
+static size_t nmetas, metascap;
+static char *metanames;
+static size_t metanameslen, metanamescap;
+
+static void *grow(void *p, size_t *cap, size_t need)
+{
+	if(need <= *cap)
+		return p;
+	if(!*cap)
+		*cap = 256;
+	while(*cap < need)
+		*cap *= 2;
+	if((p = realloc(p, *cap)) == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void queue_meta(TAR *t, const char *name)
+{
+	size_t len = strlen(name) + 1;
+	struct meta *m;
+
+	metas = grow(metas, &metascap, (nmetas + 1) * sizeof(*metas));
+	metanames = grow(metanames, &metanamescap, metanameslen + len);
+	m = &metas[nmetas++];
+	m->name = metanameslen;
+	memcpy(metanames + metanameslen, name, len);
+	metanameslen += len;
+	m->mode = th_get_mode(t);
+	m->uid = th_get_uid(t);
+	m->gid = th_get_gid(t);
+	m->mtime = th_get_mtime(t);
+	m->sym = TH_ISSYM(t);
+}
+
+static void set_meta(int dirfd, struct meta *m)
+{
+	const char *name = metanames + m->name;
+	struct timespec ts[2];
+
+	if(geteuid() == 0 &&
+			fchownat(dirfd, name, m->uid, m->gid, AT_SYMLINK_NOFOLLOW) == -1)
+		perror("fchownat");
+	if(m->sym)
+		return;
+	if(fchmodat(dirfd, name, m->mode & 07777, 0) == -1)
+		perror("fchmodat");
+	ts[0].tv_sec = ts[1].tv_sec = m->mtime;
+	ts[0].tv_nsec = ts[1].tv_nsec = 0;
+	if(utimensat(dirfd, name, ts, 0) == -1)
+		perror("utimensat");
+}
+
+static void pushdir(int fd, size_t len)
+{
+	levels = grow(levels, &levelscap, (nlevels + 1) * sizeof(*levels));
+	levels[nlevels].fd = fd;
+	levels[nlevels].len = len;
+	levels[nlevels].nmeta = nmetas;
+	nlevels++;
+}
+
+/* --journal, and whether it was left by an interrupted run */
+static struct journal journal = { .fd = -1 };
+static int resuming;
+
+/* a temporary in the current directory a crash would leave behind */
+static void journal_tmp(const char *tmpname)
+{
+	journal_put(&journal, "tmp %s%s%s\n", dirpath, dirpath[0] ? "/" : "",
+			tmpname);
+}
+
+/* --io=uring: base files are read with many reads in flight, and each
+ * output is written by one linked openat/write/[fsync]/close[/renameat]
+ * chain on a fixed file slot, so the files of a directory are written
+ * concurrently.  popdir() waits for the ring before applying metadata.
+ * Files above the memory budget take the synchronous path. */
+#define UREAD (~0ULL)
+#define URCHUNK (1 << 20)
+#define UWCHUNK (1 << 30)
+
+struct ujob {
+	int left, err, dirfd, replace;
+	char *name;
+	char tmp[64];
+	u_char *buf;
+	off_t size;
+};
+
+static int use_uring;
+static unsigned queue_depth = 64;
+static struct uring ring = { .fd = -1 };
+static struct ujob *ujobs;
+static int *freeslots, nfree;
+static size_t uring_bytes, uring_budget = 64 << 20;
+static int uring_errors, ureads, ureaderr;
+static off_t ureaddone;
+
+static void ujob_finish(int slot)
+{
+	struct ujob *j = &ujobs[slot];
+	int fd = -1;
+	struct io_uring_files_update up = { 0, 0, (uintptr_t)&fd };
+
+	if(j->err) {
+		fprintf(stderr, "%s: %s\n", j->name, strerror(j->err));
+		/* the chain stopped before close, free the slot */
+		up.offset = slot;
+		syscall(__NR_io_uring_register, ring.fd,
+				IORING_REGISTER_FILES_UPDATE, &up, 1);
+		if(j->replace)
+			unlinkat(j->dirfd, j->tmp, 0);
+		uring_errors++;
+	} else
+		STATS_ADD(bytes_written, j->size);
+	free(j->buf);
+	free(j->name);
+	uring_bytes -= j->size;
+	freeslots[nfree++] = slot;
+}
+
+static void uring_done(struct io_uring_cqe *cqe)
+{
+	struct ujob *j;
+
+	if(cqe->user_data == UREAD) {
+		if(cqe->res < 0)
+			ureaderr = -cqe->res;
+		else
+			ureaddone += cqe->res;
+		ureads--;
+		return;
+	}
+	j = &ujobs[cqe->user_data];
+	if(cqe->res < 0 && !j->err)
+		j->err = -cqe->res;
+	if(--j->left == 0)
+		ujob_finish(cqe->user_data);
+}
+
+static int uring_setup(void)
+{
+	unsigned i;
+
+	if(uring_init(&ring, queue_depth, queue_depth) != 0)
+		return -1;
+	ring.complete = uring_done;
+	ujobs = calloc(queue_depth, sizeof(*ujobs));
+	freeslots = malloc(queue_depth * sizeof(*freeslots));
+	if(!ujobs || !freeslots)
+		return -1;
+	for(i = 0; i < queue_depth; i++)
+		freeslots[nfree++] = queue_depth - 1 - i;
+	return 0;
+}
+
+/* read all of fd into memory with up to a ring's worth of reads queued */
+static u_char *uring_readfile(int fd, off_t size)
+{
+	struct io_uring_sqe *sqe;
+	u_char *buf;
+	off_t off;
+
+	if((buf = malloc(size ? size : 1)) == NULL)
+		return NULL;
+	ureaddone = ureaderr = 0;
+	for(off = 0; off < size; off += sqe->len) {
+		uring_reserve(&ring, 1);
+		sqe = uring_sqe(&ring);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)(buf + off);
+		sqe->len = size - off < URCHUNK ? size - off : URCHUNK;
+		sqe->off = off;
+		sqe->user_data = UREAD;
+		ureads++;
+	}
+	while(ureads)
+		uring_submit(&ring, 1);
+	if(ureaderr || ureaddone != size) {
+		errno = ureaderr ? ureaderr : EIO;
+		free(buf);
+		return NULL;
+	}
+	STATS_ADD(bytes_read, size);
+	return buf;
+}
+
+/* Queue buf as dirfd/name, through a temporary renamed over name when
+ * replace is set.  buf is freed once the chain completes. */
+static void uring_writefile(int dirfd, const char *name, u_char *buf,
+		off_t size, int replace)
+{
+	static unsigned int seq;
+	struct io_uring_sqe *sqe;
+	struct ujob *j;
+	off_t off;
+	int slot, nw = (size + UWCHUNK - 1) / UWCHUNK;
+
+	while(!nfree || (uring_bytes && uring_bytes + size > uring_budget))
+		uring_submit(&ring, 1);
+	slot = freeslots[--nfree];
+	j = &ujobs[slot];
+	memset(j, 0, sizeof(*j));
+	j->dirfd = dirfd;
+	j->replace = replace;
+	j->name = strdup(name);
+	j->buf = buf;
+	j->size = size;
+	snprintf(j->tmp, sizeof(j->tmp), ".fspatch.%d.u%u", getpid(), seq++);
+	if(replace)
+		journal_tmp(j->tmp);
+	uring_bytes += size;
+	uring_reserve(&ring, nw + 4);
+
+	sqe = uring_sqe(&ring);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)(replace ? j->tmp : j->name);
+	sqe->open_flags = O_WRONLY|O_CREAT|(replace ? O_EXCL : O_TRUNC);
+	sqe->len = 0600;
+	sqe->file_index = slot + 1;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = slot;
+	j->left++;
+	for(off = 0; off < size; off += sqe->len) {
+		sqe = uring_sqe(&ring);
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = slot;
+		sqe->flags = IOSQE_FIXED_FILE|IOSQE_IO_LINK;
+		sqe->addr = (uintptr_t)(buf + off);
+		sqe->len = size - off < UWCHUNK ? size - off : UWCHUNK;
+		sqe->off = off;
+		sqe->user_data = slot;
+		j->left++;
+	}
+	if(durability == SYNC_FILE) {
+		sqe = uring_sqe(&ring);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = slot;
+		sqe->flags = IOSQE_FIXED_FILE|IOSQE_IO_LINK;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqe->user_data = slot;
+		j->left++;
+	}
+	sqe = uring_sqe(&ring);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = slot + 1;
+	sqe->flags = replace ? IOSQE_IO_LINK : 0;
+	sqe->user_data = slot;
+	j->left++;
+	if(replace) {
+		sqe = uring_sqe(&ring);
+		sqe->opcode = IORING_OP_RENAMEAT;
+		sqe->fd = dirfd;
+		sqe->addr = (uintptr_t)j->tmp;
+		sqe->len = dirfd;
+		sqe->addr2 = (uintptr_t)j->name;
+		sqe->user_data = slot;
+		j->left++;
+	}
+	uring_submit(&ring, 0);
+}
+
+static void sync_fd(int fd, int data)
+{
+	struct stats_timer tm;
+
+	if(durability != SYNC_FILE)
+		return;
+	stats_start(&tm);
+	if((data ? fdatasync(fd) : fsync(fd)) == -1)
+		perror("fsync");
+	stats_stop(&tm, ST_SYNC);
+}
+
+static void popdir(void)
+{
+	struct level *l = &levels[--nlevels];
+	struct stats_timer tm;
+	size_t i;
+
+	if(use_uring)
+		uring_drain(&ring);
+	stats_start(&tm);
+	for(i = l->nmeta; i < nmetas; i++)
+		set_meta(l->fd, &metas[i]);
+	if(l->nmeta < nmetas)
+		metanameslen = metas[l->nmeta].name;
+	nmetas = l->nmeta;
+	stats_stop(&tm, ST_META);
+	sync_fd(l->fd, 0);
+	close(l->fd);
+	if(nlevels)
+		dirpath[levels[nlevels-1].len] = 0;
+}
+
+/* Make the directory dir (len bytes, relative to the root) the top level
+ * and return its fd, or -1 */
+static int enterdir(const char *dir, size_t len)
+{
+	const char *p, *e, *end = dir + len;
+	size_t l;
+	int fd;
+
+	for(;;) {
+		l = levels[nlevels-1].len;
+		if(nlevels == 1 || (l <= len && !memcmp(dirpath, dir, l) &&
+				(l == len || dir[l] == '/')))
+			break;
+		popdir();
+	}
+	for(p = dir + l; p < end; p = e) {
+		if(*p == '/') {
+			e = p + 1;
+			continue;
+		}
+		if((e = memchr(p, '/', end - p)) == NULL)
+			e = end;
+		l = levels[nlevels-1].len;
+		dirpath = grow(dirpath, &dirpathcap, l + 1 + (e - p) + 1);
+		if(l)
+			dirpath[l++] = '/';
+		memcpy(dirpath + l, p, e - p);
+		dirpath[l + (e - p)] = 0;
+		fd = openat(levels[nlevels-1].fd, dirpath + l,
+				O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+		if(fd < 0) {
+			dirpath[levels[nlevels-1].len] = 0;
 			return -1;
 		}
+		pushdir(fd, l + (e - p));
+	}
+	return levels[nlevels-1].fd;
+}
 
-	/* change access/modification time */
-	if (!TH_ISSYM(t) && utime(filename, &ut) == -1)
-	{
-#ifdef DEBUG
-		perror("utime()");
-#endif
-		return -1;
+/* Split an archive name into the fd of its parent directory and the
+ * last component, trailing slashes are dropped from name */
+static int lookup(char *name, char **file)
+{
+	char *slash;
+	size_t len = strlen(name);
+
+	while(len > 1 && name[len-1] == '/')
+		name[--len] = 0;
+	if((slash = strrchr(name, '/')) == NULL) {
+		*file = name;
+		return enterdir(name, 0);
 	}
+	*file = slash + 1;
+	return enterdir(name, slash - name);
+}
 
-	/* change permissions */
-	if (!TH_ISSYM(t) && chmod(filename, mode) == -1)
-	{
-#ifdef DEBUG
-		perror("chmod()");
-#endif
+/* Checksum manifest written by fsdiff as the first archive entry, see
+ * sum_entry() there.  Looked up by path when files are written. */
+struct sum {
+	const char *path;
+	off_t presize, postsize;
+	uint32_t precrc, postcrc;
+	int verb;
+};
+
+static struct sum *sumv;
+static size_t nsums, *sumhash, sumhashsize;
+static int noverify;
+
+static size_t sum_hashstr(const char *s)
+{
+	size_t h = 2166136261u;
+
+	while(*s)
+		h = (h ^ (unsigned char)*s++) * 16777619;
+	return h;
+}
+
+static struct sum *sum_find(const char *path)
+{
+	size_t h, i;
+
+	if(!sumhashsize)
+		return NULL;
+	h = sum_hashstr(path) & (sumhashsize - 1);
+	for(; (i = sumhash[h]) != 0; h = (h + 1) & (sumhashsize - 1))
+		if(!strcmp(sumv[i-1].path, path))
+			return &sumv[i-1];
+	return NULL;
+}
+
+static int read_sums(TAR *t)
+{
+	size_t size, i, h, n = 0;
+	char *buf, *p;
+	unsigned long long presize, postsize;
+	unsigned int precrc, postcrc;
+	char verb;
+	int len;
+
+	size = th_get_size(t);
+	if((buf = malloc(size + T_BLOCKSIZE + 1)) == NULL)
 		return -1;
+	for(i = 0; i < size; i += T_BLOCKSIZE)
+		if(tar_block_read(t, buf + i) != T_BLOCKSIZE)
+			return -1;
+	buf[size] = 0;
+
+	for(p = buf; p < buf + size; p += strlen(p) + 1)
+		n++;
+	sumv = calloc(n, sizeof(*sumv));
+	for(sumhashsize = 16; sumhashsize < 2 * n; sumhashsize *= 2)
+		;
+	sumhash = calloc(sumhashsize, sizeof(*sumhash));
+	if(!sumv || !sumhash)
+		return -1;
+	for(p = buf; p < buf + size; p += strlen(p) + 1) {
+		if(sscanf(p, "%c %llx %x %llx %x %n", &verb, &presize, &precrc,
+				&postsize, &postcrc, &len) != 5) {
+			fprintf(stderr, "bad checksum record '%s'\n", p);
+			continue;
+		}
+		sumv[nsums].path = p + len;
+		sumv[nsums].verb = verb;
+		sumv[nsums].presize = presize;
+		sumv[nsums].precrc = precrc;
+		sumv[nsums].postsize = postsize;
+		sumv[nsums].postcrc = postcrc;
+		h = sum_hashstr(p + len) & (sumhashsize - 1);
+		while(sumhash[h])
+			h = (h + 1) & (sumhashsize - 1);
+		sumhash[h] = ++nsums;
 	}
+	return 0;
+}
+
+static int is_sums(TAR *t)
+{
+	char *name = th_get_pathname(t);
+	int ret = !strcmp(name, "sums");
+
+	free(name);
+	return ret;
+}
 
+static int check_file(int fd, const char *path, off_t size, uint32_t crc)
+{
+	off_t len;
+	uint32_t c;
+	struct stats_timer tm;
+
+	stats_start(&tm);
+	if(crc32c_fd(fd, &len, &c) != 0) {
+		perror(path);
+		return -1;
+	}
+	STATS_ADD(bytes_read, len);
+	stats_stop(&tm, ST_SUM);
+	if(len != size || c != crc) {
+		fprintf(stderr, "%s: checksum mismatch\n", path);
+		return -1;
+	}
 	return 0;
 }
 
+/* When resuming, the sums whose file a previous run already patched,
+ * set by the preflight workers */
+static char *patched;
+
+/* a base file when resuming, which may also hold its result */
+static int check_base(int fd, size_t i)
+{
+	off_t len;
+	uint32_t c;
+
+	if(!resuming)
+		return check_file(fd, sumv[i].path, sumv[i].presize, sumv[i].precrc);
+	if(crc32c_fd(fd, &len, &c) != 0) {
+		perror(sumv[i].path);
+		return -1;
+	}
+	STATS_ADD(bytes_read, len);
+	if(len == sumv[i].presize && c == sumv[i].precrc)
+		return 0;
+	if(len == sumv[i].postsize && c == sumv[i].postcrc) {
+		patched[i] = 1;
+		return 0;
+	}
+	fprintf(stderr, "%s: checksum mismatch\n", sumv[i].path);
+	return -1;
+}
+
+/* Check every base file in the manifest before anything is written.
+ * Sizes are compared first, which rejects most wrong trees at once, then
+ * the CRCs are split over jobs forked workers.  Returns the number of
+ * bad files. */
+static int preflight(int rootfd, int jobs)
+{
+	struct stat sb;
+	size_t i;
+	int k, fd, status, bad = 0;
+	pid_t pid;
+
+	if(resuming && (patched = mmap(NULL, nsums + 1, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	for(i = 0; i < nsums; i++) {
+		if(sumv[i].verb != 'd')
+			continue;
+		if(fstatat(rootfd, sumv[i].path, &sb, AT_SYMLINK_NOFOLLOW) == -1 ||
+				!S_ISREG(sb.st_mode) || (sb.st_size != sumv[i].presize &&
+				(!resuming || sb.st_size != sumv[i].postsize))) {
+			fprintf(stderr, "%s: base file does not match\n", sumv[i].path);
+			bad++;
+		}
+	}
+	if(bad)
+		return bad;
+
+	for(k = 0; k < jobs; k++) {
+		if((pid = fork()) == -1) {
+			perror("fork");
+			bad++;
+			break;
+		}
+		if(pid)
+			continue;
+		for(i = k; i < nsums; i += jobs) {
+			if(sumv[i].verb != 'd')
+				continue;
+			fd = openat(rootfd, sumv[i].path, O_RDONLY|O_NOFOLLOW);
+			if(fd < 0 || check_base(fd, i) != 0)
+				bad++;
+			if(fd >= 0)
+				close(fd);
+		}
+		exit(bad ? EXIT_FAILURE : 0);
+	}
+	while(wait(&status) > 0)
+		if(!WIFEXITED(status) || WEXITSTATUS(status))
+			bad++;
+	return bad;
+}
+
 /* bspatch */
 static off_t offtin(const u_char *buf)
 {
@@ -120,24 +655,28 @@ static off_t offtin(const u_char *buf)
 	return y;
 }
 
-static int bspatch(const char *oldfile, const char *newfile, int patch)
+/* With newfd < 0 the result is built in memory and returned through
+ * out and outsize for the caller to write */
+static int bspatch(int oldfd, int newfd, int patch, const struct sum *sum,
+		u_char **out, off_t *outsize)
 {
 	u_char header[32];
 	u_char *old, *new;
 	ssize_t oldsize, newsize;
-	ssize_t ctrlsize, diffsize, nctrl;
+	ssize_t ctrlsize, nctrl;
 	off_t oldpos, newpos;
 	off_t *ctrl;
 	off_t i, j;
-	int fd, ret;
+	int ret;
+	struct stats_timer tm;
 
+	stats_start(&tm);
 	ret = xread(patch, header, sizeof(header));
 
 	if (memcmp(header, "BSDIFFXX", 8) != 0)
 		return 1;
 
 	ctrlsize = offtin(header + 8);
-	diffsize = offtin(header + 16);
 	newsize = offtin(header + 24);
 
 	ctrl = malloc(ctrlsize);
@@ -146,17 +685,23 @@ static int bspatch(const char *oldfile, const char *newfile, int patch)
 	for(i=0;i<nctrl;i++)
 		ctrl[i] = offtin((u_char*)&ctrl[i]);
 
-	fd = open(oldfile, O_RDONLY);
-	oldsize = lseek(fd, 0, SEEK_END);
-	old = mmap(NULL, oldsize, PROT_READ, MAP_SHARED, fd, 0);
-	close(fd);
+	oldsize = lseek(oldfd, 0, SEEK_END);
+	if(use_uring && (old = uring_readfile(oldfd, oldsize)) == NULL) {
+		perror("read");
+		free(ctrl);
+		return 1;
+	}
+	if(!use_uring)
+		old = mmap(NULL, oldsize, PROT_READ, MAP_SHARED, oldfd, 0);
 
-	fd = open(newfile, O_CREAT|O_RDWR, 0666);
-	ret = ftruncate(fd, newsize);
-	new = mmap(NULL, newsize, PROT_WRITE, MAP_SHARED, fd, 0);
-	if (new == MAP_FAILED)
+	if(newfd < 0) {
+		new = malloc(newsize ? newsize : 1);
+	} else {
+		ret = ftruncate(newfd, newsize);
+		new = mmap(NULL, newsize, PROT_WRITE, MAP_SHARED, newfd, 0);
+	}
+	if (new == MAP_FAILED || new == NULL)
 		perror("mmap");
-	close(fd);
 
 	oldpos=0;newpos=0;
 	for(j=0;j<nctrl;j+=3) {
@@ -187,54 +732,685 @@ static int bspatch(const char *oldfile, const char *newfile, int patch)
 
 	//while(newpos<newsize) check me!
 
+	ret = 0;
+	if(sum && (newsize != sum->postsize ||
+			crc32c(0, new, newsize) != sum->postcrc)) {
+		fprintf(stderr, "%s: checksum mismatch after patching\n", sum->path);
+		ret = 2;
+	}
+
 	free(ctrl);
-	munmap(old, oldsize);
-	munmap(new, newsize);
+	if(use_uring)
+		free(old);
+	else {
+		munmap(old, oldsize);
+		STATS_ADD(bytes_read, oldsize);
+	}
+	if(newfd < 0) {
+		*out = new;
+		*outsize = newsize;
+	} else {
+		munmap(new, newsize);
+		STATS_ADD(bytes_written, newsize);
+	}
+	stats_stop(&tm, ST_APPLY);
+	return ret;
+}
+
+/* In-place apply.  Each ctrl tuple copies x bytes of old at oldpos (plus
+ * the diff bytes) to newpos; applied onto the old file itself a copy may
+ * only run once every copy reading the range it overwrites has read it.
+ * Copies are ordered topologically over that relation, and when only
+ * cycles remain the smallest pending copy has its old bytes saved in
+ * memory, which takes it out of the cycle.  Extra bytes read nothing and go last.
+ * New tuples are sorted by newpos, so the copies overwriting a read range
+ * are a contiguous run found by binary search. */
+struct ipop {
+	off_t newpos, oldpos, len;
+	off_t lo, hi;		/* clamped old range read */
+	size_t first, last;	/* ops whose output overlaps [lo,hi) */
+	const u_char *diff;
+	u_char *saved;
+	int indeg, done;
+};
+
+static size_t ipop_find(struct ipop *op, size_t n, off_t pos)
+{
+	size_t l = 0, h = n;
+
+	/* first op whose output ends after pos */
+	while(l < h) {
+		size_t m = (l + h) / 2;
+		if(op[m].newpos + op[m].len <= pos)
+			l = m + 1;
+		else
+			h = m;
+	}
+	return l;
+}
+
+static void ipop_run(struct ipop *o, u_char *map)
+{
+	off_t i, p;
+	u_char v;
+
+	if(o->saved || o->newpos <= o->oldpos) {
+		for(i = 0; i < o->len; i++) {
+			p = o->oldpos + i;
+			v = o->diff[i];
+			if(p >= o->lo && p < o->hi)
+				v += o->saved ? o->saved[p - o->lo] : map[p];
+			if(map[o->newpos + i] != v)
+				map[o->newpos + i] = v;
+		}
+	} else {
+		for(i = o->len - 1; i >= 0; i--) {
+			p = o->oldpos + i;
+			v = o->diff[i];
+			if(p >= o->lo && p < o->hi)
+				v += map[p];
+			if(map[o->newpos + i] != v)
+				map[o->newpos + i] = v;
+		}
+	}
+}
+
+static struct ipop *ipop_sort;
+
+static int ipop_cmp(const void *a, const void *b)
+{
+	const struct ipop *x = &ipop_sort[*(size_t *)a], *y = &ipop_sort[*(size_t *)b];
+	off_t d = (x->hi - x->lo) - (y->hi - y->lo);
+
+	return d < 0 ? -1 : d > 0;
+}
+
+static void ipop_release(struct ipop *op, size_t k, size_t *queue, size_t *nq)
+{
+	size_t j;
+
+	for(j = op[k].first; j < op[k].last; j++)
+		if(j != k && --op[j].indeg == 0 && !op[j].done)
+			queue[(*nq)++] = j;
+}
+
+static int bspatch_inplace(int fd, const u_char *patch, size_t patchsize,
+		const struct sum *sum)
+{
+	ssize_t oldsize, newsize, mapsize;
+	off_t ctrlsize, diffsize, nctrl, newpos, oldpos, dpos, epos, saved = 0;
+	const u_char *diff, *extra;
+	struct ipop *op;
+	size_t nop = 0, nq = 0, ndone = 0, k, j, cursor = 0, *queue, *order;
+	u_char *map;
+	struct stats_timer tm;
+	int ret = 0;
+
+	stats_start(&tm);
+	if(patchsize < 32 || memcmp(patch, "BSDIFFXX", 8) != 0)
+		return 1;
+	ctrlsize = offtin(patch + 8);
+	diffsize = offtin(patch + 16);
+	newsize = offtin(patch + 24);
+	if(ctrlsize < 0 || diffsize < 0 || newsize < 0 ||
+			32 + ctrlsize + diffsize > patchsize)
+		return 1;
+	nctrl = ctrlsize / 24;
+	diff = patch + 32 + ctrlsize;
+	extra = diff + diffsize;
+
+	oldsize = lseek(fd, 0, SEEK_END);
+	mapsize = newsize > oldsize ? newsize : oldsize;
+	if(mapsize == 0)
+		return ftruncate(fd, 0);
+	op = calloc(nctrl + 1, sizeof(*op));
+	queue = malloc((nctrl + 1) * sizeof(*queue));
+	order = malloc((nctrl + 1) * sizeof(*order));
+	if(!op || !queue || !order) {
+		free(op);
+		free(queue);
+		free(order);
+		return 1;
+	}
+
+	/* collect the copies, checking the tuples against the sizes */
+	newpos = oldpos = dpos = epos = 0;
+	for(k = 0; k < nctrl; k++) {
+		off_t x = offtin(patch + 32 + 24 * k);
+		off_t y = offtin(patch + 32 + 24 * k + 8);
+		off_t z = offtin(patch + 32 + 24 * k + 16);
+		if(x < 0 || y < 0 || newpos + x + y > newsize ||
+				dpos + x > diffsize || epos + y > patchsize - 32 - ctrlsize - diffsize) {
+			free(op);
+			free(queue);
+			free(order);
+			return 1;
+		}
+		if(x) {
+			op[nop].newpos = newpos;
+			op[nop].oldpos = oldpos;
+			op[nop].len = x;
+			op[nop].lo = oldpos < 0 ? 0 : oldpos;
+			op[nop].hi = oldpos + x > oldsize ? oldsize : oldpos + x;
+			op[nop].diff = diff + dpos;
+			nop++;
+		}
+		dpos += x;
+		epos += y;
+		newpos += x + y;
+		oldpos += x + z;
+	}
+
+	/* edges: op k reads what ops [first,last) write */
+	for(k = 0; k < nop; k++) {
+		if(op[k].lo >= op[k].hi)
+			continue;
+		op[k].first = ipop_find(op, nop, op[k].lo);
+		for(j = op[k].first; j < nop && op[j].newpos < op[k].hi; j++)
+			if(j != k)
+				op[j].indeg++;
+		op[k].last = j;
+	}
+	for(k = 0; k < nop; k++) {
+		if(op[k].indeg == 0)
+			queue[nq++] = k;
+		order[k] = k;
+	}
+	ipop_sort = op;
+	qsort(order, nop, sizeof(*order), ipop_cmp);
+
+	if(ftruncate(fd, mapsize) != 0) {
+		perror("ftruncate");
+		free(op);
+		free(queue);
+		free(order);
+		return 1;
+	}
+	map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		perror("mmap");
+		free(op);
+		free(queue);
+		free(order);
+		return 1;
+	}
+
+	while(ndone < nop) {
+		if(nq == 0) {
+			/* only cycles left, save the next pending copy's input */
+			while(op[order[cursor]].done || op[order[cursor]].saved)
+				cursor++;
+			k = order[cursor];
+			op[k].saved = malloc(op[k].hi - op[k].lo + 1);
+			if(!op[k].saved) {
+				perror("malloc");
+				ret = 1;
+				break;
+			}
+			memcpy(op[k].saved, map + op[k].lo, op[k].hi - op[k].lo);
+			saved += op[k].hi - op[k].lo;
+			ipop_release(op, k, queue, &nq);
+			if(op[k].indeg == 0)
+				queue[nq++] = k;
+			continue;
+		}
+		k = queue[--nq];
+		if(op[k].done)
+			continue;
+		ipop_run(&op[k], map);
+		op[k].done = 1;
+		ndone++;
+		if(!op[k].saved)
+			ipop_release(op, k, queue, &nq);
+		free(op[k].saved);
+	}
+
+	/* extra strings */
+	newpos = dpos = epos = 0;
+	for(k = 0; ret == 0 && k < nctrl; k++) {
+		off_t x = offtin(patch + 32 + 24 * k);
+		off_t y = offtin(patch + 32 + 24 * k + 8);
+		memcpy(map + newpos + x, extra + epos, y);
+		epos += y;
+		newpos += x + y;
+	}
+
+	if(ret == 0 && sum && (newsize != sum->postsize ||
+			crc32c(0, map, newsize) != sum->postcrc)) {
+		fprintf(stderr, "%s: checksum mismatch after patching\n", sum->path);
+		ret = 2;
+	}
+	STATS_ADD(cycle_bytes, saved);
+	munmap(map, mapsize);
+	if(ret == 0 && ftruncate(fd, newsize) != 0)
+		ret = 1;
+	free(op);
+	free(queue);
+	free(order);
+	STATS_ADD(bytes_read, patchsize);
+	STATS_ADD(bytes_written, newsize);
+	stats_stop(&tm, ST_APPLY);
+	return ret;
+}
+
+/* move len bytes of archive payload into out, splicing from a pipe or
+ * copying in-kernel from a regular file, with a read/write fallback */
+static off_t copy_fd(int in, int out, off_t len)
+{
+	ssize_t ret;
+	off_t done = 0;
+	int mode = 0;
+	char buf[65536];
+
+	while(done < len) {
+		size_t count = len - done;
+		if(mode == 0) {
+			ret = splice(in, NULL, out, NULL, count, SPLICE_F_MOVE);
+			if(ret < 0 && errno != EINTR) {
+				mode = 1;
+				continue;
+			}
+		} else if(mode == 1) {
+			ret = copy_file_range(in, NULL, out, NULL, count, 0);
+			if(ret < 0 && errno != EINTR) {
+				mode = 2;
+				continue;
+			}
+		} else {
+			if(count > sizeof(buf))
+				count = sizeof(buf);
+			ret = read(in, buf, count);
+			if(ret > 0 && xwrite(out, buf, ret) != ret)
+				return -1;
+		}
+		if(ret == -1 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -1;
+		if(ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+/* read and drop len bytes of archive payload */
+static int skip_payload(off_t len)
+{
+	char buf[T_BLOCKSIZE];
+	off_t n;
+
+	for(; len > 0; len -= n) {
+		n = len < T_BLOCKSIZE ? len : T_BLOCKSIZE;
+		if(xread(tar_fd(t), buf, n) != n)
+			return -1;
+	}
 	return 0;
 }
 
-static int do_add(const char* name)
+/* zero a range, as a hole where the file system can punch one */
+static int punch_hole(int fd, off_t off, off_t len)
 {
-	char realname[PATH_MAX];
-	sprintf(realname, "%s/%s", base, name);
-	fprintf(stderr, "adding %s\n", realname);
-	tar_extract_file(t, realname);
+	static const char zero[65536];
+	ssize_t ret;
+
+	if(fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off, len) == 0)
+		return 0;
+	for(; len > 0; off += ret, len -= ret) {
+		ret = pwrite(fd, zero, len < sizeof(zero) ? len : sizeof(zero), off);
+		if(ret == -1 && errno == EINTR)
+			ret = 0;
+		else if(ret <= 0)
+			return -1;
+	}
+	return 0;
 }
 
-static int do_delete(const char* name)
+/* copy the data extents of in to out, holes are left unwritten */
+static int copy_sparse(int in, int out)
 {
-	int ret;
-	char realname[PATH_MAX];
-	sprintf(realname, "%s/%s", base, name);
-	fprintf(stderr, "deleting %s\n", realname);
-	if(TH_ISDIR(t)) {
-		ret = rmdir(realname);
+	struct stat sb;
+	off_t pos, s, e;
+	loff_t ri, wo;
+	ssize_t ret;
+	char buf[65536];
+
+	if(fstat(in, &sb) != 0 || ftruncate(out, sb.st_size) != 0)
+		return -1;
+	for(pos = 0; next_extent(in, pos, sb.st_size, &s, &e) == 0; pos = e) {
+		for(; s < e; s += ret) {
+			ri = wo = s;
+			ret = copy_file_range(in, &ri, out, &wo, e - s, 0);
+			if(ret < 0 && errno != EINTR) {
+				ret = pread(in, buf, e - s < sizeof(buf) ? e - s : sizeof(buf), s);
+				if(ret > 0 && pwrite(out, buf, ret, s) != ret)
+					return -1;
+			}
+			if(ret == -1 && errno == EINTR)
+				ret = 0;
+			else if(ret <= 0)
+				return -1;
+		}
+		STATS_ADD(bytes_read, e - pos);
+	}
+	return 0;
+}
+
+/* Apply the extent payload of the current entry (see sparse.c) onto fd,
+ * which holds the base contents.  The whole payload is always consumed
+ * unless the archive itself can't be read. */
+static int apply_sparse(int fd, const char *name)
+{
+	u_char hdr[SPARSE_HEADER], *rec = NULL;
+	off_t size, pad, done = 0, n, i, off, len;
+	struct stats_timer tm;
+
+	stats_start(&tm);
+	size = th_get_size(t);
+	pad = (T_BLOCKSIZE - size % T_BLOCKSIZE) % T_BLOCKSIZE;
+	if(size < SPARSE_HEADER)
+		goto corrupt;
+	if(xread(tar_fd(t), hdr, SPARSE_HEADER) != SPARSE_HEADER)
+		return -1;
+	done = SPARSE_HEADER;
+	n = offtin(hdr + 16);
+	if(memcmp(hdr, SPARSE_MAGIC, 8) || n < 0 || n > (size - done) / 16)
+		goto corrupt;
+	if((rec = malloc(16 * n + 1)) == NULL ||
+			xread(tar_fd(t), rec, 16 * n) != 16 * n) {
+		perror(name);
+		free(rec);
+		return -1;
+	}
+	done += 16 * n;
+	if(ftruncate(fd, offtin(hdr + 8)) != 0) {
+		perror(name);
+		goto fail;
+	}
+	for(i = 0; i < n; i++) {
+		off = offtin(rec + 16 * i);
+		len = offtin(rec + 16 * i + 8);
+		if(len > 0) {
+			if(len > size - done)
+				goto corrupt;
+			if(lseek(fd, off, SEEK_SET) < 0 ||
+					copy_fd(tar_fd(t), fd, len) != len) {
+				perror(name);
+				free(rec);
+				return -1;
+			}
+			done += len;
+			STATS_ADD(bytes_written, len);
+		} else if(len < 0 && punch_hole(fd, off, -len) != 0) {
+			perror(name);
+			goto fail;
+		}
+	}
+	free(rec);
+	STATS_ADD(bytes_read, size + pad);
+	stats_stop(&tm, ST_APPLY);
+	return skip_payload(size - done + pad);
+corrupt:
+	fprintf(stderr, "%s: corrupt sparse payload\n", name);
+fail:
+	free(rec);
+	skip_payload(size - done + pad);
+	return -1;
+}
+
+/* tar_extract_regfile replacement built on copy_fd() */
+static int extract_regfile(TAR *t, int dirfd, char *file, const struct sum *sum)
+{
+	int fd;
+	off_t size, pad;
+	char buf[T_BLOCKSIZE];
+
+	size = th_get_size(t);
+	pad = (T_BLOCKSIZE - size % T_BLOCKSIZE) % T_BLOCKSIZE;
+
+	unlinkat(dirfd, file, 0);
+	if(use_uring && size <= uring_budget) {
+		u_char *data = malloc(size + pad + 1);
+		if(!data || xread(tar_fd(t), data, size + pad) != size + pad) {
+			perror("read");
+			free(data);
+			return -1;
+		}
+		STATS_ADD(bytes_read, size + pad);
+		if(sum && (size != sum->postsize ||
+				crc32c(0, data, size) != sum->postcrc)) {
+			fprintf(stderr, "%s: checksum mismatch\n", sum->path);
+			free(data);
+			return -1;
+		}
+		uring_writefile(dirfd, file, data, size, 0);
+		queue_meta(t, file);
+		return 0;
+	}
+	fd = openat(dirfd, file, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if(fd < 0) {
+		perror("open");
+		tar_skip_regfile(t);
+		return -1;
+	}
+	if(copy_fd(tar_fd(t), fd, size) != size) {
+		perror("copy_fd");
+		close(fd);
+		return -1;
+	}
+	if(sum && check_file(fd, sum->path, sum->postsize, sum->postcrc) != 0) {
+		close(fd);
+		unlinkat(dirfd, file, 0);
+		if(pad)
+			xread(tar_fd(t), buf, pad);
+		return -1;
+	}
+	sync_fd(fd, 1);
+	close(fd);
+	STATS_ADD(bytes_read, size);
+	STATS_ADD(bytes_written, size);
+	if(pad && xread(tar_fd(t), buf, pad) != pad)
+		return -1;
+	STATS_ADD(bytes_read, pad);
+	queue_meta(t, file);
+	return 0;
+}
+
+static int do_add(char* name)
+{
+	int ret, dirfd;
+	char *file;
+	struct stats_timer tm;
+	fprintf(stderr, "adding %s/%s\n", base, name);
+	STATS_ADD(added, 1);
+	stats_start(&tm);
+	if((dirfd = lookup(name, &file)) < 0) {
+		perror(name);
+		if(TH_ISREG(t))
+			tar_skip_regfile(t);
+		return -1;
+	}
+	if(TH_ISREG(t)) {
+		ret = extract_regfile(t, dirfd, file, noverify ? NULL : sum_find(name));
+	} else if(TH_ISDIR(t)) {
+		ret = mkdirat(dirfd, file, 0700);
+		if(ret == -1 && errno == EEXIST)
+			ret = 0;
 		if(ret == -1)
-			perror("rmdir");
-	} else {
-		ret = unlink(realname);
+			perror("mkdirat");
+		else
+			queue_meta(t, file);
+	} else if(TH_ISSYM(t)) {
+		unlinkat(dirfd, file, 0);
+		ret = symlinkat(th_get_linkname(t), dirfd, file);
+		if(ret == -1)
+			perror("symlinkat");
+		else
+			queue_meta(t, file);
+	} else if(TH_ISLNK(t)) {
+		/* the target, relative to the tree, was written by an earlier
+		 * entry which may still be in flight */
+		if(use_uring)
+			uring_drain(&ring);
+		unlinkat(dirfd, file, 0);
+		ret = linkat(levels[0].fd, th_get_linkname(t), dirfd, file, 0);
 		if(ret == -1)
-			perror("unlink");
+			perror("linkat");
+	} else {
+		/* device nodes take libtar's path based route */
+		char realname[PATH_MAX];
+		snprintf(realname, sizeof(realname), "%s/%s", base, name);
+		ret = tar_extract_file(t, realname);
 	}
+	stats_file(name, stats_stop(&tm, ST_ARCHIVE));
+	return ret;
 }
 
-static int do_patch(const char* name)
+static int do_delete(char* name)
 {
-	int ret;
-	size_t size;
-	int pipefd[2];
-	char realname[PATH_MAX];
-	char tmpname[PATH_MAX];
-	sprintf(realname, "%s/%s", base, name);
-	sprintf(tmpname, "%s/%sXXXXXX", base, name);
-	fprintf(stderr, "patching %s\n", realname);
+	int ret, dirfd;
+	char *file;
+	fprintf(stderr, "deleting %s/%s\n", base, name);
+	STATS_ADD(deleted, 1);
+	if((dirfd = lookup(name, &file)) < 0)
+		ret = -1;
+	else if(TH_ISDIR(t))
+		ret = unlinkat(dirfd, file, AT_REMOVEDIR);
+	else
+		ret = unlinkat(dirfd, file, 0);
+	/* a resumed run may have done it before */
+	if(ret == -1 && resuming && errno == ENOENT)
+		ret = 0;
+	if(ret == -1)
+		perror(name);
+	return ret;
+}
 
-	ret = pipe(pipefd);
-	if(fork()) {
-		close(pipefd[1]);
-		ret = bspatch(realname, tmpname, pipefd[0]);
-		wait(NULL);
-	} else {
+/* "sparse/": an added sparse file rebuilt from its extents */
+static int do_sparse(char *name)
+{
+	int ret, dirfd, fd;
+	char *file;
+	const struct sum *sum = noverify ? NULL : sum_find(name);
+	struct stats_timer tm;
+	fprintf(stderr, "adding %s/%s\n", base, name);
+	STATS_ADD(added, 1);
+	stats_start(&tm);
+	if((dirfd = lookup(name, &file)) < 0) {
+		perror(name);
+		tar_skip_regfile(t);
+		return -1;
+	}
+	unlinkat(dirfd, file, 0);
+	if((fd = openat(dirfd, file, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0) {
+		perror("open");
+		tar_skip_regfile(t);
+		return -1;
+	}
+	ret = apply_sparse(fd, name);
+	if(ret == 0 && sum)
+		ret = check_file(fd, sum->path, sum->postsize, sum->postcrc);
+	if(ret == 0) {
+		sync_fd(fd, 1);
+		queue_meta(t, file);
+	} else
+		unlinkat(dirfd, file, 0);
+	close(fd);
+	stats_file(name, stats_stop(&tm, ST_ARCHIVE));
+	return ret;
+}
+
+/* "copy/": contents written earlier to another path of the tree, named
+ * by the link target, are cloned where the file system can share extents
+ * and copied otherwise */
+static int do_copy(char *name)
+{
+	int ret, dirfd, in, fd;
+	char *file;
+	const struct sum *sum = noverify ? NULL : sum_find(name);
+	struct stats_timer tm;
+	fprintf(stderr, "copying %s/%s\n", base, name);
+	STATS_ADD(deduped, 1);
+	stats_start(&tm);
+	if(use_uring)
+		uring_drain(&ring);
+	if((dirfd = lookup(name, &file)) < 0) {
+		perror(name);
+		return -1;
+	}
+	if((in = openat(levels[0].fd, th_get_linkname(t), O_RDONLY)) < 0) {
+		perror(th_get_linkname(t));
+		return -1;
+	}
+	unlinkat(dirfd, file, 0);
+	if((fd = openat(dirfd, file, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0) {
+		perror("open");
+		close(in);
+		return -1;
+	}
+	ret = ioctl(fd, FICLONE, in) == 0 ? 0 : copy_sparse(in, fd);
+	close(in);
+	if(ret != 0)
+		perror(name);
+	else if(sum)
+		ret = check_file(fd, sum->path, sum->postsize, sum->postcrc);
+	if(ret == 0) {
+		sync_fd(fd, 1);
+		queue_meta(t, file);
+	} else
+		unlinkat(dirfd, file, 0);
+	close(fd);
+	stats_file(name, stats_stop(&tm, ST_ARCHIVE));
+	return ret;
+}
+
+/* --in-place: the patch is spooled to an unnamed file in the same
+ * directory and applied onto the old file, so only the patch needs free
+ * space.  Hard linked files are patched by copy as usual. */
+static int inplace;
+
+static int patch_inplace(int dirfd, int fd, const struct sum *sum)
+{
+	int spool, ret;
+	off_t size, pad;
+	u_char *p;
+	char buf[T_BLOCKSIZE];
+	FILE *f;
+
+	size = th_get_size(t);
+	pad = (T_BLOCKSIZE - size % T_BLOCKSIZE) % T_BLOCKSIZE;
+	spool = openat(dirfd, ".", O_TMPFILE|O_RDWR, 0600);
+	if(spool < 0 && (f = tmpfile()) != NULL) {
+		spool = dup(fileno(f));
+		fclose(f);
+	}
+	if(spool < 0) {
+		perror("spool");
+		tar_skip_regfile(t);
+		return -1;
+	}
+	if(copy_fd(tar_fd(t), spool, size) != size ||
+			(pad && xread(tar_fd(t), buf, pad) != pad)) {
+		perror("copy_fd");
+		close(spool);
+		return -1;
+	}
+	p = mmap(NULL, size, PROT_READ, MAP_SHARED, spool, 0);
+	close(spool);
+	if(p == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	ret = bspatch_inplace(fd, p, size, sum);
+	munmap(p, size);
+	return ret;
+}
+
+/* feed the tar payload of the current entry into the pipe from a child */
+static pid_t feed_patch(int pipefd[2])
+{
+	pid_t pid = fork();
+	if(pid == 0) {
 		int i;
 		int size = th_get_size(t);
 		char buf[T_BLOCKSIZE];
@@ -247,27 +1423,699 @@ static int do_patch(const char* name)
 					errno = EINVAL;
 				exit(EXIT_FAILURE);
 			}
-			ret = xwrite(pipefd[1], buf, T_BLOCKSIZE);
+			if(xwrite(pipefd[1], buf, T_BLOCKSIZE) != T_BLOCKSIZE)
+				exit(EXIT_FAILURE);
 		}
 		exit(0);
 	}
+	return pid;
+}
+
+/* do_patch() for --io=uring: the result is built in memory and queued
+ * as a write chain ending in the rename over the original */
+static int patch_uring(int dirfd, int oldfd, char *file, char *name,
+		struct stats_timer *tm)
+{
+	int ret, pipefd[2];
+	u_char *buf = NULL;
+	off_t size;
+
+	if(pipe(pipefd) != 0) {
+		perror("pipe");
+		close(oldfd);
+		tar_skip_regfile(t);
+		return -1;
+	}
+	if(feed_patch(pipefd) < 0) {
+		perror("fork");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		close(oldfd);
+		tar_skip_regfile(t);
+		return -1;
+	}
+	close(pipefd[1]);
+	ret = bspatch(oldfd, -1, pipefd[0], noverify ? NULL : sum_find(name),
+			&buf, &size);
+	close(pipefd[0]);
+	wait(NULL);
+	close(oldfd);
+	if(ret == 0) {
+		uring_writefile(dirfd, file, buf, size, 1);
+		queue_meta(t, file);
+	} else
+		free(buf);
+	stats_file(name, stats_stop(tm, ST_DIFF));
+	return ret;
+}
+
+/* The patched file is built next to the original under a temporary name
+ * and renamed over it, so the name always refers to a complete file */
+static int do_patch(char* name)
+{
+	static unsigned int seq;
+	int ret, dirfd, oldfd, newfd;
+	int pipefd[2];
+	char *file;
+	char tmpname[64];
+	struct stats_timer tm;
+	fprintf(stderr, "patching %s/%s\n", base, name);
+	STATS_ADD(changed, 1);
+	stats_start(&tm);
+
+	if((dirfd = lookup(name, &file)) < 0 ||
+			(oldfd = openat(dirfd, file, O_RDONLY)) < 0) {
+		perror(name);
+		tar_skip_regfile(t);
+		return -1;
+	}
+	if(inplace) {
+		struct stat sb;
+		if(fstat(oldfd, &sb) == 0 && sb.st_nlink == 1 &&
+				(newfd = openat(dirfd, file, O_RDWR)) >= 0) {
+			close(oldfd);
+			ret = patch_inplace(dirfd, newfd, noverify ? NULL : sum_find(name));
+			if(ret == 0) {
+				sync_fd(newfd, 1);
+				queue_meta(t, file);
+			} else
+				fprintf(stderr, "%s: in-place patch failed\n", name);
+			close(newfd);
+			stats_file(name, stats_stop(&tm, ST_DIFF));
+			return ret;
+		}
+	}
+	if(use_uring) {
+		struct stat sb;
+		if(fstat(oldfd, &sb) == 0 && sb.st_size <= uring_budget)
+			return patch_uring(dirfd, oldfd, file, name, &tm);
+	}
+	do {
+		snprintf(tmpname, sizeof(tmpname), ".fspatch.%d.%u", getpid(), seq++);
+		journal_tmp(tmpname);
+		newfd = openat(dirfd, tmpname, O_RDWR|O_CREAT|O_EXCL, 0600);
+	} while(newfd < 0 && errno == EEXIST);
+	if(newfd < 0) {
+		perror("openat");
+		close(oldfd);
+		tar_skip_regfile(t);
+		return -1;
+	}
+
+	ret = pipe(pipefd);
+	feed_patch(pipefd);
+	close(pipefd[1]);
+	ret = bspatch(oldfd, newfd, pipefd[0], noverify ? NULL : sum_find(name),
+			NULL, NULL);
+	close(pipefd[0]);
+	wait(NULL);
 	//printf("bspatch returned %d\n", ret);
-	unlink(realname);
-	link(tmpname, realname);
-	unlink(tmpname);
-	tar_set_file_perms(t, realname);
+	close(oldfd);
+	if(ret == 0)
+		sync_fd(newfd, 1);
+	close(newfd);
+	if(ret == 0 && renameat(dirfd, tmpname, dirfd, file) == 0) {
+		queue_meta(t, file);
+	} else {
+		if(ret == 0)
+			perror("renameat");
+		unlinkat(dirfd, tmpname, 0);
+	}
+	stats_file(name, stats_stop(&tm, ST_DIFF));
+	return ret;
 }
 
-static tartype_t type = { open, close, xread, xwrite };
+/* the payload of the current entry, spooled to a file for random access */
+static int spool_payload(int dirfd)
+{
+	off_t size = th_get_size(t), pad;
+	char buf[T_BLOCKSIZE];
+	int spool;
 
-int main(int argc, char **argv)
+	pad = (T_BLOCKSIZE - size % T_BLOCKSIZE) % T_BLOCKSIZE;
+	if((spool = openat(dirfd, ".", O_TMPFILE|O_RDWR, 0600)) < 0)
+		spool = memfd_create("spool", 0);
+	if(spool < 0) {
+		tar_skip_regfile(t);
+		return -1;
+	}
+	if(copy_fd(tar_fd(t), spool, size) != size ||
+			(pad && xread(tar_fd(t), buf, pad) != pad)) {
+		close(spool);
+		return -1;
+	}
+	return spool;
+}
+
+/* bspatch() the rewritten old file in memory with the patch that follows
+ * in spool at off */
+static int patch_rewritten(const u_char *old, off_t oldsize, int spool,
+		off_t off, u_char **new, off_t *newsize)
 {
-	int ret;
+	int fd, ret = -1;
+
+	if((fd = memfd_create("rewritten", 0)) < 0)
+		return -1;
+	if(xwrite(fd, old, oldsize) == oldsize &&
+			lseek(spool, off, SEEK_SET) == off &&
+			bspatch(fd, -1, spool, NULL, new, newsize) == 0)
+		ret = 0;
+	close(fd);
+	return ret;
+}
+
+/* put the patched contents in place of file, checked against the sums */
+static int write_rewritten(int dirfd, char *file, const char *name,
+		const u_char *buf, off_t len, const struct sum *sum)
+{
+	static unsigned int seq;
+	char tmpname[64];
+	int fd;
+
+	if(sum && (len != sum->postsize || crc32c(0, buf, len) != sum->postcrc)) {
+		fprintf(stderr, "%s: checksum mismatch after patching\n", sum->path);
+		return -1;
+	}
+	do {
+		snprintf(tmpname, sizeof(tmpname), ".fspatch.%d.r%u", getpid(), seq++);
+		journal_tmp(tmpname);
+		fd = openat(dirfd, tmpname, O_RDWR|O_CREAT|O_EXCL, 0600);
+	} while(fd < 0 && errno == EEXIST);
+	if(fd < 0 || xwrite(fd, buf, len) != len) {
+		perror(name);
+		if(fd >= 0) {
+			close(fd);
+			unlinkat(dirfd, tmpname, 0);
+		}
+		return -1;
+	}
+	STATS_ADD(bytes_written, len);
+	sync_fd(fd, 1);
+	close(fd);
+	if(renameat(dirfd, tmpname, dirfd, file) != 0) {
+		perror("renameat");
+		unlinkat(dirfd, tmpname, 0);
+		return -1;
+	}
+	queue_meta(t, file);
+	return 0;
+}
+
+/* "zdiff/": the old file is expanded as fsdiff did, patched, and the
+ * streams of the new file recompressed with the recorded parameters */
+static int do_zdiff(char *name)
+{
+	int ret = -1, dirfd, oldfd, spool;
+	char *file;
+	const struct sum *sum = noverify ? NULL : sum_find(name);
+	struct zfile oz, nz, out;
+	u_char hdr[ZDIFF_HEADER], *old = MAP_FAILED, *tab = NULL, *exp = NULL;
+	off_t oldsize = 0, expsize, total;
+	struct stats_timer tm;
+	size_t i;
+	fprintf(stderr, "patching %s/%s\n", base, name);
+	STATS_ADD(changed, 1);
+	stats_start(&tm);
+	memset(&oz, 0, sizeof(oz));
+	memset(&nz, 0, sizeof(nz));
+	memset(&out, 0, sizeof(out));
+
+	if((dirfd = lookup(name, &file)) < 0 ||
+			(oldfd = openat(dirfd, file, O_RDONLY)) < 0) {
+		perror(name);
+		tar_skip_regfile(t);
+		return -1;
+	}
+	if((spool = spool_payload(dirfd)) < 0) {
+		perror(name);
+		close(oldfd);
+		return -1;
+	}
+	if(pread(spool, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			memcmp(hdr, ZDIFF_MAGIC, 8) ||
+			(nz.n = offtin(hdr + 24)) > (size_t)th_get_size(t) / ZDIFF_CHUNK ||
+			(tab = malloc(ZDIFF_CHUNK * nz.n + 1)) == NULL ||
+			(nz.v = calloc(nz.n + 1, sizeof(*nz.v))) == NULL ||
+			pread(spool, tab, ZDIFF_CHUNK * nz.n, ZDIFF_HEADER) !=
+			(ssize_t)(ZDIFF_CHUNK * nz.n)) {
+		fprintf(stderr, "%s: corrupt zdiff\n", name);
+		goto out;
+	}
+	for(i = 0, total = 0; i < nz.n; i++) {
+		nz.v[i].kind = offtin(tab + ZDIFF_CHUNK * i);
+		nz.v[i].len = offtin(tab + ZDIFF_CHUNK * i + 8);
+		nz.v[i].explen = offtin(tab + ZDIFF_CHUNK * i + 16);
+		nz.v[i].param = offtin(tab + ZDIFF_CHUNK * i + 24);
+		total += nz.v[i].explen;
+	}
+
+	/* the expanded old file, which the patch was made against */
+	oldsize = lseek(oldfd, 0, SEEK_END);
+	if(oldsize > 0)
+		old = mmap(NULL, oldsize, PROT_READ, MAP_SHARED, oldfd, 0);
+	if(old == MAP_FAILED) {
+		perror(name);
+		goto out;
+	}
+	STATS_ADD(bytes_read, oldsize);
+	zparse(&oz, old, oldsize);
+	if(oz.expsize != offtin(hdr + 8)) {
+		fprintf(stderr, "%s: old file does not expand as expected\n", name);
+		goto out;
+	}
+	if(patch_rewritten(oz.exp, oz.expsize, spool,
+			ZDIFF_HEADER + ZDIFF_CHUNK * nz.n, &exp, &expsize) != 0 ||
+			expsize != total || zrebuild(&nz, exp, &out) != 0 ||
+			out.expsize != offtin(hdr + 16)) {
+		fprintf(stderr, "%s: recompression failed\n", name);
+		goto out;
+	}
+	ret = write_rewritten(dirfd, file, name, out.exp, out.expsize, sum);
+out:
+	if(old != MAP_FAILED)
+		munmap(old, oldsize);
+	close(spool);
+	close(oldfd);
+	free(tab);
+	free(exp);
+	zfree(&oz);
+	zfree(&nz);
+	zfree(&out);
+	stats_file(name, stats_stop(&tm, ST_DIFF));
+	return ret;
+}
+
+/* "elfdiff/": the old file is rewritten with labels as fsdiff did, the
+ * patch gives the rewritten new file, and the label table of the payload
+ * turns its labels back into addresses */
+static int do_elfdiff(char *name)
+{
+	int ret = -1, dirfd, oldfd, spool;
+	char *file;
+	const struct sum *sum = noverify ? NULL : sum_find(name);
+	struct elf oe, te;
+	struct elfrun *runs = NULL;
+	uint64_t *a = NULL, *extra = NULL, *addr = NULL;
+	off_t *exc = NULL;
+	u_char hdr[ELFDIFF_HEADER], *old = MAP_FAILED, *told = NULL, *new = NULL;
+	u_char *tab = NULL, *p;
+	off_t oldsize = 0, newsize, hlen;
+	size_t n, nrun, nextra, nexc, i;
+	uint64_t nlabel;
+	struct stats_timer tm;
+	fprintf(stderr, "patching %s/%s\n", base, name);
+	STATS_ADD(changed, 1);
+	stats_start(&tm);
+	memset(&oe, 0, sizeof(oe));
+	memset(&te, 0, sizeof(te));
+
+	if((dirfd = lookup(name, &file)) < 0 ||
+			(oldfd = openat(dirfd, file, O_RDONLY)) < 0) {
+		perror(name);
+		tar_skip_regfile(t);
+		return -1;
+	}
+	if((spool = spool_payload(dirfd)) < 0) {
+		perror(name);
+		close(oldfd);
+		return -1;
+	}
+	if(pread(spool, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			memcmp(hdr, ELFDIFF_MAGIC, 8))
+		goto corrupt;
+	nlabel = offtin(hdr + 16);
+	nrun = offtin(hdr + 24);
+	nextra = offtin(hdr + 32);
+	nexc = offtin(hdr + 40);
+	if(nrun > (size_t)th_get_size(t) / 24 || nextra > (size_t)th_get_size(t) / 8 ||
+			nexc > (size_t)th_get_size(t) / 8)
+		goto corrupt;
+	hlen = ELFDIFF_HEADER + 24 * nrun + 8 * (nextra + nexc);
+	if((tab = malloc(hlen)) == NULL ||
+			(runs = calloc(nrun + 1, sizeof(*runs))) == NULL ||
+			(extra = calloc(nextra + 1, sizeof(*extra))) == NULL ||
+			(exc = calloc(nexc + 1, sizeof(*exc))) == NULL ||
+			pread(spool, tab, hlen, 0) != hlen)
+		goto corrupt;
+	p = tab + ELFDIFF_HEADER;
+	for(i = 0; i < nrun; i++, p += 24) {
+		runs[i].label = offtin(p);
+		runs[i].len = offtin(p + 8);
+		runs[i].delta = offtin(p + 16);
+	}
+	for(i = 0; i < nextra; i++, p += 8)
+		extra[i] = offtin(p);
+	for(i = 0; i < nexc; i++, p += 8)
+		exc[i] = offtin(p);
+
+	/* the old file rewritten, which the patch was made against */
+	oldsize = lseek(oldfd, 0, SEEK_END);
+	if(oldsize > 0)
+		old = mmap(NULL, oldsize, PROT_READ, MAP_SHARED, oldfd, 0);
+	if(old == MAP_FAILED || (told = malloc(oldsize)) == NULL) {
+		perror(name);
+		goto out;
+	}
+	STATS_ADD(bytes_read, oldsize);
+	if(elf_parse(&oe, old, oldsize) != 0) {
+		fprintf(stderr, "%s: old file is not an ELF file\n", name);
+		goto out;
+	}
+	elf_scan(&oe, old, ELF_FIND, 0, NULL);
+	a = elf_addrs(&oe, &n);
+	if(nlabel != n + nextra)
+		goto corrupt;
+	memcpy(told, old, oldsize);
+	elf_encode(&oe, told, a, n, NULL);
+
+	if(patch_rewritten(told, oldsize, spool, hlen, &new, &newsize) != 0 ||
+			newsize != offtin(hdr + 8)) {
+		fprintf(stderr, "%s: patch failed\n", name);
+		goto out;
+	}
+	if(elf_parse(&te, new, newsize) != 0)
+		goto corrupt;
+	te.exc = exc;
+	te.nexc = nexc;
+	exc = NULL;
+	elf_scan(&te, new, ELF_LABELS, nlabel, NULL);
+	if((addr = elf_table(a, n, runs, nrun, extra, nextra)) == NULL ||
+			elf_decode(&te, new, addr, nlabel) != 0)
+		goto corrupt;
+	ret = write_rewritten(dirfd, file, name, new, newsize, sum);
+	goto out;
+corrupt:
+	fprintf(stderr, "%s: corrupt elfdiff\n", name);
+out:
+	if(old != MAP_FAILED)
+		munmap(old, oldsize);
+	close(spool);
+	close(oldfd);
+	elf_free(&oe);
+	elf_free(&te);
+	free(a);
+	free(runs);
+	free(extra);
+	free(exc);
+	free(addr);
+	free(tab);
+	free(told);
+	free(new);
+	stats_file(name, stats_stop(&tm, ST_DIFF));
+	return ret;
+}
+
+/* "sparsediff/": the changed blocks of a sparse file go onto a copy of
+ * the old file that keeps its holes, or onto the old file itself with
+ * --in-place since every record is positional */
+static int do_sparsediff(char *name)
+{
+	static unsigned int seq;
+	int ret, dirfd, oldfd, newfd = -1;
+	char *file;
+	char tmpname[64];
+	const struct sum *sum = noverify ? NULL : sum_find(name);
+	struct stat sb;
+	struct stats_timer tm;
+	fprintf(stderr, "patching %s/%s\n", base, name);
+	STATS_ADD(changed, 1);
+	stats_start(&tm);
+
+	if((dirfd = lookup(name, &file)) < 0 ||
+			(oldfd = openat(dirfd, file, O_RDONLY)) < 0) {
+		perror(name);
+		tar_skip_regfile(t);
+		return -1;
+	}
+	tmpname[0] = 0;
+	if(inplace && fstat(oldfd, &sb) == 0 && sb.st_nlink == 1)
+		newfd = openat(dirfd, file, O_RDWR);
+	if(newfd < 0) {
+		do {
+			snprintf(tmpname, sizeof(tmpname), ".fspatch.%d.s%u",
+					getpid(), seq++);
+			journal_tmp(tmpname);
+			newfd = openat(dirfd, tmpname, O_RDWR|O_CREAT|O_EXCL, 0600);
+		} while(newfd < 0 && errno == EEXIST);
+		if(newfd < 0 || copy_sparse(oldfd, newfd) != 0) {
+			perror(name);
+			if(newfd >= 0) {
+				close(newfd);
+				unlinkat(dirfd, tmpname, 0);
+			}
+			close(oldfd);
+			tar_skip_regfile(t);
+			return -1;
+		}
+	}
+	close(oldfd);
+
+	ret = apply_sparse(newfd, name);
+	if(ret == 0 && sum)
+		ret = check_file(newfd, sum->path, sum->postsize, sum->postcrc);
+	if(ret == 0)
+		sync_fd(newfd, 1);
+	close(newfd);
+	if(!tmpname[0]) {
+		if(ret == 0)
+			queue_meta(t, file);
+		else
+			fprintf(stderr, "%s: in-place patch failed\n", name);
+	} else if(ret == 0 && renameat(dirfd, tmpname, dirfd, file) == 0) {
+		queue_meta(t, file);
+	} else {
+		if(ret == 0) {
+			perror("renameat");
+			ret = -1;
+		}
+		unlinkat(dirfd, tmpname, 0);
+	}
+	stats_file(name, stats_stop(&tm, ST_DIFF));
+	return ret;
+}
+
+/* --atomic: the archive is applied to a staging copy of the tree made of
+ * hard links, which then trades places with the original in a single
+ * renameat2(RENAME_EXCHANGE).  Everything the patch writes is a new
+ * inode, so the original files are never modified through the links. */
+static void copy_meta(int fd, const struct stat *sb)
+{
+	struct timespec ts[2];
+
+	if(geteuid() == 0 && fchown(fd, sb->st_uid, sb->st_gid) == -1)
+		perror("fchown");
+	if(fchmod(fd, sb->st_mode & 07777) == -1)
+		perror("fchmod");
+	ts[0] = sb->st_atim;
+	ts[1] = sb->st_mtim;
+	if(futimens(fd, ts) == -1)
+		perror("futimens");
+}
+
+/* fill the empty directory dst with links to everything in src,
+ * subdirectories are recreated so they can change independently */
+static int linktree(int src, int dst)
+{
+	DIR *dir;
+	struct dirent *dp;
+	struct stat sb;
+	int ret = 0, s, d;
+
+	if((dir = fdopendir(dup(src))) == NULL)
+		return -1;
+	while(ret == 0 && (dp = readdir(dir)) != NULL) {
+		if(!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+			continue;
+		if(fstatat(src, dp->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+			perror(dp->d_name);
+			ret = -1;
+		} else if(!S_ISDIR(sb.st_mode)) {
+			if((ret = linkat(src, dp->d_name, dst, dp->d_name, 0)) == -1)
+				perror("linkat");
+		} else if(mkdirat(dst, dp->d_name, 0700) == -1) {
+			perror("mkdirat");
+			ret = -1;
+		} else {
+			s = openat(src, dp->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+			d = openat(dst, dp->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+			if(s < 0 || d < 0)
+				ret = -1;
+			else if((ret = linktree(s, d)) == 0)
+				copy_meta(d, &sb);
+			if(s >= 0)
+				close(s);
+			if(d >= 0)
+				close(d);
+		}
+	}
+	closedir(dir);
+	return ret;
+}
+
+static int removetree(int dirfd, const char *name)
+{
+	DIR *dir;
+	struct dirent *dp;
 	int fd;
-	if(argc != 3) {
-		fprintf(stderr, "Usage: %s patch.tar dir\n", argv[0]);
+
+	if((fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW)) < 0)
+		return -1;
+	fchmod(fd, 0700);
+	if((dir = fdopendir(fd)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	while((dp = readdir(dir)) != NULL) {
+		if(!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+			continue;
+		if(unlinkat(fd, dp->d_name, 0) == -1 &&
+				((errno != EISDIR && errno != EPERM) ||
+				 removetree(fd, dp->d_name) == -1))
+			perror(dp->d_name);
+	}
+	closedir(dir);
+	return unlinkat(dirfd, name, AT_REMOVEDIR);
+}
+
+/* a complete archive ends in zero blocks, reaching its end means it was
+ * cut short */
+static int truncated;
+
+static ssize_t tar_read(int fd, void *buf, size_t count)
+{
+	ssize_t ret = xread(fd, buf, count);
+	if(ret > 0)
+		STATS_ADD(bytes_read, ret);
+	if(ret >= 0 && (size_t)ret < count)
+		truncated = 1;
+	return ret;
+}
+
+static tartype_t type = { open, close, tar_read, xwrite };
+
+/* An entry a previous run completed: only the metadata applied when the
+ * walk leaves its directory is queued again */
+static void skip_entry(char *verb)
+{
+	char *name = strchr(verb, '/'), *file;
+
+	if(name && strncmp(verb, "delete/", 7) && !TH_ISLNK(t) &&
+			lookup(name + 1, &file) >= 0)
+		queue_meta(t, file);
+	tar_skip_regfile(t);
+}
+
+/* a diff of a file the interrupted run already patched */
+static int was_patched(const char *verb)
+{
+	const struct sum *sum;
+	const char *name = strchr(verb, '/');
+
+	if(!patched || !name || (strncmp(verb, "diff/", 5) &&
+			strncmp(verb, "sparsediff/", 11) && strncmp(verb, "zdiff/", 6) &&
+			strncmp(verb, "elfdiff/", 8)))
+		return 0;
+	sum = sum_find(name + 1);
+	return sum && patched[sum - sumv];
+}
+
+int main(int argc, char **argv)
+{
+	int ret, ch, dostats = 0, atomic = 0, synced = 0, errors = 0;
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int fd, rootfd, staged = 0, failed = 0;
+	unsigned long n, pending = 0;
+	off_t pendbytes = 0, archsize = 0;
+	size_t len;
+	char *statspath = NULL, *journalpath = NULL;
+	struct stat sb;
+	char target[PATH_MAX], staging[PATH_MAX + 32];
+	static struct option longopts[] = {
+		{ "sync", required_argument, NULL, 's' },
+		{ "atomic", no_argument, NULL, 'a' },
+		{ "in-place", no_argument, NULL, 'i' },
+		{ "io", required_argument, NULL, 'I' },
+		{ "queue-depth", required_argument, NULL, 'q' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "no-verify", no_argument, NULL, 'n' },
+		{ "stats", optional_argument, NULL, 'S' },
+		{ "journal", required_argument, NULL, 'J' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while((ch = getopt_long(argc, argv, "j:", longopts, NULL)) != -1) {
+		switch(ch) {
+		case 's':
+			synced = 1;
+			if(!strcmp(optarg, "none"))
+				durability = SYNC_NONE;
+			else if(!strcmp(optarg, "file"))
+				durability = SYNC_FILE;
+			else if(!strcmp(optarg, "fs"))
+				durability = SYNC_FS;
+			else
+				argc = 0;
+			break;
+		case 'a':
+			atomic = 1;
+			break;
+		case 'i':
+			inplace = 1;
+			break;
+		case 'I':
+			if(!strcmp(optarg, "uring"))
+				use_uring = 1;
+			else if(strcmp(optarg, "sync"))
+				argc = 0;
+			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			if(queue_depth < 8)
+				queue_depth = 8;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'n':
+			noverify = 1;
+			break;
+		case 'S':
+			dostats = 1;
+			statspath = optarg;
+			break;
+		case 'J':
+			journalpath = optarg;
+			break;
+		default:
+			argc = 0;
+		}
+	}
+	if(argc - optind != 2) {
+		fprintf(stderr, "Usage: %s [--sync=none|file|fs] [--atomic | --in-place] [-j jobs] [--io=sync|uring] [--queue-depth=n] [--no-verify] [--journal=file] [--stats[=file]] patch.tar dir\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	argv += optind - 1;
+	/* an atomic commit is only crash safe once the staged tree is on disk */
+	if(atomic && !synced)
+		durability = SYNC_FS;
+	/* writing through the staging tree's links would change the live
+	 * one, and a file cut short in place matches neither version, so
+	 * neither a commit nor a resume could be trusted */
+	if(inplace && (atomic || journalpath)) {
+		fprintf(stderr, "--in-place does not combine with %s\n",
+				atomic ? "--atomic" : "--journal");
+		exit(EXIT_FAILURE);
+	}
+	if(jobs < 1)
+		jobs = 1;
+	if(dostats)
+		stats_init();
+
+	if((rootfd = open(argv[2], O_RDONLY|O_DIRECTORY)) < 0) {
+		perror(argv[2]);
 		exit(EXIT_FAILURE);
 	}
+	base = argv[2];
 
 	if(!strcmp(argv[1], "-"))
 		fd = 0;
@@ -280,27 +2128,222 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	base = argv[2];
-	while( (ret = th_read(t)) == 0) {
+	if(atomic) {
+		len = strlen(argv[2]);
+		while(len > 1 && argv[2][len-1] == '/')
+			len--;
+		if(len >= sizeof(target)) {
+			fprintf(stderr, "%s: path too long\n", argv[2]);
+			exit(EXIT_FAILURE);
+		}
+		memcpy(target, argv[2], len);
+		target[len] = 0;
+	}
+	/* an interrupted run picks up after its last durable entry */
+	if(journalpath) {
+		if(fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode))
+			archsize = sb.st_size;
+		resuming = journal_read(&journal, journalpath) == 0;
+		if(resuming && journal.archive != archsize) {
+			fprintf(stderr, "%s: journal of another archive\n", journalpath);
+			exit(EXIT_FAILURE);
+		}
+		if(journal.staging && !atomic) {
+			fprintf(stderr, "%s: journal of an --atomic run\n", journalpath);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(journal.staging) {
+		if(stat(target, &sb) == 0 && sb.st_ino == journal.ino) {
+			/* the exchange was made, the old tree is all that is left */
+			if(removetree(AT_FDCWD, journal.staging) == -1)
+				perror(journal.staging);
+			journal_end(&journal);
+			fprintf(stderr, "%s was already patched\n", target);
+			return 0;
+		}
+		if((fd = open(journal.staging, O_RDONLY|O_DIRECTORY)) >= 0 &&
+				fstat(fd, &sb) == 0 && sb.st_ino == journal.ino) {
+			close(rootfd);
+			rootfd = fd;
+			snprintf(staging, sizeof(staging), "%s", journal.staging);
+			base = staging;
+			staged = 1;
+		} else {
+			/* the target was never touched, start over */
+			if(fd >= 0)
+				close(fd);
+			journal.done = 0;
+			journal.ntmp = 0;
+			resuming = 0;
+		}
+	}
+
+	/* nothing is touched until the base files are known to match */
+	ret = th_read(t);
+	if(ret == 0 && is_sums(t)) {
+		if(read_sums(t) != 0) {
+			perror("sums");
+			exit(EXIT_FAILURE);
+		}
+		if(!noverify && preflight(rootfd, jobs) != 0) {
+			fprintf(stderr, "%s does not match the archive, nothing changed\n", argv[2]);
+			exit(EXIT_FAILURE);
+		}
+		ret = th_read(t);
+	}
+	if(use_uring && uring_setup() != 0) {
+		perror("io_uring");
+		fprintf(stderr, "falling back to synchronous I/O\n");
+		use_uring = 0;
+	}
+	if(atomic && !staged) {
+		snprintf(staging, sizeof(staging), "%s.fspatch-%d", target, getpid());
+		if(mkdir(staging, 0700) == -1 ||
+				(fd = open(staging, O_RDONLY|O_DIRECTORY)) < 0) {
+			perror(staging);
+			exit(EXIT_FAILURE);
+		}
+		if(linktree(rootfd, fd) != 0 || fstat(rootfd, &sb) != 0) {
+			fprintf(stderr, "couldn't stage %s\n", staging);
+			removetree(AT_FDCWD, staging);
+			exit(EXIT_FAILURE);
+		}
+		copy_meta(fd, &sb);
+		close(rootfd);
+		rootfd = fd;
+		base = staging;
+		fstat(rootfd, &sb);
+	}
+	if(journalpath) {
+		journal_clean(&journal, rootfd);
+		journal_begin(&journal, archsize, atomic ? staging : NULL,
+				atomic ? sb.st_ino : 0);
+	}
+	dirpath = grow(dirpath, &dirpathcap, 1);
+	dirpath[0] = 0;
+	pushdir(dup(rootfd), 0);
+
+	for(n = 1; ret == 0; ret = th_read(t), n++) {
 		char* verb = th_get_pathname(t);
-		if(!strncmp(verb, "add/", 4)) {
-			do_add(verb+4);
+		int before = errors;
+		if(n <= journal.done) {
+			if(n == journal.done && strcmp(verb, journal.name)) {
+				fprintf(stderr, "%s: journal of another archive\n",
+						journalpath);
+				exit(EXIT_FAILURE);
+			}
+			skip_entry(verb);
+			free(verb);
+			continue;
+		}
+		if(was_patched(verb)) {
+			fprintf(stderr, "%s/%s was already patched\n", base,
+					strchr(verb, '/') + 1);
+			skip_entry(verb);
+		} else if(!strncmp(verb, "add/", 4)) {
+			errors += do_add(verb+4) != 0;
 		} else if (!strncmp(verb, "delete/", 7)) {
-			do_delete(verb+7);
+			errors += do_delete(verb+7) != 0;
 		} else if (!strncmp(verb, "diff/", 5)) {
-			do_patch(verb+5);
+			errors += do_patch(verb+5) != 0;
+		} else if (!strncmp(verb, "sparse/", 7)) {
+			errors += do_sparse(verb+7) != 0;
+		} else if (!strncmp(verb, "sparsediff/", 11)) {
+			errors += do_sparsediff(verb+11) != 0;
+		} else if (!strncmp(verb, "copy/", 5)) {
+			errors += do_copy(verb+5) != 0;
+		} else if (!strncmp(verb, "zdiff/", 6)) {
+			errors += do_zdiff(verb+6) != 0;
+		} else if (!strncmp(verb, "elfdiff/", 8)) {
+			errors += do_elfdiff(verb+8) != 0;
 		} else {
 			fprintf(stderr, "unknown verb '%s', skipping\n", strtok(verb,"/"));
 			tar_skip_regfile(t);
 		}
+		/* the journal only moves past entries that all succeeded */
+		failed |= errors != before;
+		if(journalpath && !failed) {
+			pending++;
+			pendbytes += th_get_size(t);
+			if(pending >= JOURNAL_ENTRIES || pendbytes >= JOURNAL_BYTES) {
+				if(use_uring)
+					uring_drain(&ring);
+				if(uring_errors)
+					failed = 1;
+				else
+					journal_commit(&journal, rootfd, n, verb);
+				pending = pendbytes = 0;
+			}
+		}
 		free(verb);
 	}
+	if(ret > 0 && truncated) {
+		errno = EINVAL;
+		ret = -1;
+	}
 	if(ret < 0) {
 		perror("th_read");
+		if(atomic) {
+			removetree(AT_FDCWD, staging);
+			journal_end(&journal);
+		}
 		exit(EXIT_FAILURE);
 	}
+	while(nlevels)
+		popdir();
+	errors += uring_errors;
+
+	if(durability == SYNC_FS) {
+		struct stats_timer tm;
+		stats_start(&tm);
+		if(syncfs(rootfd) == -1)
+			perror("syncfs");
+		stats_stop(&tm, ST_SYNC);
+	} else if(journalpath && !errors && syncfs(rootfd) == -1)
+		perror("syncfs");
+	close(rootfd);
+	if(!atomic && !errors)
+		journal_end(&journal);
 
+	if(atomic) {
+		char *slash;
+		if(errors) {
+			fprintf(stderr, "%d errors, %s left unchanged\n", errors, target);
+			removetree(AT_FDCWD, staging);
+			journal_end(&journal);
+			exit(EXIT_FAILURE);
+		}
+		if(renameat2(AT_FDCWD, staging, AT_FDCWD, target, RENAME_EXCHANGE) == -1) {
+			perror("renameat2");
+			fprintf(stderr, "patched tree left in %s\n", staging);
+			exit(EXIT_FAILURE);
+		}
+		if(durability != SYNC_NONE) {
+			slash = strrchr(target, '/');
+			if(slash == target)
+				slash[1] = 0;
+			else if(slash)
+				*slash = 0;
+			fd = open(slash ? target : ".", O_RDONLY|O_DIRECTORY);
+			if(fd < 0 || fsync(fd) == -1)
+				perror("fsync");
+			if(fd >= 0)
+				close(fd);
+		}
+		/* staging now holds the old tree */
+		if(removetree(AT_FDCWD, staging) == -1)
+			perror(staging);
+		journal_end(&journal);
+	}
+
+	/* in place the tree is left as far as it got */
+	if(errors)
+		fprintf(stderr, "%d errors\n", errors);
 	ret = tar_close(t);
 
-	return ret;
+	if(dostats)
+		stats_print("fspatch", statspath);
+
+	return errors ? EXIT_FAILURE : ret;
 }
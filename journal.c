@@ -0,0 +1,182 @@
+/*
+ * Progress journal of fspatch --journal, so an interrupted run can be
+ * restarted where it stopped instead of from a base tree that no longer
+ * matches.  One record per line:
+ *
+ *	fspatch-journal <archive size>
+ *	staging <path> <inode>		the --atomic staging tree
+ *	done <n> <name>			archive entries 1..n are on disk
+ *	tmp <path>			a temporary that may be left over
+ *
+ * A done record is written after a syncfs() of the tree and synced, so
+ * everything it covers is durable.  tmp records are appended unsynced as
+ * temporaries are created, paths relative to the tree.  A line without
+ * its newline is a torn write and is ignored.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JOURNAL_ENTRIES	1024
+#define JOURNAL_BYTES	(64 << 20)
+
+struct journal {
+	int fd;
+	const char *path;
+	long long archive;
+	char *staging;
+	unsigned long long ino;
+	unsigned long done;	/* last entry known to be on disk */
+	char *name;		/* its archive name */
+	char **tmp;
+	size_t ntmp;
+};
+
+/* Read an existing journal, 0 when there is one, 1 when there is none */
+static int journal_read(struct journal *j, const char *path)
+{
+	FILE *f;
+	char *line = NULL, *p;
+	size_t cap = 0;
+	ssize_t len;
+	int n;
+
+	memset(j, 0, sizeof(*j));
+	j->fd = -1;
+	j->path = path;
+	j->archive = -1;
+	if((f = fopen(path, "r")) == NULL) {
+		if(errno == ENOENT)
+			return 1;
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	while((len = getline(&line, &cap, f)) > 0) {
+		if(line[len-1] != '\n')
+			break;
+		line[len-1] = 0;
+		if(sscanf(line, "fspatch-journal %lld", &j->archive) == 1)
+			continue;
+		if(!strncmp(line, "tmp ", 4)) {
+			if((j->tmp = realloc(j->tmp, (j->ntmp + 1) *
+					sizeof(*j->tmp))) == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+			j->tmp[j->ntmp++] = strdup(line + 4);
+		} else if(!strncmp(line, "staging ", 8) &&
+				(p = strrchr(line, ' ')) != line + 7) {
+			*p = 0;
+			j->ino = strtoull(p + 1, NULL, 10);
+			free(j->staging);
+			j->staging = strdup(line + 8);
+		} else if(sscanf(line, "done %lu %n", &j->done, &n) == 1) {
+			free(j->name);
+			j->name = strdup(line + n);
+			/* everything before it was cleaned up */
+			while(j->ntmp)
+				free(j->tmp[--j->ntmp]);
+		}
+	}
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+static void journal_put(struct journal *j, const char *fmt, ...)
+{
+	char buf[PATH_MAX + 64];
+	va_list ap;
+	int len;
+
+	if(j->fd < 0)
+		return;
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if(len >= (int)sizeof(buf))
+		return;
+	if(write(j->fd, buf, len) != len)
+		perror(j->path);
+}
+
+static void journal_sync(struct journal *j)
+{
+	if(j->fd >= 0 && fdatasync(j->fd) == -1)
+		perror(j->path);
+}
+
+/* Start the journal over with what a restart needs to know */
+static void journal_begin(struct journal *j, long long archive,
+		const char *staging, unsigned long long ino)
+{
+	char tmp[PATH_MAX + 32];
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", j->path, (int)getpid());
+	if((j->fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0) {
+		perror(tmp);
+		exit(EXIT_FAILURE);
+	}
+	j->archive = archive;
+	journal_put(j, "fspatch-journal %lld\n", archive);
+	if(staging)
+		journal_put(j, "staging %s %llu\n", staging, ino);
+	if(j->done)
+		journal_put(j, "done %lu %s\n", j->done, j->name);
+	journal_sync(j);
+	if(rename(tmp, j->path) == -1) {
+		perror(j->path);
+		unlink(tmp);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* remove the temporaries an interrupted run left in the tree at rootfd */
+static void journal_clean(struct journal *j, int rootfd)
+{
+	size_t i;
+
+	for(i = 0; i < j->ntmp; i++) {
+		if(unlinkat(rootfd, j->tmp[i], 0) == 0)
+			fprintf(stderr, "removed %s\n", j->tmp[i]);
+		else if(errno != ENOENT)
+			perror(j->tmp[i]);
+		free(j->tmp[i]);
+	}
+	j->ntmp = 0;
+}
+
+/* entries 1..n, the last one named name, are durable in the tree at
+ * rootfd */
+static void journal_commit(struct journal *j, int rootfd, unsigned long n,
+		const char *name)
+{
+	if(j->fd < 0 || n == j->done)
+		return;
+	if(syncfs(rootfd) == -1) {
+		perror("syncfs");
+		return;
+	}
+	free(j->name);
+	j->name = strdup(name);
+	j->done = n;
+	journal_put(j, "done %lu %s\n", n, name);
+	journal_sync(j);
+}
+
+/* the run completed, there is nothing left to resume */
+static void journal_end(struct journal *j)
+{
+	if(!j->path)
+		return;
+	if(j->fd >= 0)
+		close(j->fd);
+	j->fd = -1;
+	if(unlink(j->path) == -1 && errno != ENOENT)
+		perror(j->path);
+}
@@ -0,0 +1,43 @@
+/*
+ * Sparse files.  Data extents are found with SEEK_DATA/SEEK_HOLE, and a
+ * sparse file travels in the archive as an extent payload instead of its
+ * expanded bytes:
+ *
+ *	"SPARSE00" size nrec { off len }[nrec] data
+ *
+ * all numbers 8 bytes as in the bsdiff header.  The result is size bytes
+ * long; a record with len > 0 replaces [off, off+len) with the next len
+ * bytes of data, len < 0 punches a hole over [off, off-len).  The rest
+ * keeps the base contents: nothing for a "sparse/" add, the old file for
+ * a "sparsediff/" entry.
+ */
+#include <errno.h>
+#include <unistd.h>
+
+#define SPARSE_MAGIC	"SPARSE00"
+#define SPARSE_HEADER	24
+
+/* The data extent at or after pos and before size, 0 when found.  On a
+ * file system without SEEK_DATA the rest of the file is one extent. */
+__attribute__((unused))
+static int next_extent(int fd, off_t pos, off_t size, off_t *start, off_t *end)
+{
+	off_t s, e;
+
+	if(pos >= size)
+		return -1;
+	s = lseek(fd, pos, SEEK_DATA);
+	if(s < 0 && errno == ENXIO)
+		return -1;
+	if(s < 0) {
+		*start = pos;
+		*end = size;
+		return 0;
+	}
+	if(s >= size)
+		return -1;
+	e = lseek(fd, s, SEEK_HOLE);
+	*start = s;
+	*end = e < 0 || e > size ? size : e;
+	return 0;
+}
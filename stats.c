@@ -0,0 +1,202 @@
+/*
+ * Run statistics for --stats: per-phase wall and CPU time, byte and
+ * per-verb file counters, the slowest files and peak memory, printed as
+ * one JSON object when the tool exits.
+ *
+ * The counters live in a shared anonymous mapping, so forked bsdiff
+ * children account into their parent's totals.  Everything is a no-op
+ * until stats_init() has been called.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+enum {
+	ST_WALK,		/* scandir and stat of the trees */
+	ST_COMPARE,		/* byte comparison of same-size files */
+	ST_READ,		/* reading file contents into memory */
+	ST_QSUFSORT,		/* suffix sorting the old file */
+	ST_SCAN,		/* matching new against old */
+	ST_WRITE,		/* writing patch output */
+	ST_DIFF,		/* whole per-file diff, including the child */
+	ST_ARCHIVE,		/* tar headers and payloads */
+	ST_APPLY,		/* applying a patch */
+	ST_META,		/* owner, mode and times */
+	ST_SYNC,		/* fdatasync, fsync and syncfs */
+	ST_SUM,			/* checksumming files */
+	ST_NPHASES
+};
+
+static const char *stats_phase_names[ST_NPHASES] = {
+	"walk", "compare", "read", "qsufsort", "scan", "write",
+	"diff", "archive", "apply", "meta", "sync", "checksum",
+};
+
+#define STATS_TOPN 10
+
+struct stats {
+	struct {
+		unsigned long long wall, cpu, calls;
+	} phase[ST_NPHASES];
+	unsigned long long bytes_read, bytes_written;
+	unsigned long long added, deleted, changed, unchanged;
+	unsigned long long cache_hits, cache_misses;
+	unsigned long long deduped, zdiffs, elfdiffs;
+	unsigned long long cycle_bytes;	/* --in-place copies buffered in memory */
+	struct {
+		char name[256];
+		unsigned long long wall;
+	} slow[STATS_TOPN];
+	unsigned long long start;
+};
+
+struct stats_timer {
+	unsigned long long wall, cpu;
+};
+
+static struct stats *stats;
+
+#define STATS_ADD(field, n) do { \
+	if(stats) \
+		__atomic_add_fetch(&stats->field, (n), __ATOMIC_RELAXED); \
+} while(0)
+
+static unsigned long long stats_clock(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_init(void)
+{
+	void *p;
+
+	if(stats)
+		return;
+	p = mmap(NULL, sizeof(*stats), PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED) {
+		perror("stats");
+		return;
+	}
+	stats = p;
+	stats->start = stats_clock(CLOCK_MONOTONIC);
+}
+
+static void stats_start(struct stats_timer *t)
+{
+	if(!stats)
+		return;
+	t->wall = stats_clock(CLOCK_MONOTONIC);
+	t->cpu = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/* Charge the time since stats_start() to phase, returns the wall ns */
+static unsigned long long stats_stop(struct stats_timer *t, int phase)
+{
+	unsigned long long wall;
+
+	if(!stats)
+		return 0;
+	wall = stats_clock(CLOCK_MONOTONIC) - t->wall;
+	STATS_ADD(phase[phase].wall, wall);
+	STATS_ADD(phase[phase].cpu, stats_clock(CLOCK_PROCESS_CPUTIME_ID) - t->cpu);
+	STATS_ADD(phase[phase].calls, 1);
+	return wall;
+}
+
+/* Keep the STATS_TOPN slowest files, only called by the parent */
+__attribute__((unused))
+static void stats_file(const char *name, unsigned long long wall)
+{
+	int i;
+
+	if(!stats || wall <= stats->slow[STATS_TOPN-1].wall)
+		return;
+	for(i = STATS_TOPN - 1; i > 0 && stats->slow[i-1].wall < wall; i--)
+		stats->slow[i] = stats->slow[i-1];
+	snprintf(stats->slow[i].name, sizeof(stats->slow[i].name), "%s", name);
+	stats->slow[i].wall = wall;
+}
+
+static void stats_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/* Print the totals to path, or stderr when path is NULL */
+static void stats_print(const char *tool, const char *path)
+{
+	struct rusage self, children;
+	FILE *f = stderr;
+	int i, first;
+
+	if(!stats)
+		return;
+	if(path && (f = fopen(path, "w")) == NULL) {
+		perror(path);
+		return;
+	}
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+
+	fprintf(f, "{\"tool\":\"%s\",\"wall_s\":%.6f,\"cpu_s\":%.6f,"
+		"\"children_cpu_s\":%.6f,"
+		"\"peak_rss_kb\":%ld,\"children_peak_rss_kb\":%ld,"
+		"\"bytes_read\":%llu,\"bytes_written\":%llu,",
+		tool, (stats_clock(CLOCK_MONOTONIC) - stats->start) / 1e9,
+		self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1e6 +
+		self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1e6,
+		children.ru_utime.tv_sec + children.ru_utime.tv_usec / 1e6 +
+		children.ru_stime.tv_sec + children.ru_stime.tv_usec / 1e6,
+		self.ru_maxrss, children.ru_maxrss,
+		stats->bytes_read, stats->bytes_written);
+	fprintf(f, "\"files\":{\"added\":%llu,\"deleted\":%llu,"
+		"\"changed\":%llu,\"unchanged\":%llu},",
+		stats->added, stats->deleted, stats->changed, stats->unchanged);
+	if(stats->deduped)
+		fprintf(f, "\"deduped\":%llu,", stats->deduped);
+	if(stats->zdiffs)
+		fprintf(f, "\"zdiffs\":%llu,", stats->zdiffs);
+	if(stats->elfdiffs)
+		fprintf(f, "\"elfdiffs\":%llu,", stats->elfdiffs);
+	if(stats->cycle_bytes)
+		fprintf(f, "\"cycle_bytes\":%llu,", stats->cycle_bytes);
+	if(stats->cache_hits || stats->cache_misses)
+		fprintf(f, "\"cache\":{\"hits\":%llu,\"misses\":%llu},",
+			stats->cache_hits, stats->cache_misses);
+
+	fprintf(f, "\"phases\":{");
+	for(i = 0, first = 1; i < ST_NPHASES; i++) {
+		if(!stats->phase[i].calls)
+			continue;
+		fprintf(f, "%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f,\"calls\":%llu}",
+			first ? "" : ",", stats_phase_names[i],
+			stats->phase[i].wall / 1e9, stats->phase[i].cpu / 1e9,
+			stats->phase[i].calls);
+		first = 0;
+	}
+	fprintf(f, "},\"slowest\":[");
+	for(i = 0; i < STATS_TOPN && stats->slow[i].wall; i++) {
+		fprintf(f, "%s{\"file\":", i ? "," : "");
+		stats_string(f, stats->slow[i].name);
+		fprintf(f, ",\"wall_s\":%.6f}", stats->slow[i].wall / 1e9);
+	}
+	fprintf(f, "]}\n");
+
+	if(path)
+		fclose(f);
+}
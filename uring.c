@@ -0,0 +1,151 @@
+/*
+ * Minimal io_uring wrapper over the raw system calls, so fspatch needs
+ * no liburing: one ring with a sparse table of fixed file slots, SQEs
+ * handed out in order and completions passed to a callback.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned depth, cqentries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned pending;	/* filled in, not yet submitted */
+	unsigned inflight;	/* submitted, not yet completed */
+	void (*complete)(struct io_uring_cqe *);
+};
+
+static int uring_enter(struct uring *r, unsigned submit, unsigned wait)
+{
+	return syscall(__NR_io_uring_enter, r->fd, submit, wait,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static int uring_init(struct uring *r, unsigned depth, unsigned slots)
+{
+	struct io_uring_params p;
+	struct io_uring_rsrc_register reg;
+	size_t sqsize, cqsize;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+	r->fd = syscall(__NR_io_uring_setup, depth, &p);
+	if(r->fd < 0)
+		return -1;
+	sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP && cqsize > sqsize)
+		sqsize = cqsize;
+	sq = mmap(NULL, sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			r->fd, IORING_OFF_SQ_RING);
+	if(sq == MAP_FAILED)
+		goto fail;
+	cq = sq;
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cqsize, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(cq == MAP_FAILED)
+			goto fail;
+	}
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED)
+		goto fail;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->depth = p.sq_entries;
+	r->cqentries = p.cq_entries;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = slots;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES2,
+			&reg, sizeof(reg)) < 0)
+		goto fail;
+	return 0;
+fail:
+	close(r->fd);
+	r->fd = -1;
+	return -1;
+}
+
+/* hand completed entries to the callback, returns how many */
+static unsigned uring_reap(struct uring *r)
+{
+	unsigned head, n = 0;
+
+	head = *r->cq_head;
+	while(head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		r->complete(&r->cqes[head & *r->cq_mask]);
+		head++;
+		n++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	r->inflight -= n;
+	return n;
+}
+
+/* submit what is pending and wait for at least wait completions */
+static int uring_submit(struct uring *r, unsigned wait)
+{
+	int ret;
+
+	if(!r->pending && !wait)
+		return 0;
+	do {
+		ret = uring_enter(r, r->pending, wait);
+	} while(ret < 0 && errno == EINTR);
+	if(ret < 0)
+		return -1;
+	r->inflight += ret;
+	r->pending -= ret;
+	uring_reap(r);
+	return 0;
+}
+
+/* Room for n more SQEs that will go in one submission, so a linked chain
+ * is never split; completions are reaped while waiting for space */
+static void uring_reserve(struct uring *r, unsigned n)
+{
+	while(r->pending + n > r->depth ||
+			r->inflight + r->pending + n > r->cqentries) {
+		uring_submit(r, r->inflight ? 1 : 0);
+		if(!r->inflight && r->pending + n > r->depth)
+			break;
+	}
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	unsigned tail = *r->sq_tail;
+	struct io_uring_sqe *sqe = &r->sqes[tail & *r->sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+	return sqe;
+}
+
+/* wait until everything submitted has completed */
+static void uring_drain(struct uring *r)
+{
+	uring_submit(r, 0);
+	while(r->inflight)
+		uring_submit(r, 1);
+}
@@ -0,0 +1,429 @@
+/*
+ * Compressed containers for "zdiff/" entries, in the spirit of imgdiff.
+ * gzip members, the deflated members of a zip archive and a whole xz
+ * stream are found by parsing the file, which is then a list of chunks:
+ * raw spans and compressed streams.  The expanded form has the raw spans
+ * as they are and the streams decompressed.  fsdiff diffs the expanded
+ * forms and keeps, for every stream of the new file, the parameters that
+ * recompress it to the same bytes; fspatch expands the old file the same
+ * way, patches it and recompresses.  The payload is
+ *
+ *	"ZDIFF000" oldexp size nchunk { kind len explen param }[nchunk] patch
+ *
+ * all numbers 8 bytes as in the bsdiff header, followed by a bsdiff
+ * patch from the expanded old file to the expanded new one.  size is the
+ * size of the new file, len a chunk's size in it and explen expanded.
+ * param is the deflate level, memLevel << 8 and strategy << 16, or the
+ * xz preset and check << 32.  Expansion stops at ZDIFF_RATIO times the
+ * size of the file, which depends on nothing else, so fspatch expands the
+ * old file exactly as fsdiff did.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <lzma.h>
+
+#define ZDIFF_MAGIC	"ZDIFF000"
+#define ZDIFF_HEADER	32
+#define ZDIFF_CHUNK	32
+#define ZDIFF_RATIO	64
+
+enum { ZC_RAW, ZC_DEFLATE, ZC_XZ };
+
+struct zchunk {
+	int kind;
+	off_t off, len;		/* in the file */
+	off_t expoff, explen;	/* in the expanded form */
+	int64_t param;
+};
+
+struct zfile {
+	struct zchunk *v;
+	size_t n, cap;
+	u_char *exp;
+	off_t expsize, expcap;
+	off_t explimit;		/* no stream expands past this */
+};
+
+static void zgrow(struct zfile *z, off_t len)
+{
+	if(z->expsize + len <= z->expcap)
+		return;
+	if(!z->expcap)
+		z->expcap = 65536;
+	while(z->expcap < z->expsize + len)
+		z->expcap *= 2;
+	if((z->exp = realloc(z->exp, z->expcap)) == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void zchunk_push(struct zfile *z, int kind, off_t off, off_t len,
+		off_t explen)
+{
+	struct zchunk *c;
+
+	if(kind == ZC_RAW && !len)
+		return;
+	if(kind == ZC_RAW && z->n && z->v[z->n-1].kind == ZC_RAW) {
+		z->v[z->n-1].len += len;
+		z->v[z->n-1].explen += len;
+		return;
+	}
+	if(z->n == z->cap) {
+		z->cap = z->cap ? 2 * z->cap : 16;
+		if((z->v = realloc(z->v, z->cap * sizeof(*z->v))) == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	c = &z->v[z->n++];
+	c->kind = kind;
+	c->off = off;
+	c->len = len;
+	c->expoff = z->expsize - explen;
+	c->explen = explen;
+	c->param = 0;
+}
+
+static void zraw(struct zfile *z, const u_char *buf, off_t off, off_t len)
+{
+	zgrow(z, len);
+	memcpy(z->exp + z->expsize, buf + off, len);
+	z->expsize += len;
+	zchunk_push(z, ZC_RAW, off, len, len);
+}
+
+/* inflate the raw deflate stream at buf+off onto the expanded form,
+ * returns its compressed length or -1 if it does not end cleanly */
+static off_t zinflate(struct zfile *z, const u_char *buf, off_t off, off_t size)
+{
+	z_stream s;
+	off_t start = z->expsize;
+	int ret;
+
+	memset(&s, 0, sizeof(s));
+	if(inflateInit2(&s, -15) != Z_OK)
+		return -1;
+	s.next_in = (u_char *)buf + off;
+	s.avail_in = size - off > UINT_MAX ? UINT_MAX : size - off;
+	do {
+		if(z->expsize + 65536 > z->explimit) {
+			ret = Z_MEM_ERROR;
+			break;
+		}
+		zgrow(z, 65536);
+		s.next_out = z->exp + z->expsize;
+		s.avail_out = 65536;
+		ret = inflate(&s, Z_NO_FLUSH);
+		z->expsize += 65536 - s.avail_out;
+	} while(ret == Z_OK);
+	inflateEnd(&s);
+	if(ret != Z_STREAM_END) {
+		z->expsize = start;
+		return -1;
+	}
+	zchunk_push(z, ZC_DEFLATE, off, s.total_in, z->expsize - start);
+	return s.total_in;
+}
+
+/* length of the gzip member header at p, or -1 */
+static off_t gzip_header(const u_char *p, off_t len)
+{
+	off_t n = 10;
+	int flags;
+
+	if(len < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8)
+		return -1;
+	flags = p[3];
+	if(flags & 0xe0)
+		return -1;
+	if(flags & 4) {
+		n += 2 + (p[n] | p[n+1] << 8);
+	}
+	if(flags & 8)
+		while(n < len && p[n++])
+			;
+	if(flags & 16)
+		while(n < len && p[n++])
+			;
+	if(flags & 2)
+		n += 2;
+	return n < len ? n : -1;
+}
+
+static unsigned le16(const u_char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const u_char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* An xz stream lzma_easy_encoder() could have written: its first block
+ * has one LZMA2 filter and no sizes in the header, which the threaded
+ * encoder of the xz tool always stores.  Returns the dictionary size
+ * byte of the filter properties, or -1. */
+static int xz_easy(const u_char *buf, off_t size)
+{
+	if(size < 12 + 12 || memcmp(buf, "\xfd" "7zXZ\0", 6))
+		return -1;
+	if(buf[13] & 0xc3 || buf[14] != 0x21 || buf[15] != 1 || buf[16] > 40)
+		return -1;
+	return buf[16];
+}
+
+/* the LZMA2 dictionary size byte of an xz preset */
+static int xz_dictbyte(uint32_t preset)
+{
+	lzma_options_lzma opt;
+	int d;
+
+	if(lzma_lzma_preset(&opt, preset))
+		return -1;
+	for(d = 0; d < 40 && (uint32_t)(2 | (d & 1)) << (d / 2 + 11) <
+			opt.dict_size; d++)
+		;
+	return d;
+}
+
+/* Split buf into chunks and expand it, returns the number of compressed
+ * streams found.  Anything that does not parse stays raw, and a file
+ * that starts like none of the formats is not expanded at all. */
+static int zparse(struct zfile *z, const u_char *buf, off_t size)
+{
+	off_t pos = 0, n, m;
+	int streams = 0, flags, method;
+	lzma_stream xs = LZMA_STREAM_INIT;
+	lzma_ret lr;
+
+	memset(z, 0, sizeof(*z));
+	z->explimit = ZDIFF_RATIO * size + 65536;
+	if(size >= 6 && !memcmp(buf, "\xfd" "7zXZ\0", 6)) {
+		if(xz_easy(buf, size) < 0)
+			return 0;
+		/* one xz stream, decoded whole */
+		if(lzma_stream_decoder(&xs, UINT64_MAX, 0) != LZMA_OK)
+			return 0;
+		xs.next_in = buf;
+		xs.avail_in = size;
+		do {
+			if(z->expsize + 65536 > z->explimit) {
+				lr = LZMA_MEMLIMIT_ERROR;
+				break;
+			}
+			zgrow(z, 65536);
+			xs.next_out = z->exp + z->expsize;
+			xs.avail_out = 65536;
+			lr = lzma_code(&xs, LZMA_FINISH);
+			z->expsize += 65536 - xs.avail_out;
+		} while(lr == LZMA_OK);
+		n = xs.total_in;
+		lzma_end(&xs);
+		if(lr == LZMA_STREAM_END && n == size && z->expsize) {
+			zchunk_push(z, ZC_XZ, 0, size, z->expsize);
+			return 1;
+		}
+		return 0;
+	} else if(gzip_header(buf, size) > 0) {
+		/* gzip members, one after the other */
+		while((n = gzip_header(buf + pos, size - pos)) > 0) {
+			zraw(z, buf, pos, n);
+			pos += n;
+			if((m = zinflate(z, buf, pos, size)) < 0)
+				break;
+			streams++;
+			pos += m;
+			if(pos + 8 > size)
+				break;
+			zraw(z, buf, pos, 8);
+			pos += 8;
+		}
+	} else if(size >= 30 && !memcmp(buf, "PK\3\4", 4)) {
+		/* zip local entries, up to the central directory */
+		while(pos + 30 <= size && !memcmp(buf + pos, "PK\3\4", 4)) {
+			flags = le16(buf + pos + 6);
+			method = le16(buf + pos + 8);
+			n = 30 + le16(buf + pos + 26) + le16(buf + pos + 28);
+			if(pos + n > size)
+				break;
+			zraw(z, buf, pos, n);
+			pos += n;
+			if(method == 8) {
+				if((m = zinflate(z, buf, pos, size)) < 0)
+					break;
+				streams++;
+			} else if(method == 0 && !(flags & 8)) {
+				m = le32(buf + pos - n + 18);
+				if(pos + m > size)
+					break;
+				zraw(z, buf, pos, m);
+			} else
+				break;
+			pos += m;
+			if(flags & 8) {
+				/* data descriptor, with or without its signature */
+				n = pos + 4 <= size && !memcmp(buf + pos, "PK\7\10", 4) ? 16 : 12;
+				if(pos + n > size)
+					break;
+				zraw(z, buf, pos, n);
+				pos += n;
+			}
+		}
+	} else
+		return 0;
+	zraw(z, buf, pos, size - pos);
+	return streams;
+}
+
+/* Compress in with the parameters of chunk kind.  With expect the output
+ * is only compared against it, returning -1 at the first difference;
+ * otherwise it is appended to out. */
+static int zcompress(int kind, int64_t param, const u_char *in, off_t inlen,
+		const u_char *expect, off_t explen, struct zfile *out)
+{
+	u_char buf[65536];
+	off_t done = 0;
+	size_t n;
+	int ret;
+
+	if(kind == ZC_DEFLATE) {
+		z_stream s;
+		memset(&s, 0, sizeof(s));
+		if(deflateInit2(&s, param & 0xff, Z_DEFLATED, -15,
+				(param >> 8) & 0xff, (param >> 16) & 0xff) != Z_OK)
+			return -1;
+		s.next_in = (u_char *)in;
+		s.avail_in = inlen;
+		do {
+			s.next_out = buf;
+			s.avail_out = sizeof(buf);
+			ret = deflate(&s, Z_FINISH);
+			n = sizeof(buf) - s.avail_out;
+			if(expect ? done + n > explen || memcmp(expect + done, buf, n) :
+					ret == Z_STREAM_ERROR)
+				break;
+			if(!expect) {
+				zgrow(out, n);
+				memcpy(out->exp + out->expsize, buf, n);
+				out->expsize += n;
+			}
+			done += n;
+		} while(ret == Z_OK);
+		deflateEnd(&s);
+		ret = ret == Z_STREAM_END ? 0 : -1;
+	} else {
+		lzma_stream s = LZMA_STREAM_INIT;
+		lzma_ret lr;
+		if(lzma_easy_encoder(&s, param & 0xffffffff, param >> 32) != LZMA_OK)
+			return -1;
+		s.next_in = in;
+		s.avail_in = inlen;
+		do {
+			s.next_out = buf;
+			s.avail_out = sizeof(buf);
+			lr = lzma_code(&s, LZMA_FINISH);
+			n = sizeof(buf) - s.avail_out;
+			if(expect && (done + n > explen || memcmp(expect + done, buf, n)))
+				break;
+			if(!expect) {
+				zgrow(out, n);
+				memcpy(out->exp + out->expsize, buf, n);
+				out->expsize += n;
+			}
+			done += n;
+		} while(lr == LZMA_OK);
+		lzma_end(&s);
+		ret = lr == LZMA_STREAM_END ? 0 : -1;
+	}
+	return ret == 0 && (!expect || done == explen) ? 0 : -1;
+}
+
+static void zfree(struct zfile *z)
+{
+	free(z->v);
+	free(z->exp);
+	memset(z, 0, sizeof(*z));
+}
+
+/* Find the parameters that recompress every stream of z, parsed from buf,
+ * to the same bytes.  Streams none of them reproduce are turned back into
+ * raw spans.  Returns the compressed bytes that are covered. */
+__attribute__((unused))
+static off_t zfind_params(struct zfile *z, const u_char *buf)
+{
+	static const int levels[] = { 6, 9, 1, 2, 3, 4, 5, 7, 8, 0 };
+	static const int presets[] = { 6, 0, 1, 2, 3, 4, 5, 7, 8, 9 };
+	struct zfile nz;
+	struct zchunk *c;
+	int64_t param;
+	off_t covered = 0;
+	size_t i, j, k;
+	int found;
+
+	memset(&nz, 0, sizeof(nz));
+	for(i = 0; i < z->n; i++) {
+		c = &z->v[i];
+		found = 0;
+		if(c->kind == ZC_DEFLATE) {
+			for(j = 0; !found && j < 2; j++)
+				for(k = 0; !found && k < sizeof(levels) / sizeof(*levels); k++) {
+					param = levels[k] | (8 + j) << 8;
+					found = !zcompress(c->kind, param, z->exp + c->expoff,
+							c->explen, buf + c->off, c->len, NULL);
+				}
+		} else if(c->kind == ZC_XZ) {
+			/* only the presets with the dictionary size it records */
+			for(j = 0; !found && j < 2; j++)
+				for(k = 0; !found && k < sizeof(presets) / sizeof(*presets); k++) {
+					if(xz_dictbyte(presets[k]) != xz_easy(buf + c->off, c->len))
+						continue;
+					param = (presets[k] | (j ? LZMA_PRESET_EXTREME : 0)) |
+						(int64_t)(buf[c->off + 7] & 0xf) << 32;
+					found = !zcompress(c->kind, param, z->exp + c->expoff,
+							c->explen, buf + c->off, c->len, NULL);
+				}
+		}
+		if(!found) {
+			zraw(&nz, buf, c->off, c->len);
+			continue;
+		}
+		zgrow(&nz, c->explen);
+		memcpy(nz.exp + nz.expsize, z->exp + c->expoff, c->explen);
+		nz.expsize += c->explen;
+		zchunk_push(&nz, c->kind, c->off, c->len, c->explen);
+		nz.v[nz.n-1].param = param;
+		covered += c->len;
+	}
+	zfree(z);
+	*z = nz;
+	return covered;
+}
+
+/* recompress the expanded form exp by the chunk table of z onto out */
+__attribute__((unused))
+static int zrebuild(const struct zfile *z, const u_char *exp, struct zfile *out)
+{
+	const struct zchunk *c;
+	off_t expoff = 0, start;
+	size_t i;
+
+	for(i = 0; i < z->n; expoff += c->explen, i++) {
+		c = &z->v[i];
+		start = out->expsize;
+		if(c->kind == ZC_RAW) {
+			zgrow(out, c->len);
+			memcpy(out->exp + out->expsize, exp + expoff, c->len);
+			out->expsize += c->len;
+		} else if(zcompress(c->kind, c->param, exp + expoff, c->explen,
+				NULL, 0, out) != 0)
+			return -1;
+		if(out->expsize - start != c->len)
+			return -1;
+	}
+	return 0;
+}